@@ -0,0 +1,3161 @@
+/*!
+ *
+ * Receive and print the value of temperature and humidity from AM2321 sold by Akizuki-denshi.
+ *
+ * The command am2321 on libam2321 : the one-shot measurement, and the
+ * polling engine of the daemon mode with its outputs.
+ *
+ * @file am2321-cli.c
+ *
+ * @date 2014/08/22
+ * @author Kodai Tooi
+ * @version 1.0
+ */
+#define _GNU_SOURCE                 // sched_setaffinity()
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if !AM2321_STATIC
+  #include <netdb.h>
+#endif
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "am2321.h"
+#include "am2321-shm.h"
+//ユーザランドでも動くようにするための、関数・定数の再定義
+#define printk(...) fprintf(stderr, __VA_ARGS__)
+#define KERN_INFO ""
+#define KERN_NOTICE ""
+#define KERN_WARNING ""
+#define KERN_ERR ""
+
+#define AM2321_PIPELINE_DEPTH 4     // Max AM2321s measured at once on a bus. Keeps the waits under 3000.
+#define AM2321_EXPORTER_MAX_CLIENTS 16  // Max connections served by the exporter at once.
+#define AM2321_EXPORTER_REQUEST_MAX 2048 // Max length of the HTTP request header.
+#define AM2321_PUBLISH_RECORDS 58   // Records in a message of the publisher. 58 * 24 bytes fit in a datagram of MTU 1500.
+#define AM2321_PUBLISH_MESSAGES 64  // Messages of the publisher sent at once.
+#define AM2321_MQTT_PORT "1883"
+#define AM2321_MQTT_TOPIC "am2321"
+#define AM2321_MQTT_TOPIC_MAX 128
+#define AM2321_MQTT_KEEPALIVE 60    // Keep alive of the connection to the broker in seconds.
+#define AM2321_MQTT_TIMEOUT 1000000 // Timeout of the connect and the send to the broker. (= 1sec)
+#define AM2321_MQTT_RECONNECT 5000000 // Interval of the connections again to the broker. (= 5sec)
+#define AM2321_DISCOVER_TRIES 2     // Tries of discover_am2321() per AM2321.
+#define AM2321_QUEUE_SIZE 256       // Samples in the queue of a bus. Power of 2.
+#define AM2321_EVENT_SAMPLES ((uint64_t)-2) // data.u64 of the queues, or of the timer in the single thread build.
+#define TCA9548A_ID 0x70            // The first address of TCA9548A.
+#define TCA9548A_MAX_MUX 8          // TCA9548A can be 0x70 to 0x77 on a bus.
+#define TCA9548A_MAX_CHANNEL 8
+
+#if AM2321_ALLOC_CHECK
+/*
+ * Check of the allocations on the sample path. (make ALLOC_CHECK=1)
+ *
+ * malloc(), calloc(), realloc() and free() are wrapped to count the calls
+ * of each thread. The count must not change in the sweeps and the outputs
+ * of the samples, or the command aborts. The sessions, the queues and the
+ * buffers are all allocated before the first sweep.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread uint64_t am2321_allocs;  // Calls of malloc() family by the thread.
+static uint64_t am2321_alloc_checks;     // Sweeps and outputs checked.
+
+void *malloc(size_t size) {
+
+  am2321_allocs++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+
+  am2321_allocs++;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+
+  am2321_allocs++;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+
+  if (ptr != NULL) {
+    am2321_allocs++;
+  }
+  __libc_free(ptr);
+}
+
+/*!
+ * @brief Abort if the thread called malloc() family since the count.
+ *
+ * @param[in] allocs The count by count_allocs().
+ * @param[in] where  The name of the path checked.
+ */
+static void check_allocs(uint64_t allocs, const char *where) {
+
+  if (am2321_allocs != allocs) {
+    printk(KERN_ERR "am2321 : %llu allocations in %s.\n", (unsigned long long)(am2321_allocs - allocs), where);
+    abort();
+  }
+  __atomic_add_fetch(&am2321_alloc_checks, 1, __ATOMIC_RELAXED);
+}
+
+  #define count_allocs() am2321_allocs
+#else
+  #define count_allocs() 0
+  #define check_allocs(allocs, where) ((void)(allocs))
+#endif
+
+/*
+ * Prometheus exporter.
+ *
+ * The main thread serves GET /metrics in the text exposition format on the
+ * epoll of run_engine(). The samples are cached by output_am2321() through
+ * cache_exporter_am2321() on the main thread too, so a scrape never touches
+ * the bus, and the metrics need no lock.
+ */
+
+/*!
+ * The last sample of a sensor cached by the exporter.
+ */
+struct am2321_metric {
+
+  char register_data[8];
+  uint64_t realtime;        // Time of the frame is received. (CLOCK_REALTIME, nsec) 0 : No sample yet.
+  uint64_t failures;        // Count of the measurements failed after retries.
+};
+
+struct am2321_client {
+
+  int fd;                   // -1 : Not used.
+  size_t len;
+  char request[AM2321_EXPORTER_REQUEST_MAX];
+  char *response;
+  size_t response_len;
+  size_t sent;
+};
+
+struct am2321_exporter {
+
+  int fd;                   // The listening socket.
+  struct am2321 *sensors;
+  int nsensors;
+  struct am2321_metric *metrics;  // Written and read by the main thread only.
+  struct am2321_client clients[AM2321_EXPORTER_MAX_CLIENTS];
+};
+
+/*!
+ * @brief Open the exporter listening on the TCP port.
+ *
+ * @param[in] port     TCP port to listen.
+ * @param[in] sensors  The sensors to export.
+ * @param[in] nsensors Number of the sensors.
+ *
+ * @return The exporter, or NULL if failed.
+ */
+struct am2321_exporter *open_exporter_am2321(int port, struct am2321 *sensors, int nsensors) {
+
+  struct am2321_exporter *exporter;
+  struct sockaddr_in addr;
+  int i, on = 1;
+
+  if ((exporter = calloc(1, sizeof(struct am2321_exporter))) == NULL
+      || (exporter->metrics = calloc(nsensors, sizeof(struct am2321_metric))) == NULL) {
+    free(exporter);
+    return NULL;
+  }
+  exporter->sensors = sensors;
+  exporter->nsensors = nsensors;
+  for (i = 0; i < AM2321_EXPORTER_MAX_CLIENTS; i++) {
+    exporter->clients[i].fd = -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if ((exporter->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1
+      || setsockopt(exporter->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1
+      || bind(exporter->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+      || listen(exporter->fd, AM2321_EXPORTER_MAX_CLIENTS) == -1) {
+    printk(KERN_ERR "am2321 : Failed listen the port %d.\n", port);
+    if (exporter->fd != -1) {
+      close(exporter->fd);
+    }
+    free(exporter->metrics);
+    free(exporter);
+    return NULL;
+  }
+  return exporter;
+}
+
+/*!
+ * @brief Close the connection of the client.
+ */
+static void close_client_am2321(struct am2321_client *client) {
+
+  close(client->fd);
+  free(client->response);
+  client->fd = -1;
+  client->len = 0;
+  client->response = NULL;
+  client->response_len = 0;
+  client->sent = 0;
+}
+
+/*!
+ * @brief Close the exporter and all connections.
+ *
+ * @param[in] exporter The exporter.
+ */
+void close_exporter_am2321(struct am2321_exporter *exporter) {
+
+  int i;
+
+  for (i = 0; i < AM2321_EXPORTER_MAX_CLIENTS; i++) {
+    if (exporter->clients[i].fd != -1) {
+      close_client_am2321(&exporter->clients[i]);
+    }
+  }
+  close(exporter->fd);
+  free(exporter->metrics);
+  free(exporter);
+}
+
+/*!
+ * @brief Cache the result of the measurement for the exporter.
+ *
+ * @param[in,out] exporter    The exporter.
+ * @param[in]     am2321_data The data of received from AM2321.
+ * @param[in]     sensor      Index of the sensor.
+ * @param[in]     ret         Result of the measurement.
+ */
+void cache_exporter_am2321(struct am2321_exporter *exporter, struct am2321 *am2321_data, int sensor, int ret) {
+
+  struct am2321_metric *metric = &exporter->metrics[sensor];
+  uint64_t realtime = realtime_ns() - (monotonic_ns() - am2321_data->timestamp);
+
+  if (ret < 0) {
+    metric->failures++;
+  } else {
+    memcpy(metric->register_data, am2321_data->register_data, sizeof(metric->register_data));
+    metric->realtime = realtime;
+  }
+}
+
+/*!
+ * @brief Append the formatted string to the response, growing the buffer.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+static int append_response(char **buf, size_t *len, size_t *size, const char *fmt, ...) {
+
+  va_list ap;
+  int n;
+  char *grown;
+
+  for (;;) {
+    va_start(ap, fmt);
+    n = vsnprintf(*buf + *len, *size - *len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+      return -1;
+    }
+    if ((size_t)n < *size - *len) {
+      *len += n;
+      return 0;
+    }
+    if ((grown = realloc(*buf, *size * 2)) == NULL) {
+      return -1;
+    }
+    *buf = grown;
+    *size *= 2;
+  }
+}
+
+/*!
+ * @brief Format the metrics of all sensors in the text exposition format of Prometheus.
+ *
+ * @param[in]  exporter The exporter.
+ * @param[out] len      Length of the response.
+ *
+ * @return The HTTP response allocated by malloc(), or NULL if failed.
+ */
+char *format_exporter_am2321(struct am2321_exporter *exporter, size_t *len) {
+
+  static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+  } gauges[] = {
+    { "am2321_temperature_celsius", "gauge", "Temperature of the last sample." },
+    { "am2321_humidity_percent", "gauge", "Relative humidity of the last sample." },
+    { "am2321_discomfort_index", "gauge", "Discomfort index of the last sample." },
+    { "am2321_sample_timestamp_seconds", "gauge", "Time of the last sample." },
+    { "am2321_crc_errors_total", "counter", "Frames failed the CRC check." },
+    { "am2321_device_errors_total", "counter", "Error codes returned by AM2321." },
+    { "am2321_retries_total", "counter", "Retries of the measurement." },
+    { "am2321_failures_total", "counter", "Measurements failed after the retries." },
+    { "am2321_health_score", "gauge", "Health of AM2321 by the faults of the last measurements. 0 to 100." },
+    { "am2321_info", "gauge", "Model, version and device ID of AM2321." },
+  };
+  size_t body = 0, size = 4096, header;
+  char *buf, *response, label[128], value[AM2321_X10_LEN];
+  struct am2321_metric metric;
+  struct am2321 *sensor, data;
+  int g, i, code, temp, hum;
+
+  if ((buf = malloc(size)) == NULL) {
+    return NULL;
+  }
+  for (g = 0; g < (int)(sizeof(gauges) / sizeof(gauges[0])); g++) {
+    if (append_response(&buf, &body, &size, "# HELP %s %s\n# TYPE %s %s\n"
+          , gauges[g].name, gauges[g].help, gauges[g].name, gauges[g].type) == -1) {
+      free(buf);
+      return NULL;
+    }
+    for (i = 0; i < exporter->nsensors; i++) {
+      sensor = &exporter->sensors[i];
+      metric = exporter->metrics[i];
+      snprintf(label, sizeof(label), "sensor=\"%s\",bus=\"%d\",address=\"0x%02x\"", sensor->name, sensor->bus, sensor->address);
+
+      if (g <= 3 && metric.realtime == 0) {
+        continue;
+      }
+      memcpy(data.register_data, metric.register_data, sizeof(data.register_data));
+      temp = calc_temp_x10(&data);
+      hum = calc_hum_x10(&data);
+      switch (g) {
+        case 0:
+        case 1:
+        case 2:
+          format_x10(value, g == 0 ? temp : g == 1 ? hum : discomfort_x10(temp, hum));
+          if (append_response(&buf, &body, &size, "%s{%s} %s\n", gauges[g].name, label, value) == -1) {
+            free(buf);
+            return NULL;
+          }
+          break;
+        case 3:
+          if (append_response(&buf, &body, &size, "%s{%s} %llu.%03llu\n", gauges[g].name, label
+                , (unsigned long long)(metric.realtime / 1000000000), (unsigned long long)(metric.realtime / 1000000 % 1000)) == -1) {
+            free(buf);
+            return NULL;
+          }
+          break;
+        case 8:
+          if (append_response(&buf, &body, &size, "%s{%s} %d\n", gauges[g].name, label
+                , AM2321_HEALTH_MAX - __atomic_load_n(&sensor->health.penalty, __ATOMIC_RELAXED)) == -1) {
+            free(buf);
+            return NULL;
+          }
+          break;
+        case 9:
+          if (__atomic_load_n(&sensor->discovered, __ATOMIC_ACQUIRE)
+              && append_response(&buf, &body, &size, "%s{%s,model=\"0x%04x\",version=\"0x%02x\",id=\"0x%08x\"} 1\n"
+                , gauges[g].name, label, sensor->model, sensor->version, sensor->device_id) == -1) {
+            free(buf);
+            return NULL;
+          }
+          break;
+        case 5:
+          for (code = 0; code < 8; code++) {
+            uint64_t count = __atomic_load_n(&sensor->device_errors[code], __ATOMIC_RELAXED);
+
+            if (count != 0 && append_response(&buf, &body, &size, "%s{%s,code=\"0x%02x\"} %llu\n"
+                  , gauges[g].name, label, 0x80 | code, (unsigned long long)count) == -1) {
+              free(buf);
+              return NULL;
+            }
+          }
+          break;
+        default:
+          if (append_response(&buf, &body, &size, "%s{%s} %llu\n", gauges[g].name, label
+                , (unsigned long long)(g == 4 ? __atomic_load_n(&sensor->crc_errors, __ATOMIC_RELAXED)
+                  : g == 6 ? __atomic_load_n(&sensor->retries, __ATOMIC_RELAXED) : metric.failures)) == -1) {
+            free(buf);
+            return NULL;
+          }
+          break;
+      }
+    }
+  }
+
+#if AM2321_TIMING
+  if (append_response(&buf, &body, &size, "# HELP am2321_phase_seconds Latency of the phases of the measurement.\n# TYPE am2321_phase_seconds summary\n") == -1) {
+    free(buf);
+    return NULL;
+  }
+  for (g = 0; g < AM2321_PHASES; g++) {
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t count, sum;
+
+    summary_timing_am2321(g, &count, &sum);
+    for (i = 0; i < (int)(sizeof(quantiles) / sizeof(quantiles[0])); i++) {
+      if (append_response(&buf, &body, &size, "am2321_phase_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n"
+            , phase_name_am2321(g), quantiles[i], quantile_timing_am2321(g, quantiles[i]) / 1e9) == -1) {
+        free(buf);
+        return NULL;
+      }
+    }
+    if (append_response(&buf, &body, &size, "am2321_phase_seconds_sum{phase=\"%s\"} %.9f\nam2321_phase_seconds_count{phase=\"%s\"} %llu\n"
+          , phase_name_am2321(g), sum / 1e9, phase_name_am2321(g), (unsigned long long)count) == -1) {
+      free(buf);
+      return NULL;
+    }
+  }
+#endif
+  header = snprintf(label, sizeof(label), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body);
+  if ((response = malloc(header + body)) != NULL) {
+    memcpy(response, label, header);
+    memcpy(response + header, buf, body);
+    *len = header + body;
+  }
+  free(buf);
+  return response;
+}
+
+/*!
+ * @brief Serve the event of the exporter on epoll.
+ *
+ * @param[in,out] exporter The exporter.
+ * @param[in]     epfd     The epoll.
+ * @param[in]     event    The event. data.u64 is 0 for the listening socket, or 1 + index of the client.
+ */
+void serve_exporter_am2321(struct am2321_exporter *exporter, int epfd, struct epoll_event *event) {
+
+  static const char not_found[] = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+  struct am2321_client *client;
+  struct epoll_event ev;
+  ssize_t n;
+  int fd, i;
+
+  if (event->data.u64 == 0) {
+    while ((fd = accept(exporter->fd, NULL, NULL)) != -1) {
+      fcntl(fd, F_SETFL, O_NONBLOCK);
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      for (i = 0; i < AM2321_EXPORTER_MAX_CLIENTS && exporter->clients[i].fd != -1; i++);
+      if (i == AM2321_EXPORTER_MAX_CLIENTS) {
+        close(fd);
+        continue;
+      }
+      exporter->clients[i].fd = fd;
+      ev.events = EPOLLIN;
+      ev.data.u64 = 1 + i;
+      epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    return;
+  }
+
+  client = &exporter->clients[event->data.u64 - 1];
+  if (client->response == NULL) {
+    n = read(client->fd, client->request + client->len, sizeof(client->request) - 1 - client->len);
+    if (n <= 0 || (client->len += n) == sizeof(client->request) - 1) {
+      close_client_am2321(client);
+      return;
+    }
+    client->request[client->len] = '\0';
+    if (strstr(client->request, "\r\n\r\n") == NULL && strstr(client->request, "\n\n") == NULL) {
+      return;
+    }
+    if (strncmp(client->request, "GET /metrics ", 13) == 0 || strncmp(client->request, "GET / ", 6) == 0) {
+      client->response = format_exporter_am2321(exporter, &client->response_len);
+    } else if ((client->response = malloc(sizeof(not_found) - 1)) != NULL) {
+      memcpy(client->response, not_found, sizeof(not_found) - 1);
+      client->response_len = sizeof(not_found) - 1;
+    }
+    if (client->response == NULL) {
+      close_client_am2321(client);
+      return;
+    }
+    ev.events = EPOLLOUT;
+    ev.data.u64 = event->data.u64;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev);
+  }
+
+  n = write(client->fd, client->response + client->sent, client->response_len - client->sent);
+  if (n == -1 || (client->sent += n) == client->response_len) {
+    close_client_am2321(client);
+  }
+}
+
+/*
+ * Publisher of the samples to the network.
+ *
+ * The records of AM2321_OUTPUT_BINARY are packed into the messages of the
+ * publisher by publish_am2321() on the main thread, and all messages of the
+ * sweep are sent at once by flush_publisher_am2321() after the sweep of all
+ * buses :
+ *
+ *   - UDP : Each message is a datagram of up to AM2321_PUBLISH_RECORDS
+ *           records, and the datagrams are sent by one sendmmsg(2) on the
+ *           connected socket.
+ *   - MQTT : Each message is PUBLISH of QoS0 to the topic, and the messages
+ *           are sent by one sendmsg(2) on the persistent connection to the
+ *           broker. The connection is kept alive by PINGREQ, and made again
+ *           after AM2321_MQTT_RECONNECT when it is lost.
+ *
+ * The records are gathered from the messages by the iovecs, in place, and
+ * all buffers are allocated once by open_publisher_am2321(), so the cost
+ * per sample is the copy of the record only.
+ */
+
+/*!
+ * The message of the publisher.
+ */
+struct am2321_message {
+
+  char header[5];           // Fixed header of PUBLISH. (MQTT only)
+  int nrecords;
+  struct am2321_output_record records[AM2321_PUBLISH_RECORDS];
+};
+
+struct am2321_publisher {
+
+  int fd;                   // -1 : Not connected to the broker.
+  int mqtt;                 // Publish by MQTT, not by UDP.
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  char topic[2 + AM2321_MQTT_TOPIC_MAX];  // Topic name of PUBLISH, after its length.
+  size_t topic_len;
+  uint64_t sent_at;         // Time of the last packet sent to the broker. (CLOCK_MONOTONIC, nsec)
+  uint64_t connected_at;    // Time of the last connection tried.
+  uint64_t buffered_at;     // Time of the first record in the messages.
+  int failing;              // The last send failed, not to report the failures of every sweep.
+  uint64_t dropped;         // Records not sent.
+  int nmessages;            // Messages filled in the sweep.
+  struct am2321_message messages[AM2321_PUBLISH_MESSAGES];
+  struct mmsghdr msgs[AM2321_PUBLISH_MESSAGES];
+  struct iovec iov[AM2321_PUBLISH_MESSAGES * 3];
+};
+
+/*!
+ * @brief Connect to the broker of MQTT, and wait for CONNACK.
+ *
+ * @param[in,out] publisher The publisher.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+static int connect_mqtt_am2321(struct am2321_publisher *publisher) {
+
+  struct timeval timeout = { AM2321_MQTT_TIMEOUT / 1000000, AM2321_MQTT_TIMEOUT % 1000000 };
+  unsigned char packet[64], connack[4];
+  size_t len, id_len;
+  int on = 1;
+
+  publisher->connected_at = monotonic_ns();
+  if ((publisher->fd = socket(publisher->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+    return -1;
+  }
+  // The timeouts bound the send and the connect, which are on the main thread.
+  setsockopt(publisher->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  setsockopt(publisher->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  // The messages are coalesced by the publisher already.
+  setsockopt(publisher->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  // CONNECT of MQTT 3.1.1 with the clean session, and the client ID of "am2321-<pid>".
+  id_len = snprintf((char *)packet + 14, sizeof(packet) - 14, "am2321-%d", (int)getpid());
+  len = 12 + id_len;
+  memcpy(packet, "\x10\x00\x00\x04MQTT\x04\x02", 10);
+  packet[1] = len;
+  packet[10] = AM2321_MQTT_KEEPALIVE >> 8;
+  packet[11] = AM2321_MQTT_KEEPALIVE & 0xff;
+  packet[12] = id_len >> 8;
+  packet[13] = id_len & 0xff;
+  if (connect(publisher->fd, (struct sockaddr *)&publisher->addr, publisher->addrlen) == -1
+      || send(publisher->fd, packet, 2 + len, MSG_NOSIGNAL) != (ssize_t)(2 + len)
+      || recv(publisher->fd, connack, sizeof(connack), MSG_WAITALL) != sizeof(connack)
+      || connack[0] != 0x20 || connack[3] != 0) {
+    close(publisher->fd);
+    publisher->fd = -1;
+    return -1;
+  }
+  publisher->sent_at = monotonic_ns();
+  return 0;
+}
+
+/*!
+ * @brief Resolve the address of the destination of the publisher.
+ *
+ * The numeric addresses are parsed directly. The names are resolved by
+ * getaddrinfo() only in the dynamic build, which the static one links
+ * without the NSS of glibc.
+ *
+ * @param[out] publisher The publisher to set the address.
+ * @param[in]  host      Host name, or the numeric address of IPv4 or IPv6.
+ * @param[in]  port      Port number.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+static int resolve_publisher_am2321(struct am2321_publisher *publisher, const char *host, const char *port) {
+
+  struct sockaddr_in *in = (struct sockaddr_in *)&publisher->addr;
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&publisher->addr;
+  char *end;
+  long number = strtol(port, &end, 10);
+#if !AM2321_STATIC
+  struct addrinfo hints, *res;
+#endif
+
+  memset(&publisher->addr, 0, sizeof(publisher->addr));
+  if (end != port && *end == '\0' && 0 < number && number <= 65535) {
+    if (inet_pton(AF_INET, host, &in->sin_addr) == 1) {
+      in->sin_family = AF_INET;
+      in->sin_port = htons(number);
+      publisher->addrlen = sizeof(struct sockaddr_in);
+      return 0;
+    }
+    if (inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+      in6->sin6_family = AF_INET6;
+      in6->sin6_port = htons(number);
+      publisher->addrlen = sizeof(struct sockaddr_in6);
+      return 0;
+    }
+  }
+#if AM2321_STATIC
+  printk(KERN_ERR "am2321 : Only the numeric address and port are supported in the static build. (%s:%s)\n", host, port);
+  return -1;
+#else
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = publisher->mqtt ? SOCK_STREAM : SOCK_DGRAM;
+  if (getaddrinfo(host, port, &hints, &res) != 0) {
+    printk(KERN_ERR "am2321 : Failed resolve %s.\n", host);
+    return -1;
+  }
+  memcpy(&publisher->addr, res->ai_addr, res->ai_addrlen);
+  publisher->addrlen = res->ai_addrlen;
+  freeaddrinfo(res);
+  return 0;
+#endif
+}
+
+/*!
+ * @brief Open the publisher.
+ *
+ * @param[in] target HOST:PORT of UDP, or HOST[:PORT][/TOPIC] of the broker of MQTT.
+ * @param[in] mqtt   Publish by MQTT, not by UDP.
+ *
+ * @return The publisher, or NULL if failed.
+ */
+struct am2321_publisher *open_publisher_am2321(const char *target, int mqtt) {
+
+  struct am2321_publisher *publisher;
+  char host[256], *port, *topic;
+  int i;
+
+  if (strlen(target) >= sizeof(host)) {
+    printk(KERN_ERR "am2321 : Invalid destination %s.\n", target);
+    return NULL;
+  }
+  strcpy(host, target);
+  if ((topic = strchr(host, '/')) != NULL) {
+    *topic++ = '\0';
+  }
+  if ((port = strrchr(host, ':')) != NULL) {
+    *port++ = '\0';
+  }
+  if ((!mqtt && (port == NULL || topic != NULL)) || (topic != NULL && (*topic == '\0' || strlen(topic) > AM2321_MQTT_TOPIC_MAX))) {
+    printk(KERN_ERR "am2321 : Invalid destination %s.\n", target);
+    return NULL;
+  }
+
+  if ((publisher = calloc(1, sizeof(struct am2321_publisher))) == NULL) {
+    return NULL;
+  }
+  publisher->mqtt = mqtt;
+  if (resolve_publisher_am2321(publisher, host, port != NULL ? port : AM2321_MQTT_PORT) == -1) {
+    free(publisher);
+    return NULL;
+  }
+  if (topic == NULL) {
+    topic = AM2321_MQTT_TOPIC;
+  }
+  publisher->topic_len = 2 + strlen(topic);
+  publisher->topic[0] = (publisher->topic_len - 2) >> 8;
+  publisher->topic[1] = (publisher->topic_len - 2) & 0xff;
+  memcpy(publisher->topic + 2, topic, publisher->topic_len - 2);
+  for (i = 0; i < AM2321_PUBLISH_MESSAGES; i++) {
+    publisher->messages[i].header[0] = 0x30;
+  }
+
+  if (mqtt) {
+    if (connect_mqtt_am2321(publisher) == -1) {
+      printk(KERN_ERR "am2321 : Failed connect to the broker %s.\n", target);
+      free(publisher);
+      return NULL;
+    }
+  } else if ((publisher->fd = socket(publisher->addr.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1
+      || connect(publisher->fd, (struct sockaddr *)&publisher->addr, publisher->addrlen) == -1) {
+    printk(KERN_ERR "am2321 : Failed open the socket to %s.\n", target);
+    if (publisher->fd != -1) {
+      close(publisher->fd);
+    }
+    free(publisher);
+    return NULL;
+  }
+  return publisher;
+}
+
+/*!
+ * @brief Report the failure of the send once, until it is sent again.
+ */
+static void fail_publisher_am2321(struct am2321_publisher *publisher, const char *what) {
+
+  if (!publisher->failing) {
+    printk(KERN_ERR "am2321 : Failed %s. (%s)\n", what, strerror(errno));
+  }
+  publisher->failing = 1;
+}
+
+/*!
+ * @brief Send the messages of PUBLISH to the broker, and keep the connection alive.
+ *
+ * @param[in,out] publisher The publisher.
+ * @param[in]     n         Number of the messages.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+static int send_mqtt_am2321(struct am2321_publisher *publisher, int n) {
+
+  static const char pingreq[2] = { (char)0xc0, 0x00 };
+  struct am2321_message *message;
+  struct iovec *iov = publisher->iov;
+  struct msghdr msg;
+  uint64_t now = monotonic_ns();
+  size_t remaining, header;
+  char discard[64];
+  ssize_t ret;
+  int i, niov = 0;
+
+  if (publisher->fd == -1) {
+    if (now < publisher->connected_at + AM2321_MQTT_RECONNECT * 1000ULL || connect_mqtt_am2321(publisher) == -1) {
+      errno = ENOTCONN;
+      return -1;
+    }
+    printk(KERN_NOTICE "am2321 : Connected to the broker again.\n");
+  }
+  // PINGRESP and the other packets from the broker are thrown away. 0 : The broker closed the connection.
+  while ((ret = recv(publisher->fd, discard, sizeof(discard), MSG_DONTWAIT)) > 0);
+  if (ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+    goto lost;
+  }
+
+  for (i = 0; i < n; i++) {
+    message = &publisher->messages[i];
+    remaining = publisher->topic_len + message->nrecords * sizeof(struct am2321_output_record);
+    // Remaining length of the fixed header, in the variable length encoding.
+    for (header = 1; ; remaining >>= 7) {
+      message->header[header++] = (remaining & 0x7f) | (remaining > 0x7f ? 0x80 : 0);
+      if (remaining <= 0x7f) {
+        break;
+      }
+    }
+    iov[niov].iov_base = message->header;
+    iov[niov++].iov_len = header;
+    iov[niov].iov_base = publisher->topic;
+    iov[niov++].iov_len = publisher->topic_len;
+    iov[niov].iov_base = message->records;
+    iov[niov++].iov_len = message->nrecords * sizeof(struct am2321_output_record);
+  }
+  if (n == 0) {
+    if (now < publisher->sent_at + AM2321_MQTT_KEEPALIVE * 500000000ULL) {
+      return 0;
+    }
+    iov[niov].iov_base = (void *)pingreq;
+    iov[niov++].iov_len = sizeof(pingreq);
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = niov;
+  while (msg.msg_iovlen > 0) {
+    if ((ret = sendmsg(publisher->fd, &msg, MSG_NOSIGNAL)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      goto lost;
+    }
+    // The rest of the short send.
+    for (; msg.msg_iovlen > 0 && (size_t)ret >= msg.msg_iov->iov_len; msg.msg_iov++, msg.msg_iovlen--) {
+      ret -= msg.msg_iov->iov_len;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + ret;
+      msg.msg_iov->iov_len -= ret;
+    }
+  }
+  publisher->sent_at = now;
+  return 0;
+
+lost:
+  // The PUBLISH sent partially breaks the stream, so the connection is made again.
+  close(publisher->fd);
+  publisher->fd = -1;
+  return -1;
+}
+
+/*!
+ * @brief Send all messages of the sweep.
+ *
+ * @param[in,out] publisher The publisher.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int flush_publisher_am2321(struct am2321_publisher *publisher) {
+
+  int i, n = publisher->nmessages, sent = 0, ret = 0;
+
+  if (n < AM2321_PUBLISH_MESSAGES && publisher->messages[n].nrecords != 0) {
+    n++;
+  }
+  if (publisher->mqtt) {
+    if ((ret = send_mqtt_am2321(publisher, n)) == 0) {
+      sent = n;
+    } else {
+      fail_publisher_am2321(publisher, "publish to the broker");
+    }
+  } else {
+    for (i = 0; i < n; i++) {
+      publisher->iov[i].iov_base = publisher->messages[i].records;
+      publisher->iov[i].iov_len = publisher->messages[i].nrecords * sizeof(struct am2321_output_record);
+      publisher->msgs[i].msg_hdr.msg_iov = &publisher->iov[i];
+      publisher->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (sent < n) {
+      if ((ret = sendmmsg(publisher->fd, publisher->msgs + sent, n - sent, 0)) == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        fail_publisher_am2321(publisher, "send the datagrams");
+        break;
+      }
+      sent += ret;
+      ret = 0;
+    }
+  }
+  if (ret == 0 && n != 0) {
+    publisher->failing = 0;
+  }
+  for (i = 0; i < n; i++) {
+    if (i >= sent) {
+      publisher->dropped += publisher->messages[i].nrecords;
+    }
+    publisher->messages[i].nrecords = 0;
+  }
+  publisher->nmessages = 0;
+  return ret == 0 ? 0 : -1;
+}
+
+/*!
+ * @brief Append the measured values of AM2321 to the messages of the publisher.
+ *
+ * The messages are sent when all of them are full, or by flush_publisher_am2321() after the sweep.
+ *
+ * @param[in,out] publisher   The publisher.
+ * @param[in]     am2321_data The data of received from AM2321.
+ * @param[in]     sensor      Index of the sensor.
+ */
+void publish_am2321(struct am2321_publisher *publisher, struct am2321 *am2321_data, int sensor) {
+
+  struct am2321_message *message = &publisher->messages[publisher->nmessages];
+
+  if (publisher->nmessages == 0 && message->nrecords == 0) {
+    publisher->buffered_at = monotonic_ns();
+  }
+  fill_record_am2321(&message->records[message->nrecords++], am2321_data, sensor);
+  if (message->nrecords == AM2321_PUBLISH_RECORDS && ++publisher->nmessages == AM2321_PUBLISH_MESSAGES) {
+    flush_publisher_am2321(publisher);
+  }
+}
+
+/*!
+ * @brief Send the rest of the messages, and close the publisher.
+ *
+ * @param[in] publisher The publisher.
+ */
+void close_publisher_am2321(struct am2321_publisher *publisher) {
+
+  static const char disconnect[2] = { (char)0xe0, 0x00 };
+
+  flush_publisher_am2321(publisher);
+  if (publisher->dropped != 0) {
+    printk(KERN_WARNING "am2321 : %llu samples are not published.\n", (unsigned long long)publisher->dropped);
+  }
+  if (publisher->fd != -1) {
+    if (publisher->mqtt) {
+      send(publisher->fd, disconnect, sizeof(disconnect), MSG_NOSIGNAL);
+    }
+    close(publisher->fd);
+  }
+  free(publisher);
+}
+
+static volatile sig_atomic_t am2321_stop = 0;
+
+static void stop_handler(int signum) {
+
+  if (signum != SIGUSR1) {
+    am2321_stop = 1;
+  }
+}
+
+/*!
+ * @brief Add microseconds to the time.
+ *
+ * @param[in,out] ts   The time to add to.
+ * @param[in]     usec Microseconds to add.
+ */
+void add_timespec(struct timespec *ts, long usec) {
+
+  ts->tv_sec += usec / 1000000;
+  ts->tv_nsec += (usec % 1000000) * 1000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+/*!
+ * @brief Compare two times.
+ *
+ * @return a < b : negative, a == b : 0, a > b : positive
+ */
+int cmp_timespec(const struct timespec *a, const struct timespec *b) {
+
+  if (a->tv_sec != b->tv_sec) {
+    return a->tv_sec < b->tv_sec ? -1 : 1;
+  }
+  if (a->tv_nsec != b->tv_nsec) {
+    return a->tv_nsec < b->tv_nsec ? -1 : 1;
+  }
+  return 0;
+}
+
+/*!
+ * @brief Sleep until the next tick of the fixed-rate schedule.
+ *
+ * The deadline advances from the previous deadline, not from the time of
+ * waking up, so the schedule does not drift by the time of measurement.
+ * When the deadline was already missed, the missed ticks are skipped
+ * instead of being run back to back.
+ *
+ * The sleep is woken up by stop_fd, which stays readable once written, so
+ * the stop requested during the sweep is not lost as a signal would be.
+ *
+ * @param[in,out] next     The deadline of the previous tick. Set to the deadline of this tick.
+ * @param[in]     interval Interval of the ticks in microseconds.
+ * @param[in]     stop_fd  eventfd written to stop.
+ *
+ * @return Successed : 0, Interrupted by stop request or failed : -1
+ */
+int sleep_until_next(struct timespec *next, long interval, int stop_fd) {
+
+  struct timespec now, timeout;
+  struct pollfd pfd;
+  int ret;
+
+  add_timespec(next, interval);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  while (cmp_timespec(next, &now) <= 0) {
+    add_timespec(next, interval);
+  }
+
+  pfd.fd = stop_fd;
+  pfd.events = POLLIN;
+  // The timeout of ppoll() is relative, so it is waited again until the deadline.
+  while (cmp_timespec(next, &now) > 0 && !am2321_stop) {
+    timeout.tv_sec = next->tv_sec - now.tv_sec;
+    timeout.tv_nsec = next->tv_nsec - now.tv_nsec;
+    if (timeout.tv_nsec < 0) {
+      timeout.tv_sec--;
+      timeout.tv_nsec += 1000000000;
+    }
+    if ((ret = ppoll(&pfd, 1, &timeout, NULL)) > 0) {
+      return -1;
+    }
+    if (ret == -1 && errno != EINTR) {
+      printk(KERN_ERR "am2321 : Failed sleep until the next sweep.\n");
+      return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  }
+  return am2321_stop ? -1 : 0;
+}
+
+/*!
+ * TCA9548A (I2C mux) in front of AM2321s.
+ */
+struct tca9548a {
+
+  int address;
+  I2CSlave *i2c_slave;
+  int channel;          // Selected channel. -1 : No channel is selected.
+};
+
+struct am2321_engine;
+
+/*!
+ * Plans of AM2321 in a sweep, by its health. See plan_bus_am2321().
+ */
+enum am2321_plan {
+  AM2321_PLAN_SKIP = 0,     // In the backoff of the failures, or measured already.
+  AM2321_PLAN_NOW,          // Healthy. Measured first.
+  AM2321_PLAN_LATER,        // Flaky or quarantined. Measured one by one after the healthy ones.
+};
+
+/*!
+ * The sensors on an I2C bus, which are polled by a worker thread.
+ */
+struct am2321_bus {
+
+  int bus;
+  struct am2321 **sensors;  // Sorted by mux and channel.
+  char *plan;               // AM2321_PLAN_* of each sensor in the sweep. See plan_bus_am2321().
+  int nsensors;
+  struct tca9548a mux[TCA9548A_MAX_MUX];
+  int nmux;
+  int rdwr_fd;              // /dev/i2c-<bus> for I2C_RDWR. -1 : Not used. See sweep_bus_batched().
+  unsigned long funcs;      // Functionality of the adapter. (I2C_FUNCS)
+  int lock_fd;              // /dev/i2c-<bus> for the bus lock. -1 : Not locked. See open_lock_am2321().
+#if !AM2321_SINGLE_THREAD
+  pthread_t thread;
+  struct am2321_queue *queue;     // Samples to the main thread.
+  int queued;               // Samples queued in the sweep, not notified yet.
+#endif
+  struct am2321_engine *engine;
+};
+
+/*!
+ * The polling engine, which owns the sessions to all AM2321s.
+ */
+struct am2321_engine {
+
+  struct am2321 *sensors;   // The pool of the sessions. See reserve_engine().
+  int nsensors;
+  int capacity;
+  struct am2321 **order;    // Sensors sorted by bus, mux and channel.
+  char *plan;               // Plans of the sweeps of all buses, in the order.
+  struct am2321_bus *buses;
+  int nbuses;
+  int format;
+  int pipelined;            // Interleave the steps of AM2321s on a bus. See sweep_bus_pipelined().
+  int rdwr;                 // Batch the transfers of AM2321s on a bus by I2C_RDWR. See sweep_bus_batched().
+  int variant;              // AM2321_VARIANT_* of the sensors without the model in the config.
+  int lock;                 // Share the buses with the other I2C clients by the bus lock. See open_lock_am2321().
+  long interval;            // Interval of sweep in microseconds.
+  int count;                // Number of sweeps. 0 : Until SIGINT or SIGTERM.
+  int running;              // Number of running workers.
+  int *cpus;                // CPUs to pin the workers to, in the order of the buses. NULL : Not pinned.
+  int ncpus;
+  int priority;             // Priority of SCHED_FIFO of the workers. 0 : SCHED_OTHER.
+  int event_fd;             // eventfd to notify the main thread of the samples queued.
+  int stop_fd;              // eventfd to stop the workers sleeping in sleep_until_next().
+  struct am2321 *samples;   // The last samples output, by the main thread. (Copy of sensors)
+  int quiet;                // Do not print the values.
+  struct am2321_ring *ring; // Publish the samples to. NULL : Not published.
+  struct am2321_capture *capture; // Capture the raw frames to. NULL : Not captured.
+  struct am2321_history *history; // Append the values to. NULL : No history.
+  uint32_t *last;           // The values last printed of each sensor, for -u. NULL : All values are printed.
+  struct am2321_writer *writer;   // Stream the values to. NULL : print_am2321().
+  struct am2321_exporter *exporter; // Serve the metrics by. NULL : Not served.
+  struct am2321_publisher *publisher; // Publish the samples by. NULL : Not published.
+  struct am2321_stats *stats;     // Aggregates of each sensor for the writer. NULL : Not aggregated.
+  uint64_t window;          // Length of the window of the aggregates in nanoseconds. 0 : Not written.
+  int deadband;             // Deadband of 10 times to forward the samples. 0 : Not forwarded.
+};
+
+/*!
+ * @brief Allocate the pool of the sessions of the engine.
+ *
+ * The pool is allocated once for all AM2321s in the config, and never
+ * after open_engine().
+ *
+ * @param[in,out] engine   The engine.
+ * @param[in]     capacity Number of AM2321s in the pool.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int reserve_engine(struct am2321_engine *engine, int capacity) {
+
+  struct am2321 *sensors;
+
+  if (capacity <= engine->capacity) {
+    return 0;
+  }
+  if ((sensors = realloc(engine->sensors, sizeof(struct am2321) * capacity)) == NULL) {
+    return -1;
+  }
+  engine->sensors = sensors;
+  engine->capacity = capacity;
+
+  return 0;
+}
+
+/*!
+ * @brief Find the variant of the sensor by the name of its descriptor.
+ *
+ * @param[in] name Name of the model, e.g. am2320.
+ *
+ * @return AM2321_VARIANT_*, or -1 if unknown.
+ */
+int find_variant_am2321(const char *name) {
+
+  int i;
+
+  for (i = 0; i < AM2321_VARIANTS; i++) {
+    if (strcmp(name, am2321_descriptors[i].name) == 0) {
+      return i;
+    }
+  }
+  printk(KERN_ERR "am2321 : Unknown model %s.\n", name);
+  return -1;
+}
+
+/*!
+ * @brief Add AM2321 to the engine.
+ *
+ * @param[in,out] engine      The engine.
+ * @param[in]     name        Name of AM2321. Only [A-Za-z0-9_.-], because it is
+ *                            written without escape in every output format.
+ * @param[in]     bus         Number of I2C bus.
+ * @param[in]     address     I2C slave address of AM2321.
+ * @param[in]     mux_address I2C slave address of TCA9548A. -1 : No mux.
+ * @param[in]     mux_channel Channel of TCA9548A.
+ * @param[in]     variant     AM2321_VARIANT_*
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int add_sensor_engine(struct am2321_engine *engine, const char *name, int bus, int address, int mux_address, int mux_channel, int variant) {
+
+  struct am2321 *am2321_data;
+
+  if (name[strspn(name, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_.-")] != '\0') {
+    printk(KERN_ERR "am2321 : Invalid name %s. Use only [A-Za-z0-9_.-].\n", name);
+    return -1;
+  }
+  if (mux_address >= 0 && (mux_channel < 0 || TCA9548A_MAX_CHANNEL <= mux_channel)) {
+    printk(KERN_ERR "am2321 : Invalid channel %d of TCA9548A for %s.\n", mux_channel, name);
+    return -1;
+  }
+  if (engine->nsensors == engine->capacity && reserve_engine(engine, engine->capacity == 0 ? 1 : engine->capacity * 2) == -1) {
+    return -1;
+  }
+
+  am2321_data = &engine->sensors[engine->nsensors++];
+  memset(am2321_data, 0, sizeof(struct am2321));
+  am2321_data->bus = bus;
+  am2321_data->address = address;
+  am2321_data->mux_address = mux_address;
+  am2321_data->mux_channel = mux_channel;
+  am2321_data->variant = variant;
+  snprintf(am2321_data->name, sizeof(am2321_data->name), "%s", name);
+
+  return 0;
+}
+
+/*!
+ * @brief Find the sensor at the bus, the address and the channel of the mux in the engine.
+ *
+ * @return The sensor, or NULL if not found.
+ */
+static struct am2321 *find_sensor_engine(struct am2321_engine *engine, int bus, int address, int mux_address, int mux_channel) {
+
+  struct am2321 *am2321_data;
+  int i;
+
+  for (i = 0; i < engine->nsensors; i++) {
+    am2321_data = &engine->sensors[i];
+    if (am2321_data->bus == bus && am2321_data->address == address
+        && am2321_data->mux_address == mux_address && (mux_address < 0 || am2321_data->mux_channel == mux_channel)) {
+      return am2321_data;
+    }
+  }
+  return NULL;
+}
+
+/*!
+ * @brief Load the config of the sensors to the engine.
+ *
+ * Each line of the config is one AM2321 :
+ *
+ *   <name> <bus> <address> [<mux address> <mux channel>] [<model>]
+ *
+ * The name is made of [A-Za-z0-9_.-].
+ * The model is the name of the descriptor, e.g. am2320. (default engine->variant)
+ * Empty lines and lines beginning with '#' are ignored. The same AM2321 in
+ * two lines is rejected, because the two sessions would collide on it.
+ *
+ * @param[in,out] engine The engine.
+ * @param[in]     path   Path of the config.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int load_config_engine(struct am2321_engine *engine, const char *path) {
+
+  FILE *fp;
+  char line[256], name[32], address[16], mux_address[16], mux_channel[16], model[16];
+  int bus, variant, n, lineno = 0, ret = 0, addr, mux, channel;
+  struct am2321 *found;
+
+  if ((fp = fopen(path, "r")) == NULL) {
+    printk(KERN_ERR "am2321 : Failed open the config %s.\n", path);
+    return -1;
+  }
+  // The pool is sized by the lines at first.
+  for (n = 0; fgets(line, sizeof(line), fp) != NULL; n++);
+  if (reserve_engine(engine, engine->nsensors + n) == -1) {
+    fclose(fp);
+    return -1;
+  }
+  rewind(fp);
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    lineno++;
+    n = sscanf(line, "%31s %d %15s %15s %15s %15s", name, &bus, address, mux_address, mux_channel, model);
+    if (n <= 0 || name[0] == '#') {
+      continue;
+    }
+    variant = engine->variant;
+    if (n < 3 || (n % 2 == 0 && (variant = find_variant_am2321(n == 4 ? mux_address : model)) == -1)) {
+      printk(KERN_ERR "am2321 : Invalid config at %s:%d.\n", path, lineno);
+      ret = -1;
+      break;
+    }
+    addr = (int)strtol(address, NULL, 0);
+    mux = 5 <= n ? (int)strtol(mux_address, NULL, 0) : -1;
+    channel = 5 <= n ? (int)strtol(mux_channel, NULL, 0) : -1;
+    if ((found = find_sensor_engine(engine, bus, addr, mux, channel)) != NULL) {
+      printk(KERN_ERR "am2321 : Duplicated AM2321 at %s:%d, which is %s already.\n", path, lineno, found->name);
+      ret = -1;
+      break;
+    }
+    if (add_sensor_engine(engine, name, bus, addr, mux, channel, variant) == -1) {
+      ret = -1;
+      break;
+    }
+  }
+  fclose(fp);
+
+  return ret;
+}
+
+static int cmp_sensor(const void *a, const void *b) {
+
+  const struct am2321 *x = *(struct am2321 * const *)a;
+  const struct am2321 *y = *(struct am2321 * const *)b;
+
+  if (x->bus != y->bus) {
+    return x->bus - y->bus;
+  }
+  if (x->mux_address != y->mux_address) {
+    return x->mux_address - y->mux_address;
+  }
+  return x->mux_channel - y->mux_channel;
+}
+
+/*!
+ * @brief Write the channels of TCA9548As to connect AM2321, except the ones selected already.
+ */
+static int write_mux_am2321(struct am2321_bus *bus, struct am2321 *am2321_data) {
+
+  char data;
+  int i;
+
+  for (i = 0; i < bus->nmux; i++) {
+    struct tca9548a *mux = &bus->mux[i];
+    int channel = mux->address == am2321_data->mux_address ? am2321_data->mux_channel : -1;
+
+    if (mux->channel == channel) {
+      continue;
+    }
+    data = channel < 0 ? 0 : 1 << channel;
+    if (write_i2c_slave(mux->i2c_slave, &data, 1) == -1) {
+      printk(KERN_ERR "am2321 : Failed select channel %d of TCA9548A 0x%02x on /dev/i2c-%d.\n", channel, mux->address, bus->bus);
+      mux->channel = -2;  // Unknown. Written again at next time.
+      return -1;
+    }
+    mux->channel = channel;
+  }
+  return 0;
+}
+
+/*!
+ * @brief Forget the channels selected, which the other clients may switch without the bus lock.
+ */
+static void forget_mux_am2321(struct am2321_bus *bus) {
+
+  int i;
+
+  for (i = 0; i < bus->nmux; i++) {
+    bus->mux[i].channel = -2;
+  }
+}
+
+/*!
+ * @brief Select the channel of AM2321 in the bus lock, before each transfer. See share_bus_am2321().
+ *
+ * The other clients may switch the channels while the bus is unlocked, so
+ * they are written again every time.
+ *
+ * @param[in] am2321_data AM2321 to select.
+ * @param[in] arg         The bus of AM2321.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+static int select_locked_am2321(struct am2321 *am2321_data, void *arg) {
+
+  struct am2321_bus *bus = arg;
+
+  forget_mux_am2321(bus);
+  return write_mux_am2321(bus, am2321_data);
+}
+
+/*!
+ * @brief Select the channel of TCA9548A connected to AM2321.
+ *
+ * Nothing is written when the channel is selected already, so the sensors
+ * on the same channel are polled with a single channel switch. The other
+ * muxes on the bus are closed, because the addresses of AM2321s collide.
+ * On the bus shared by the bus lock, the channel is selected in the lock
+ * at each transfer by select_locked_am2321() instead.
+ *
+ * @param[in,out] bus         The bus of AM2321.
+ * @param[in]     am2321_data AM2321 to select.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int select_mux_am2321(struct am2321_bus *bus, struct am2321 *am2321_data) {
+
+  if (bus->lock_fd != -1) {
+    return 0;
+  }
+  return write_mux_am2321(bus, am2321_data);
+}
+
+/*!
+ * @brief Open /dev/i2c-<bus> for the batched transfers by I2C_RDWR.
+ *
+ * The bus is measured without I2C_RDWR if the adapter does not support
+ * the plain I2C transfers.
+ *
+ * @param[in,out] bus The bus.
+ *
+ * @return Successed : 0, Not supported : -1
+ */
+int open_rdwr_am2321(struct am2321_bus *bus) {
+
+  char i2c_dev_name[64];
+
+  sprintf(i2c_dev_name, I2C_DEV, bus->bus);
+  if ((bus->rdwr_fd = open(i2c_dev_name, O_RDWR | O_CLOEXEC)) == -1) {
+    printk(KERN_WARNING "am2321 : Failed open %s for I2C_RDWR.\n", i2c_dev_name);
+    return -1;
+  }
+  if (ioctl(bus->rdwr_fd, I2C_FUNCS, &bus->funcs) == -1 || !(bus->funcs & I2C_FUNC_I2C)) {
+    printk(KERN_WARNING "am2321 : %s does not support I2C_RDWR. Transfer one by one.\n", i2c_dev_name);
+    close(bus->rdwr_fd);
+    bus->rdwr_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+/*!
+ * @brief Open /dev/i2c-<bus> for the bus lock shared with the other I2C clients.
+ *
+ * The other daemons on the bus, e.g. of ADCs or EEPROMs, take flock(LOCK_EX)
+ * on the same device around their transfers. AM2321s hold it only during
+ * each transfer, not during the waits of the measurement. See lock_bus_am2321().
+ *
+ * @param[in,out] bus The bus.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int open_lock_am2321(struct am2321_bus *bus) {
+
+  char i2c_dev_name[64];
+
+  sprintf(i2c_dev_name, I2C_DEV, bus->bus);
+  if ((bus->lock_fd = open(i2c_dev_name, O_RDONLY | O_CLOEXEC)) == -1) {
+    printk(KERN_WARNING "am2321 : Failed open %s for the bus lock. Transfer without the lock.\n", i2c_dev_name);
+    return -1;
+  }
+  return 0;
+}
+
+/*!
+ * @brief Open the sessions to all AM2321s and the muxes in the engine.
+ *
+ * @param[in,out] engine The engine.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int open_engine(struct am2321_engine *engine) {
+
+  char i2c_dev_name[64], name[sizeof(((struct am2321 *)0)->name)];
+  struct am2321_bus *bus = NULL;
+  struct am2321 *am2321_data;
+  int i, j;
+
+  engine->order = malloc(sizeof(struct am2321 *) * engine->nsensors);
+  engine->buses = calloc(engine->nsensors, sizeof(struct am2321_bus));
+  engine->plan = calloc(engine->nsensors, sizeof(char));
+  if (engine->order == NULL || engine->buses == NULL || engine->plan == NULL) {
+    return -1;
+  }
+  for (i = 0; i < engine->nsensors; i++) {
+    engine->order[i] = &engine->sensors[i];
+  }
+  qsort(engine->order, engine->nsensors, sizeof(struct am2321 *), cmp_sensor);
+
+  for (i = 0; i < engine->nsensors; i++) {
+    am2321_data = engine->order[i];
+    if (bus == NULL || bus->bus != am2321_data->bus) {
+      bus = &engine->buses[engine->nbuses++];
+      bus->bus = am2321_data->bus;
+      bus->sensors = &engine->order[i];
+      bus->plan = &engine->plan[i];
+      bus->engine = engine;
+      bus->rdwr_fd = -1;
+      bus->lock_fd = -1;
+      if (engine->rdwr) {
+        open_rdwr_am2321(bus);
+      }
+      if (engine->lock) {
+        open_lock_am2321(bus);
+      }
+    }
+    bus->nsensors++;
+
+    // open_am2321() initializes the whole session, but the name of the config.
+    memcpy(name, am2321_data->name, sizeof(name));
+    j = open_am2321(am2321_data, am2321_data->bus, am2321_data->address, am2321_data->variant
+      , am2321_data->mux_address, am2321_data->mux_channel);
+    memcpy(am2321_data->name, name, sizeof(name));
+    if (j == -1) {
+      return -1;
+    }
+    share_bus_am2321(am2321_data, bus->lock_fd, bus->lock_fd != -1 ? select_locked_am2321 : NULL, bus);
+    load_calibration_am2321(am2321_data);
+    if (am2321_data->mux_address < 0) {
+      continue;
+    }
+    for (j = 0; j < bus->nmux; j++) {
+      if (bus->mux[j].address == am2321_data->mux_address) {
+        break;
+      }
+    }
+    if (j < bus->nmux) {
+      continue;
+    }
+    if (bus->nmux == TCA9548A_MAX_MUX) {
+      printk(KERN_ERR "am2321 : Too many TCA9548A on /dev/i2c-%d.\n", bus->bus);
+      return -1;
+    }
+    sprintf(i2c_dev_name, I2C_DEV, bus->bus);
+    bus->mux[j].address = am2321_data->mux_address;
+    bus->mux[j].channel = -2;
+    bus->mux[j].i2c_slave = gen_i2c_slave(i2c_dev_name, "tca9548a", am2321_data->mux_address, 1, 3000);
+    if (bus->mux[j].i2c_slave == NULL || init_i2c_slave(bus->mux[j].i2c_slave) == -1) {
+      printk(KERN_ERR "am2321 : Failed open TCA9548A 0x%02x on %s.\n", am2321_data->mux_address, i2c_dev_name);
+      return -1;
+    }
+    bus->nmux++;
+  }
+  // The outputs read the samples queued into the copies, while the workers measure the next ones.
+  if ((engine->samples = malloc(engine->nsensors * sizeof(struct am2321))) == NULL) {
+    return -1;
+  }
+  memcpy(engine->samples, engine->sensors, engine->nsensors * sizeof(struct am2321));
+
+  return 0;
+}
+
+/*!
+ * @brief Calibrate the waits of all AM2321s in the engine, and save them.
+ *
+ * @param[in,out] engine The engine opened by open_engine().
+ *
+ * @return Successed : 0, Failed on some AM2321s : -1
+ */
+int calibrate_engine(struct am2321_engine *engine) {
+
+  struct am2321_bus *bus;
+  struct am2321 *am2321_data;
+  int i, j, ret = 0;
+
+  for (i = 0; i < engine->nbuses; i++) {
+    bus = &engine->buses[i];
+    for (j = 0; j < bus->nsensors; j++) {
+      am2321_data = bus->sensors[j];
+      if (select_mux_am2321(bus, am2321_data) == -1 || calibrate_am2321(am2321_data) == -1) {
+        printf("Failed calibrate AM2321 %s on /dev/i2c-%d 0x%02x.\n", am2321_data->name, am2321_data->bus, am2321_data->address);
+        ret = -1;
+        continue;
+      }
+      printf("%s /dev/i2c-%d 0x%02x : wakeup %d, writemode %d, readmode %d usec (safe : %d, %d, %d)\n"
+        , am2321_data->name, am2321_data->bus, am2321_data->address
+        , wait_am2321(am2321_data, AM2321_CAL_WAKEUP), wait_am2321(am2321_data, AM2321_CAL_WRITEMODE)
+        , wait_am2321(am2321_data, AM2321_CAL_READMODE)
+        , descriptor_am2321(am2321_data)->wait[AM2321_CAL_WAKEUP], descriptor_am2321(am2321_data)->wait[AM2321_CAL_WRITEMODE]
+        , descriptor_am2321(am2321_data)->wait[AM2321_CAL_READMODE]);
+      if (save_calibration_am2321(am2321_data) == -1) {
+        ret = -1;
+      }
+    }
+  }
+  return ret;
+}
+
+/*!
+ * @brief Close all sessions and free the engine.
+ *
+ * @param[in,out] engine The engine.
+ */
+void close_engine(struct am2321_engine *engine) {
+
+  int i, j;
+
+  for (i = 0; i < engine->nsensors; i++) {
+    close_am2321(&engine->sensors[i]);
+  }
+  for (i = 0; i < engine->nbuses; i++) {
+    if (engine->buses[i].rdwr_fd != -1) {
+      close(engine->buses[i].rdwr_fd);
+    }
+    if (engine->buses[i].lock_fd != -1) {
+      close(engine->buses[i].lock_fd);
+    }
+    for (j = 0; j < engine->buses[i].nmux; j++) {
+      if (engine->buses[i].mux[j].i2c_slave != NULL) {
+        term_i2c_slave(engine->buses[i].mux[j].i2c_slave);
+        destroy_i2c_slave(engine->buses[i].mux[j].i2c_slave);
+      }
+    }
+  }
+  free(engine->buses);
+  free(engine->order);
+  free(engine->plan);
+  free(engine->sensors);
+  free(engine->samples);
+  memset(engine, 0, sizeof(struct am2321_engine));
+}
+
+/*!
+ * @brief Create the ring of the samples in POSIX shared memory.
+ *
+ * The layout of the ring and the functions of the consumers are in am2321-shm.h.
+ *
+ * @param[in] name Name of the shared memory. (/dev/shm/<name>)
+ *
+ * @return The ring, or NULL if failed.
+ */
+struct am2321_ring *create_ring_am2321(const char *name) {
+
+  struct am2321_ring *ring;
+  size_t size = am2321_ring_size(AM2321_SHM_CAPACITY);
+  char path[256];
+  int fd;
+
+  snprintf(path, sizeof(path), "/%s", name);
+  if ((fd = shm_open(path, O_RDWR | O_CREAT, 0644)) == -1) {
+    printk(KERN_ERR "am2321 : Failed open the shared memory %s.\n", path);
+    return NULL;
+  }
+  // Truncated to 0 first, so that the slots of the old ring are cleared.
+  if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1) {
+    printk(KERN_ERR "am2321 : Failed resize the shared memory %s.\n", path);
+    close(fd);
+    return NULL;
+  }
+  ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED) {
+    printk(KERN_ERR "am2321 : Failed map the shared memory %s.\n", path);
+    return NULL;
+  }
+  ring->version = AM2321_SHM_VERSION;
+  ring->capacity = AM2321_SHM_CAPACITY;
+  ring->slot_size = sizeof(struct am2321_slot);
+  __atomic_store_n(&ring->magic, AM2321_SHM_MAGIC, __ATOMIC_RELEASE);
+
+  return ring;
+}
+
+/*!
+ * @brief Remove the ring created by create_ring_am2321().
+ *
+ * @param[in] ring The ring.
+ * @param[in] name Name of the shared memory.
+ */
+void destroy_ring_am2321(struct am2321_ring *ring, const char *name) {
+
+  char path[256];
+
+  munmap(ring, am2321_ring_size(ring->capacity));
+  snprintf(path, sizeof(path), "/%s", name);
+  shm_unlink(path);
+}
+
+/*!
+ * @brief Write the sample to the ring.
+ *
+ * Only one thread may write to the ring at once. The consumers never block
+ * the producer, they check the seq of the slot around the copy instead.
+ *
+ * @param[in,out] ring        The ring.
+ * @param[in]     am2321_data AM2321 measured.
+ */
+void publish_ring_am2321(struct am2321_ring *ring, struct am2321 *am2321_data) {
+
+  uint64_t position = ring->head;
+  struct am2321_slot *slot = &ring->slots[position & (ring->capacity - 1)];
+  struct am2321_sample *sample = &slot->sample;
+
+  __atomic_store_n(&slot->seq, 2 * position + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  sample->timestamp = am2321_data->timestamp;
+  sample->realtime = realtime_ns() - (monotonic_ns() - am2321_data->timestamp);
+  memcpy(sample->name, am2321_data->name, sizeof(sample->name));
+  sample->bus = am2321_data->bus;
+  sample->address = am2321_data->address;
+  memcpy(sample->register_data, am2321_data->register_data, sizeof(sample->register_data));
+  sample->temperature = calc_temp(am2321_data);
+  sample->humidity = calc_hum(am2321_data);
+  sample->discomfort = calc_discomfort(am2321_data);
+
+  __atomic_store_n(&slot->seq, 2 * (position + 1), __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->head, position + 1, __ATOMIC_RELEASE);
+}
+
+/*!
+ * @brief Check the values of AM2321 are changed from the last ones printed. (-u)
+ *
+ * @param[in,out] engine      The engine.
+ * @param[in]     am2321_data AM2321 measured.
+ * @param[in]     sensor      Index of the sensor.
+ *
+ * @return 1 : Changed, or all values are printed, 0 : Not changed
+ */
+int changed_engine(struct am2321_engine *engine, struct am2321 *am2321_data, int sensor) {
+
+  uint32_t *last, values;
+
+  if (engine->last == NULL) {
+    return 1;
+  }
+  last = &engine->last[sensor];
+  values = (uint32_t)calc_temp_x10(am2321_data) << 16 | (uint16_t)calc_hum_x10(am2321_data);
+  if (*last == values) {
+    return 0;
+  }
+  *last = values;
+  return 1;
+}
+
+/*
+ * Queues of the samples from the workers.
+ *
+ * Each worker is the only producer of the queue of its bus, and the main
+ * thread is the only consumer of all queues, so the samples are handed over
+ * without any lock. The worker notifies the main thread by the eventfd of
+ * the engine once after each sweep, not to delay the measurements.
+ */
+
+/*!
+ * A sample queued by the worker.
+ */
+struct am2321_entry {
+
+  uint64_t timestamp;       // Time of the frame is received. (CLOCK_MONOTONIC, nsec)
+  int sensor;               // Index of the sensor in the engine.
+  int ret;                  // Result of the measurement.
+  char register_data[8];
+};
+
+/*!
+ * The single-producer single-consumer queue of the samples.
+ */
+struct am2321_queue {
+
+  uint64_t head __attribute__((aligned(64)));  // Written by the worker only.
+  uint64_t dropped;         // Samples dropped because the queue is full.
+  uint64_t tail __attribute__((aligned(64)));  // Written by the main thread only.
+  struct am2321_entry entries[AM2321_QUEUE_SIZE] __attribute__((aligned(64)));
+};
+
+/*!
+ * @brief Push the sample to the queue. (The worker)
+ *
+ * @return Successed : 0, Failed : -1 (The queue is full)
+ */
+static inline int push_queue_am2321(struct am2321_queue *queue, const struct am2321_entry *entry) {
+
+  uint64_t head = queue->head;
+
+  if (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == AM2321_QUEUE_SIZE) {
+    __atomic_store_n(&queue->dropped, queue->dropped + 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  queue->entries[head & (AM2321_QUEUE_SIZE - 1)] = *entry;
+  __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/*!
+ * @brief Pop the sample from the queue. (The main thread)
+ *
+ * @return 1 : Popped, 0 : The queue is empty.
+ */
+static inline int pop_queue_am2321(struct am2321_queue *queue, struct am2321_entry *entry) {
+
+  uint64_t tail = queue->tail;
+
+  if (tail == __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+    return 0;
+  }
+  *entry = queue->entries[tail & (AM2321_QUEUE_SIZE - 1)];
+  __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/*!
+ * @brief Output the sample to the exporter, the ring, the capture, the history and stdout.
+ *
+ * This is called by the main thread only.
+ *
+ * @param[in,out] engine The engine.
+ * @param[in]     entry  The sample.
+ */
+void output_am2321(struct am2321_engine *engine, const struct am2321_entry *entry) {
+
+  struct am2321 *am2321_data = &engine->samples[entry->sensor];
+  int sensor = entry->sensor, ret = entry->ret;
+
+  am2321_data->timestamp = entry->timestamp;
+  memcpy(am2321_data->register_data, entry->register_data, sizeof(am2321_data->register_data));
+
+  if (engine->exporter != NULL) {
+    cache_exporter_am2321(engine->exporter, am2321_data, sensor, ret);
+  }
+  if (engine->ring != NULL && ret == 0) {
+    publish_ring_am2321(engine->ring, am2321_data);
+  }
+  if (engine->capture != NULL) {
+    struct am2321_frame_record record;
+
+    record.timestamp = am2321_data->timestamp;
+    record.sensor = sensor;
+    record.bus = am2321_data->bus;
+    record.address = am2321_data->address;
+    record.status = ret;
+    memcpy(record.frame, am2321_data->register_data, sizeof(record.frame));
+    append_capture_am2321(engine->capture, &record);
+  }
+  if (engine->history != NULL && ret == 0) {
+    append_history_am2321(engine->history, am2321_data, sensor);
+  }
+  if (engine->publisher != NULL && ret == 0) {
+    publish_am2321(engine->publisher, am2321_data, sensor);
+  }
+  if (engine->writer != NULL) {
+    if (ret < 0) {
+      printk(KERN_ERR "am2321 : Failed measure data from AM2321 %s.\n", am2321_data->name);
+    } else if (engine->stats != NULL) {
+      struct am2321_stats *stats = &engine->stats[sensor];
+
+      // Only the samples crossing the deadband and the aggregates of the windows are written.
+      if (update_stats_am2321(stats, am2321_data, engine->deadband)) {
+        write_am2321(engine->writer, am2321_data, sensor);
+      }
+      if (engine->window != 0 && stats->begin + engine->window <= am2321_data->timestamp + engine->interval * 1000ULL) {
+        write_stats_am2321(engine->writer, stats, am2321_data);
+        reset_stats_am2321(stats);
+      }
+    } else if (changed_engine(engine, am2321_data, sensor)) {
+      write_am2321(engine->writer, am2321_data, sensor);
+    }
+  } else if (!engine->quiet) {
+    if (ret < 0) {
+      printf("Failed measure data from AM2321 %s.\n", am2321_data->name);
+    } else if (changed_engine(engine, am2321_data, sensor)) {
+      print_am2321(am2321_data, engine->format);
+    }
+    fflush(stdout);
+  }
+}
+
+/*!
+ * @brief Hand the result of the measurement in the sweep to the outputs.
+ *
+ * The sample is queued to the main thread, or output at once in the single
+ * thread build.
+ *
+ * @param[in,out] bus         The bus of AM2321.
+ * @param[in]     am2321_data AM2321 measured.
+ * @param[in]     ret         Result of the measurement.
+ */
+void emit_am2321(struct am2321_bus *bus, struct am2321 *am2321_data, int ret) {
+
+  struct am2321_entry entry;
+
+  entry.timestamp = am2321_data->timestamp;
+  entry.sensor = am2321_data - bus->engine->sensors;
+  entry.ret = ret;
+  memcpy(entry.register_data, am2321_data->register_data, sizeof(entry.register_data));
+#if AM2321_SINGLE_THREAD
+  output_am2321(bus->engine, &entry);
+#else
+  if (push_queue_am2321(bus->queue, &entry) == 0) {
+    bus->queued++;
+  }
+#endif
+}
+
+/*!
+ * @brief Sleep until the time of CLOCK_MONOTONIC.
+ *
+ * @param[in] deadline The time in nanoseconds.
+ */
+void sleep_until_ns(uint64_t deadline) {
+
+  struct timespec ts;
+
+  ts.tv_sec = deadline / 1000000000;
+  ts.tv_nsec = deadline % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && !am2321_stop);
+}
+
+/*!
+ * @brief Plan the sweep of the bus by the health of AM2321s.
+ *
+ * The healthy AM2321s are measured first, and the flaky or quarantined ones
+ * after them, so that the retries of the failing ones do not delay the
+ * healthy ones. AM2321s in the backoff of their failures are skipped.
+ * See update_health_am2321().
+ *
+ * @param[in,out] bus The bus.
+ */
+static void plan_bus_am2321(struct am2321_bus *bus) {
+
+  uint64_t now = monotonic_ns();
+  int i;
+
+  for (i = 0; i < bus->nsensors; i++) {
+    if (!due_am2321(bus->sensors[i], now)) {
+      bus->plan[i] = AM2321_PLAN_SKIP;
+    } else if (state_health_am2321(bus->sensors[i]) == AM2321_HEALTHY) {
+      bus->plan[i] = AM2321_PLAN_NOW;
+    } else {
+      bus->plan[i] = AM2321_PLAN_LATER;
+    }
+  }
+}
+
+/*!
+ * @brief Finish the measurement of AM2321 in the sweep.
+ *
+ * @param[in,out] bus         The bus of AM2321.
+ * @param[in,out] am2321_data AM2321 measured.
+ * @param[in]     ret         Result of the measurement.
+ * @param[in]     emit        Print the values or not. (0 : warm-up)
+ */
+static void finish_am2321(struct am2321_bus *bus, struct am2321 *am2321_data, int ret, int emit) {
+
+  update_health_am2321(am2321_data, ret);
+  if (emit) {
+    emit_am2321(bus, am2321_data, ret);
+  }
+}
+
+/*!
+ * @brief Measure from AM2321s of the plan on the bus, one after another.
+ *
+ * @param[in,out] bus  The bus.
+ * @param[in]     plan AM2321_PLAN_* of AM2321s measured.
+ * @param[in]     emit Print the values or not. (0 : warm-up)
+ */
+static void sweep_plan_serial(struct am2321_bus *bus, int plan, int emit) {
+
+  struct am2321 *am2321_data;
+  int i, ret;
+
+  for (i = 0; i < bus->nsensors && !am2321_stop; i++) {
+    if (bus->plan[i] != plan) {
+      continue;
+    }
+    am2321_data = bus->sensors[i];
+    ret = select_mux_am2321(bus, am2321_data);
+    if (ret == 0) {
+      ret = measure_retry(am2321_data);
+    }
+    finish_am2321(bus, am2321_data, ret, emit);
+  }
+}
+
+/*!
+ * @brief Measure from all AM2321s on the bus once, one after another.
+ *
+ * @param[in,out] bus  The bus.
+ * @param[in]     emit Print the values or not. (0 : warm-up)
+ */
+void sweep_bus_serial(struct am2321_bus *bus, int emit) {
+
+  plan_bus_am2321(bus);
+  sweep_plan_serial(bus, AM2321_PLAN_NOW, emit);
+  sweep_plan_serial(bus, AM2321_PLAN_LATER, emit);
+}
+
+/*!
+ * @brief Measure from all AM2321s on the bus once, interleaving their steps.
+ *
+ * While an AM2321 is waiting between the steps, the steps of AM2321s on the
+ * other channels are done, e.g. AM2321 B is woken up while AM2321 A is
+ * converting. So the sweep takes about the time of the bus, not the sum of
+ * the waits. Up to AM2321_PIPELINE_DEPTH AM2321s are measured at once, so
+ * that the steps of the others do not delay the step too long.
+ * AM2321s failed here are measured again one by one by measure_retry(),
+ * and the unhealthy ones only so, after them. See plan_bus_am2321().
+ *
+ * @param[in,out] bus  The bus.
+ * @param[in]     emit Print the values or not. (0 : warm-up)
+ */
+void sweep_bus_pipelined(struct am2321_bus *bus, int emit) {
+
+  struct am2321 *slot[AM2321_PIPELINE_DEPTH], *am2321_data;
+  uint64_t deadline[AM2321_PIPELINE_DEPTH];
+  int next = 0, active = 0, i, min, ret;
+
+  plan_bus_am2321(bus);
+  while ((next < bus->nsensors || 0 < active) && !am2321_stop) {
+    while (active < AM2321_PIPELINE_DEPTH && next < bus->nsensors) {
+      if (bus->plan[next] != AM2321_PLAN_NOW) {
+        next++;
+        continue;
+      }
+      slot[active] = bus->sensors[next++];
+      begin_am2321(slot[active]);
+      deadline[active++] = 0;
+    }
+    // No AM2321 is left to measure now, e.g. all of them are in the backoff.
+    if (active == 0) {
+      break;
+    }
+
+    // Do the step of AM2321 whose wait ends first.
+    for (min = 0, i = 1; i < active; i++) {
+      if (deadline[i] < deadline[min]) {
+        min = i;
+      }
+    }
+    if (monotonic_ns() < deadline[min]) {
+      sleep_until_ns(deadline[min]);
+    }
+    am2321_data = slot[min];
+    ret = select_mux_am2321(bus, am2321_data);
+    if (ret == 0) {
+      ret = step_am2321(am2321_data);
+    } else {
+      am2321_data->step = AM2321_STEP_FAILED;
+    }
+    if (0 < ret) {
+      deadline[min] = monotonic_ns() + (uint64_t)ret * 1000;
+      continue;
+    }
+
+    if (ret == 0) {
+      finish_am2321(bus, am2321_data, 0, emit);
+    }
+    slot[min] = slot[--active];
+    deadline[min] = deadline[active];
+  }
+
+  // The healthy AM2321s failed in the pipeline are retried first.
+  for (i = 0; i < bus->nsensors; i++) {
+    if (bus->plan[i] == AM2321_PLAN_NOW && bus->sensors[i]->step != AM2321_STEP_FAILED) {
+      bus->plan[i] = AM2321_PLAN_SKIP;
+    }
+  }
+  sweep_plan_serial(bus, AM2321_PLAN_NOW, emit);
+  sweep_plan_serial(bus, AM2321_PLAN_LATER, emit);
+}
+
+/*!
+ * The messages of a batched transfer by I2C_RDWR.
+ */
+struct am2321_batch {
+
+  struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+  char channels[I2C_RDWR_IOCTL_MAX_MSGS]; // Data of the messages to TCA9548A.
+  struct am2321 *sensors[I2C_RDWR_IOCTL_MAX_MSGS]; // AM2321s in the messages.
+  int nmsgs;
+  int nsensors;
+};
+
+/*!
+ * @brief Transfer the messages of the batch in an ioctl.
+ *
+ * When the transfer is failed, all AM2321s in the batch are failed, and
+ * the channels of the muxes are unknown.
+ *
+ * @param[in,out] bus   The bus.
+ * @param[in,out] batch The batch. Cleared after the transfer.
+ * @param[in]     phase AM2321_PHASE_* of the messages.
+ */
+static void flush_batch_am2321(struct am2321_bus *bus, struct am2321_batch *batch, int phase) {
+
+  struct i2c_rdwr_ioctl_data data;
+  int i, ret;
+
+  (void)phase;
+  if (batch->nmsgs == 0) {
+    return;
+  }
+  data.msgs = batch->msgs;
+  data.nmsgs = batch->nmsgs;
+  lock_bus_am2321(bus->lock_fd);
+  ret = TIMED_AM2321(phase, ioctl(bus->rdwr_fd, I2C_RDWR, &data));
+  unlock_bus_am2321(bus->lock_fd);
+  if (ret < 0) {
+    for (i = 0; i < batch->nsensors; i++) {
+      batch->sensors[i]->step = AM2321_STEP_FAILED;
+    }
+  }
+  // The batch selects the channels again after the bus is unlocked.
+  if (ret < 0 || bus->lock_fd != -1) {
+    forget_mux_am2321(bus);
+  }
+  batch->nmsgs = 0;
+  batch->nsensors = 0;
+}
+
+/*!
+ * @brief Add the message to AM2321 to the batch, after the messages to select its channel.
+ *
+ * @param[in,out] bus         The bus.
+ * @param[in,out] batch       The batch.
+ * @param[in]     phase       AM2321_PHASE_* of the messages.
+ * @param[in]     am2321_data AM2321.
+ * @param[in]     flags       Flags of the message. (I2C_M_*)
+ * @param[in]     buf         Data of the message.
+ * @param[in]     len         Length of the data.
+ */
+static void add_batch_am2321(struct am2321_bus *bus, struct am2321_batch *batch, int phase
+    , struct am2321 *am2321_data, int flags, char *buf, int len) {
+
+  struct i2c_msg *msg;
+  int i, channel;
+
+  if (I2C_RDWR_IOCTL_MAX_MSGS < batch->nmsgs + bus->nmux + 1) {
+    flush_batch_am2321(bus, batch, phase);
+  }
+  for (i = 0; i < bus->nmux; i++) {
+    channel = bus->mux[i].address == am2321_data->mux_address ? am2321_data->mux_channel : -1;
+    if (bus->mux[i].channel == channel) {
+      continue;
+    }
+    batch->channels[batch->nmsgs] = channel < 0 ? 0 : 1 << channel;
+    msg = &batch->msgs[batch->nmsgs];
+    msg->addr = bus->mux[i].address;
+    msg->flags = 0;
+    msg->len = 1;
+    msg->buf = (__u8 *)&batch->channels[batch->nmsgs++];
+    bus->mux[i].channel = channel;
+  }
+  msg = &batch->msgs[batch->nmsgs++];
+  msg->addr = am2321_data->address;
+  msg->flags = flags;
+  msg->len = len;
+  msg->buf = (__u8 *)buf;
+  batch->sensors[batch->nsensors++] = am2321_data;
+}
+
+/*!
+ * @brief Do the step of all AM2321s on the bus in the batched transfers.
+ *
+ * @param[in,out] bus  The bus.
+ * @param[in]     step The step of the measurement. (AM2321_STEP_*)
+ *
+ * @return The longest wait of AM2321s after the step in microseconds.
+ */
+static int step_batch_am2321(struct am2321_bus *bus, int step) {
+
+  const struct am2321_descriptor *descriptor;
+  struct am2321_batch batch;
+  struct am2321 *am2321_data;
+  int i, wait, max = 0, phase = AM2321_PHASE_WAKEUP;
+
+  batch.nmsgs = 0;
+  batch.nsensors = 0;
+  for (i = 0; i < bus->nsensors; i++) {
+    am2321_data = bus->sensors[i];
+    if (am2321_data->step != step) {
+      continue;
+    }
+    descriptor = descriptor_am2321(am2321_data);
+    switch (step) {
+      // AM2321 in suspend mode does not ACK the wakeup. It aborts the batch unless I2C_M_IGNORE_NAK.
+      case AM2321_STEP_WAKEUP:
+        if (bus->funcs & I2C_FUNC_PROTOCOL_MANGLING) {
+          add_batch_am2321(bus, &batch, AM2321_PHASE_WAKEUP, am2321_data, I2C_M_IGNORE_NAK, NULL, 0);
+        } else if (select_mux_am2321(bus, am2321_data) == -1) {
+          // Not batched on the channel selected for the other AM2321. Retried by sweep_bus_batched().
+          am2321_data->step = AM2321_STEP_FAILED;
+          continue;
+        } else if (step_am2321(am2321_data) < 0) {
+          // In the bus lock, with the channel selected in the lock.
+          continue;
+        }
+        wait = wait_am2321(am2321_data, AM2321_CAL_WAKEUP);
+        phase = AM2321_PHASE_WAKEUP;
+        break;
+      case AM2321_STEP_WRITEMODE:
+        add_batch_am2321(bus, &batch, AM2321_PHASE_WRITEMODE, am2321_data, 0, NULL, 0);
+        wait = wait_am2321(am2321_data, AM2321_CAL_WRITEMODE);
+        phase = AM2321_PHASE_WRITEMODE;
+        break;
+      case AM2321_STEP_REQUEST:
+        add_batch_am2321(bus, &batch, AM2321_PHASE_REQUEST, am2321_data, 0, (char *)descriptor->request, descriptor->request_len);
+        wait = wait_am2321(am2321_data, AM2321_CAL_READMODE);
+        phase = AM2321_PHASE_REQUEST;
+        break;
+      case AM2321_STEP_READ:
+      default:
+        add_batch_am2321(bus, &batch, AM2321_PHASE_READ, am2321_data, I2C_M_RD, am2321_data->register_data, descriptor->frame_len);
+        wait = 0;
+        phase = AM2321_PHASE_READ;
+        break;
+    }
+    // The frame read is checked by sweep_bus_batched() at IDLE.
+    am2321_data->step = step == AM2321_STEP_READ ? AM2321_STEP_IDLE : step + 1;
+    if (max < wait) {
+      max = wait;
+    }
+  }
+  flush_batch_am2321(bus, &batch, phase);
+
+  return max;
+}
+
+/*!
+ * @brief Measure from all AM2321s on the bus once, in the batched transfers.
+ *
+ * Each step of all AM2321s on the bus is transferred in an I2C_RDWR ioctl,
+ * with the messages to select the channels of the muxes between them. So
+ * a sweep costs 4 ioctls on the bus instead of 4 syscalls per AM2321.
+ * The wait after the step is the longest wait of AM2321s.
+ * The request and the read are not combined into an ioctl, because AM2321
+ * needs AM2321_WAIT_READMODE after the stop of the request.
+ * When a transfer is failed, AM2321s in it are measured again one by one
+ * by measure_retry(), and the unhealthy ones only so, after them.
+ * See plan_bus_am2321().
+ *
+ * @param[in,out] bus  The bus.
+ * @param[in]     emit Print the values or not. (0 : warm-up)
+ */
+void sweep_bus_batched(struct am2321_bus *bus, int emit) {
+
+  struct am2321 *am2321_data;
+  int i, step, wait, ret;
+
+  plan_bus_am2321(bus);
+  for (i = 0; i < bus->nsensors; i++) {
+    if (bus->plan[i] == AM2321_PLAN_NOW) {
+      begin_am2321(bus->sensors[i]);
+    }
+  }
+  for (step = AM2321_STEP_WAKEUP; step <= AM2321_STEP_READ && !am2321_stop; step++) {
+    if (0 < (wait = step_batch_am2321(bus, step))) {
+      usleep(wait);
+    }
+  }
+
+  for (i = 0; i < bus->nsensors && !am2321_stop; i++) {
+    if (bus->plan[i] != AM2321_PLAN_NOW) {
+      continue;
+    }
+    am2321_data = bus->sensors[i];
+    ret = am2321_data->step == AM2321_STEP_IDLE ? check_frame_am2321(am2321_data) : AM2321_ERR_IO;
+    // The healthy AM2321s failed in the batch are retried first.
+    if (0 <= ret) {
+      finish_am2321(bus, am2321_data, ret, emit);
+      bus->plan[i] = AM2321_PLAN_SKIP;
+    }
+  }
+  sweep_plan_serial(bus, AM2321_PLAN_NOW, emit);
+  sweep_plan_serial(bus, AM2321_PLAN_LATER, emit);
+}
+
+/*!
+ * @brief Measure from all AM2321s on the bus once.
+ *
+ * @param[in,out] bus  The bus.
+ * @param[in]     emit Print the values or not. (0 : warm-up)
+ */
+void sweep_bus(struct am2321_bus *bus, int emit) {
+
+  if (bus->rdwr_fd != -1) {
+    sweep_bus_batched(bus, emit);
+  } else if (bus->engine->pipelined) {
+    sweep_bus_pipelined(bus, emit);
+  } else {
+    sweep_bus_serial(bus, emit);
+  }
+}
+
+/*!
+ * @brief Read the model, the version and the device ID of all AM2321s on the bus, which have the registers.
+ *
+ * @param[in,out] bus  The bus.
+ * @param[in]     warn Print the AM2321s failed.
+ *
+ * @return Number of AM2321s discovered.
+ */
+static int discover_bus_am2321(struct am2321_bus *bus, int warn) {
+
+  struct am2321 *am2321_data;
+  int i, try, found = 0;
+
+  for (i = 0; i < bus->nsensors && !am2321_stop; i++) {
+    am2321_data = bus->sensors[i];
+    // The variants without the registers, e.g. DHT12, have nothing to discover.
+    if (!descriptor_am2321(am2321_data)->registers) {
+      continue;
+    }
+    for (try = 0; try < AM2321_DISCOVER_TRIES && !am2321_data->discovered; try++) {
+      if (select_mux_am2321(bus, am2321_data) == 0) {
+        discover_am2321(am2321_data);
+      }
+    }
+    if (am2321_data->discovered) {
+      found++;
+    } else if (warn) {
+      printk(KERN_WARNING "am2321 : Failed read the device ID of am2321 %s on /dev/i2c-%d.\n", am2321_data->name, bus->bus);
+    }
+  }
+  return found;
+}
+
+/*!
+ * @brief Pin the calling worker to the CPU, and set SCHED_FIFO, for the waits of AM2321 to be accurate.
+ *
+ * @param[in] engine The engine.
+ * @param[in] index  Index of the worker. It is pinned to cpus[index % ncpus].
+ */
+static void setup_worker_am2321(struct am2321_engine *engine, int index) {
+
+  struct sched_param param;
+  cpu_set_t set;
+  int cpu;
+
+  if (0 < engine->ncpus) {
+    cpu = engine->cpus[index % engine->ncpus];
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+      printk(KERN_WARNING "am2321 : Failed pin the worker %d to CPU %d.\n", index, cpu);
+    }
+  }
+  if (0 < engine->priority) {
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = engine->priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) == -1) {
+      printk(KERN_WARNING "am2321 : Failed set SCHED_FIFO %d to the worker %d.\n", engine->priority, index);
+    }
+  }
+}
+
+#if !AM2321_SINGLE_THREAD
+/*!
+ * @brief Notify the main thread of the samples queued in the sweep.
+ *
+ * @param[in,out] bus The bus.
+ */
+static void notify_engine(struct am2321_bus *bus) {
+
+  uint64_t one = 1;
+
+  if (bus->queued == 0) {
+    return;
+  }
+  bus->queued = 0;
+  if (write(bus->engine->event_fd, &one, sizeof(one)) != sizeof(one)) {
+    printk(KERN_ERR "am2321 : Failed notify the samples of /dev/i2c-%d.\n", bus->bus);
+  }
+}
+
+/*!
+ * @brief Output the samples in the queues of all buses. (The main thread)
+ *
+ * @param[in,out] engine The engine.
+ */
+static void drain_engine(struct am2321_engine *engine) {
+
+  struct am2321_entry entry;
+  uint64_t allocs;
+  int i;
+
+  for (i = 0; i < engine->nbuses && engine->buses[i].queue != NULL; i++) {
+    while (pop_queue_am2321(engine->buses[i].queue, &entry)) {
+      allocs = count_allocs();
+      output_am2321(engine, &entry);
+      check_allocs(allocs, "the output");
+    }
+  }
+}
+
+/*!
+ * @brief The worker thread polling the sensors on a bus at fixed rate.
+ *
+ * @param[in] arg The bus.
+ */
+static void *bus_worker(void *arg) {
+
+  struct am2321_bus *bus = arg;
+  struct timespec next;
+  uint64_t allocs;
+  int count = 0;
+
+  setup_worker_am2321(bus->engine, bus - bus->engine->buses);
+  discover_bus_am2321(bus, 1);
+  // The first data is the result of the previous conversion, so it is thrown away.
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  sweep_bus(bus, 0);
+
+  while (sleep_until_next(&next, bus->engine->interval, bus->engine->stop_fd) == 0) {
+    allocs = count_allocs();
+    sweep_bus(bus, 1);
+    notify_engine(bus);
+    check_allocs(allocs, "the sweep");
+    if (bus->engine->count && bus->engine->count <= ++count) {
+      break;
+    }
+  }
+  // Notify the main thread waiting in run_engine().
+  __sync_sub_and_fetch(&bus->engine->running, 1);
+  kill(getpid(), SIGUSR2);
+  return NULL;
+}
+
+/*!
+ * @brief Start the worker threads of all buses, with their queues.
+ *
+ * @param[in,out] engine The engine.
+ *
+ * @return Number of the workers started.
+ */
+static int start_workers(struct am2321_engine *engine) {
+
+  struct am2321_bus *bus;
+  int started;
+
+  engine->stop_fd = -1;
+  if ((engine->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1
+      || (engine->stop_fd = eventfd(0, EFD_CLOEXEC)) == -1) {
+    printk(KERN_ERR "am2321 : Failed create the eventfd.\n");
+    return 0;
+  }
+  engine->running = engine->nbuses;
+  for (started = 0; started < engine->nbuses; started++) {
+    bus = &engine->buses[started];
+    if (posix_memalign((void **)&bus->queue, 64, sizeof(struct am2321_queue)) != 0) {
+      bus->queue = NULL;
+    } else {
+      memset(bus->queue, 0, sizeof(struct am2321_queue));
+    }
+    if (bus->queue == NULL || pthread_create(&bus->thread, NULL, bus_worker, bus) != 0) {
+      printk(KERN_ERR "am2321 : Failed create the worker of /dev/i2c-%d.\n", bus->bus);
+      free(bus->queue);
+      bus->queue = NULL;
+      break;
+    }
+  }
+  __sync_sub_and_fetch(&engine->running, engine->nbuses - started);
+  return started;
+}
+
+/*!
+ * @brief Stop the worker threads, and output the samples left in the queues.
+ *
+ * @param[in,out] engine  The engine.
+ * @param[in]     started Number of the workers started.
+ */
+static void stop_workers(struct am2321_engine *engine, int started) {
+
+  struct am2321_bus *bus;
+  uint64_t one = 1;
+  int i;
+
+  // Wake up the workers sleeping in sleep_until_next(), and in sleep_until_ns() during the sweep.
+  if (engine->stop_fd != -1 && write(engine->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+    printk(KERN_WARNING "am2321 : Failed notify the workers to stop.\n");
+  }
+  for (i = 0; i < started; i++) {
+    pthread_kill(engine->buses[i].thread, SIGUSR1);
+  }
+  for (i = 0; i < started; i++) {
+    pthread_join(engine->buses[i].thread, NULL);
+  }
+  drain_engine(engine);
+  for (i = 0; i < started; i++) {
+    bus = &engine->buses[i];
+    if (bus->queue->dropped != 0) {
+      printk(KERN_WARNING "am2321 : %llu samples of /dev/i2c-%d are dropped by the full queue.\n"
+        , (unsigned long long)bus->queue->dropped, bus->bus);
+    }
+    free(bus->queue);
+    bus->queue = NULL;
+  }
+  if (engine->event_fd != -1) {
+    close(engine->event_fd);
+  }
+  if (engine->stop_fd != -1) {
+    close(engine->stop_fd);
+  }
+}
+#endif
+
+/*!
+ * @brief Run the workers of all buses until SIGINT, SIGTERM or the end of sweeps.
+ *
+ * The buses are polled concurrently by the worker thread per bus, and the
+ * samples are output by the main thread, which also serves the exporter.
+ * In the single thread build, the main thread sweeps the buses one after
+ * another at each tick of the timerfd, between the other events.
+ *
+ * @param[in,out] engine The opened engine.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int run_engine(struct am2321_engine *engine) {
+
+  struct epoll_event ev, events[16];
+  struct signalfd_siginfo info;
+  struct sigaction sa;
+  sigset_t mask;
+  uint64_t value;
+  int i, n, started, sfd = -1, epfd = -1, fd;
+  uint64_t allocs;
+#if AM2321_SINGLE_THREAD
+  struct itimerspec its;
+  int j, count = 0;
+#else
+  uint64_t swept = 0;       // Sweeps notified since the last publish.
+#endif
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stop_handler;
+  sigaction(SIGUSR1, &sa, NULL);
+
+  // SIGINT, SIGTERM and SIGUSR2 are received by signalfd of the main thread only.
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGUSR2);
+#if AM2321_TIMING
+  sigaddset(&mask, SIGHUP);   // Print the histograms of the latency.
+#endif
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+  if (0 < engine->priority && mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+    printk(KERN_WARNING "am2321 : Failed lock the memory for SCHED_FIFO.\n");
+  }
+
+#if AM2321_SINGLE_THREAD
+  setup_worker_am2321(engine, 0);
+  for (i = 0; i < engine->nbuses; i++) {
+    discover_bus_am2321(&engine->buses[i], 1);
+  }
+  // The first data is the result of the previous conversion, so it is thrown away.
+  for (i = 0; i < engine->nbuses; i++) {
+    sweep_bus(&engine->buses[i], 0);
+  }
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = its.it_interval.tv_sec = engine->interval / 1000000;
+  its.it_value.tv_nsec = its.it_interval.tv_nsec = engine->interval % 1000000 * 1000;
+  if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1 || timerfd_settime(fd, 0, &its, NULL) == -1) {
+    printk(KERN_ERR "am2321 : Failed create the timerfd.\n");
+    am2321_stop = 1;
+  }
+  engine->running = 1;
+  started = engine->nbuses;
+#else
+  started = start_workers(engine);
+  fd = engine->event_fd;
+  if (started < engine->nbuses) {
+    am2321_stop = 1;
+  }
+#endif
+
+  // The signals, the samples and the exporter are waited on the epoll. data.u64 of the signals is -1.
+  if ((sfd = signalfd(-1, &mask, SFD_CLOEXEC)) == -1 || (epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    printk(KERN_ERR "am2321 : Failed create the epoll.\n");
+    am2321_stop = 1;
+  } else {
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)-1;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev);
+    if (fd != -1) {
+      ev.data.u64 = AM2321_EVENT_SAMPLES;
+      epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    if (engine->exporter != NULL) {
+      ev.data.u64 = 0;
+      epoll_ctl(epfd, EPOLL_CTL_ADD, engine->exporter->fd, &ev);
+    }
+  }
+  while (!am2321_stop && __sync_add_and_fetch(&engine->running, 0) > 0) {
+    n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+    for (i = 0; i < n; i++) {
+      if (events[i].data.u64 == AM2321_EVENT_SAMPLES) {
+        if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+          continue;
+        }
+#if AM2321_SINGLE_THREAD
+        // The ticks missed by the long sweep are skipped.
+        allocs = count_allocs();
+        for (j = 0; j < engine->nbuses; j++) {
+          sweep_bus(&engine->buses[j], 1);
+        }
+        if (engine->publisher != NULL) {
+          flush_publisher_am2321(engine->publisher);
+        }
+        check_allocs(allocs, "the sweep");
+        if (engine->count && engine->count <= ++count) {
+          engine->running = 0;
+        }
+#else
+        drain_engine(engine);
+        // The samples are published at once after all buses are swept, or after the interval at the latest.
+        swept += value;
+        if (engine->publisher != NULL && ((uint64_t)__sync_add_and_fetch(&engine->running, 0) <= swept
+            || engine->publisher->buffered_at + engine->interval * 1000ULL <= monotonic_ns())) {
+          allocs = count_allocs();
+          flush_publisher_am2321(engine->publisher);
+          check_allocs(allocs, "the publish");
+          swept = 0;
+        }
+#endif
+      } else if (events[i].data.u64 != (uint64_t)-1) {
+        serve_exporter_am2321(engine->exporter, epfd, &events[i]);
+      } else if (read(sfd, &info, sizeof(info)) != sizeof(info) || info.ssi_signo == SIGUSR2) {
+        continue;
+#if AM2321_TIMING
+      } else if (info.ssi_signo == SIGHUP) {
+        print_timing_am2321(stderr);
+#endif
+      } else {
+        am2321_stop = 1;
+      }
+    }
+  }
+  if (epfd != -1) {
+    close(epfd);
+  }
+  if (sfd != -1) {
+    close(sfd);
+  }
+#if AM2321_SINGLE_THREAD
+  if (fd != -1) {
+    close(fd);
+  }
+#else
+  stop_workers(engine, started);
+#endif
+#if AM2321_TIMING
+  print_timing_am2321(stderr);
+#endif
+#if AM2321_ALLOC_CHECK
+  printk(KERN_INFO "am2321 : No allocation in %llu sweeps and outputs.\n"
+    , (unsigned long long)__atomic_load_n(&am2321_alloc_checks, __ATOMIC_RELAXED));
+#endif
+
+  return started == engine->nbuses ? 0 : -1;
+}
+
+/*!
+ * @brief Probe TCA9548A at the address, by reading its control register.
+ *
+ * Nothing is written, because the other devices may sit at 0x70 to 0x77,
+ * e.g. HT16K33 or the all call of PCA9685. TCA9548A has the control
+ * register only, so the bytes read are all the same. The devices which
+ * auto-increment their register address are skipped by it.
+ *
+ * @param[in] bus     Number of I2C bus.
+ * @param[in] address I2C slave address of TCA9548A.
+ *
+ * @return Found : 0, Not found : -1
+ */
+static int probe_mux_am2321(int bus, int address) {
+
+  char i2c_dev_name[64], data[2];
+  I2CSlave *mux;
+  int ret;
+
+  sprintf(i2c_dev_name, I2C_DEV, bus);
+  if ((mux = gen_i2c_slave(i2c_dev_name, "tca9548a", address, 1, 3000)) == NULL) {
+    return -1;
+  }
+  if (init_i2c_slave(mux) == -1) {
+    destroy_i2c_slave(mux);
+    return -1;
+  }
+  ret = read_i2c_slave(mux, data, sizeof(data));
+  term_i2c_slave(mux);
+  destroy_i2c_slave(mux);
+  if (ret == -1) {
+    return -1;
+  }
+  if (data[0] != data[1]) {
+    printk(KERN_WARNING "am2321 : 0x%02x on %s does not look like TCA9548A. Skipped.\n", address, i2c_dev_name);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void *scan_worker(void *arg) {
+
+  discover_bus_am2321(arg, 0);
+  return NULL;
+}
+
+/*!
+ * @brief Scan the buses for AM2321, and print the config of the AM2321s found.
+ *
+ * AM2321 at 0x5c is probed on the bus itself and on every channel of every
+ * TCA9548A found at 0x70 to 0x77, by reading its model, version and device
+ * ID. The channels of the muxes found are written to scan behind them.
+ * The buses are scanned in parallel by the thread per bus. The output can
+ * be used as the config of -f, named by the device IDs.
+ *
+ * @param[in] buses  Numbers of I2C buses.
+ * @param[in] nbuses Number of the buses.
+ *
+ * @return Number of AM2321s found, or -1 if failed.
+ */
+int scan_am2321(const int *buses, int nbuses) {
+
+  struct am2321_engine engine;
+  struct am2321 *am2321_data;
+  int i, address, channel, found = 0;
+
+  memset(&engine, 0, sizeof(engine));
+  for (i = 0; i < nbuses; i++) {
+    if (add_sensor_engine(&engine, "", buses[i], AM2321_ID, -1, -1, AM2321_VARIANT_AM2321) == -1) {
+      close_engine(&engine);
+      return -1;
+    }
+    for (address = TCA9548A_ID; address < TCA9548A_ID + TCA9548A_MAX_MUX; address++) {
+      if (probe_mux_am2321(buses[i], address) == -1) {
+        continue;
+      }
+      for (channel = 0; channel < TCA9548A_MAX_CHANNEL; channel++) {
+        if (add_sensor_engine(&engine, "", buses[i], AM2321_ID, address, channel, AM2321_VARIANT_AM2321) == -1) {
+          close_engine(&engine);
+          return -1;
+        }
+      }
+    }
+  }
+  if (open_engine(&engine) == -1) {
+    close_engine(&engine);
+    return -1;
+  }
+
+#if AM2321_SINGLE_THREAD
+  for (i = 0; i < engine.nbuses; i++) {
+    scan_worker(&engine.buses[i]);
+  }
+#else
+  for (i = 0; i < engine.nbuses; i++) {
+    if (pthread_create(&engine.buses[i].thread, NULL, scan_worker, &engine.buses[i]) != 0) {
+      scan_worker(&engine.buses[i]);
+      engine.buses[i].thread = 0;
+    }
+  }
+  for (i = 0; i < engine.nbuses; i++) {
+    if (engine.buses[i].thread != 0) {
+      pthread_join(engine.buses[i].thread, NULL);
+    }
+  }
+#endif
+
+  for (i = 0; i < engine.nsensors; i++) {
+    am2321_data = engine.order[i];
+    if (!am2321_data->discovered) {
+      continue;
+    }
+    found++;
+    printf("# model 0x%04x, version 0x%02x, id 0x%08x\n", am2321_data->model, am2321_data->version, am2321_data->device_id);
+    if (am2321_data->mux_address < 0) {
+      printf("am2321-%08x %d 0x%02x\n", am2321_data->device_id, am2321_data->bus, am2321_data->address);
+    } else {
+      printf("am2321-%08x %d 0x%02x 0x%02x %d\n", am2321_data->device_id, am2321_data->bus, am2321_data->address
+        , am2321_data->mux_address, am2321_data->mux_channel);
+    }
+  }
+  close_engine(&engine);
+
+  return found;
+}
+
+/*!
+ * @brief Get the numbers of all I2C buses. (/dev/i2c-*)
+ *
+ * @param[out] buses The numbers.
+ * @param[in]  max   Max number of the buses.
+ *
+ * @return Number of the buses.
+ */
+int list_buses_am2321(int *buses, int max) {
+
+  DIR *dir;
+  struct dirent *entry;
+  int n = 0, bus;
+  char rest;
+
+  if ((dir = opendir("/dev")) == NULL) {
+    return 0;
+  }
+  while ((entry = readdir(dir)) != NULL && n < max) {
+    if (sscanf(entry->d_name, "i2c-%d%c", &bus, &rest) == 1) {
+      buses[n++] = bus;
+    }
+  }
+  closedir(dir);
+
+  return n;
+}
+
+void print_help(void) {
+
+  printf("Usage: am2321 [OPTION]\n");
+  printf("Receive the data from AM2321 which is I2C Slave device and print the value of temperature, humidity, discomfort index.\n\n");
+  printf("  -c\tPrint the value in CSV format.\n");
+  printf("  -j\tPrint the value in JSON format.\n");
+  printf("  -r\tPrint the value in human readable format.\n");
+  printf("  -d\tRun as daemon, measure and print the value continuously.\n");
+  printf("  -i SEC\tInterval of measurement in daemon mode. (default and minimum : %d)\n", AM2321_WAIT_REFRESH / 1000000);
+  printf("  -m SEC\tMax age of the last conversion to skip the warm-up measurement. 0 to disable. (default : %d)\n", AM2321_MAX_AGE / 1000000);
+  printf("  -F\tPrint the last sample from the state at once, without the bus, while AM2321 has no newer conversion to read.\n");
+  printf("         \tThe state is kept in /run/am2321, or in the directory of the environment variable AM2321_STATE_DIR.\n");
+  printf("  -b BUS\tNumber of I2C bus of AM2321. (default : 1)\n");
+  printf("  -a ADDR\tI2C slave address of AM2321. (default : 0x%02x)\n", AM2321_ID);
+  printf("  -t MODEL\tModel of the sensor, or of the sensors without the model in the config : am2321, am2320, am2322 or dht12. (default : am2321)\n");
+  printf("  -f FILE\tMeasure from the sensors in the config FILE. Each line is :\n");
+  printf("         \t  <name> <bus> <address> [<mux address> <mux channel>] [<model>]\n");
+  printf("         \t  The name is made of [A-Za-z0-9_.-].\n");
+  printf("  -p NAME\tPublish the samples to the ring in the shared memory /dev/shm/NAME. See am2321-shm.h.\n");
+  printf("  -n\tDo not print the values in daemon mode.\n");
+  printf("  -I\tInterleave the measurements of AM2321s on the different channels of the muxes.\n");
+  printf("  -A CPUS\tPin the worker of each bus to the CPU in the list CPUS, e.g. 1,2,3, in the order of the buses.\n");
+  printf("  -T PRIO\tRun the workers in SCHED_FIFO of the priority PRIO, with the memory locked.\n");
+  printf("  -R\tBatch the transfers of AM2321s on a bus in the I2C_RDWR ioctls.\n");
+  printf("  -L\tShare the buses with the other I2C clients by flock on /dev/i2c-N, held only during each transfer.\n");
+  printf("  -w FILE\tAppend the raw frames to the capture FILE in daemon mode.\n");
+  printf("  -H FILE\tAppend the values to the compact history FILE in daemon mode, in the delta encoded blocks of %d bytes.\n", AM2321_HISTORY_BLOCK);
+  printf("  -u\tPrint and append to the history only the values changed from the last ones of each sensor.\n");
+  printf("  -o FORMAT\tStream the values to stdout in FORMAT : ndjson, csv, influx or binary.\n");
+  printf("  -W SEC\tStream min, max, mean, EWMA and quantiles of the values over each window of SEC in place of the values. (default output : ndjson)\n");
+  printf("  -B VALUE\tStream also the values which change by VALUE or more of the temperature or the humidity, with -o or -W.\n");
+  printf("  -U HOST:PORT\tPublish the values to HOST:PORT by UDP, in the records of the binary output batched into the datagrams per sweep.\n");
+  printf("  -Q HOST[:PORT][/TOPIC]\tPublish the values to the broker of MQTT by PUBLISH of QoS0 per sweep, in the records of the binary output. (default : %s/%s)\n", AM2321_MQTT_PORT, AM2321_MQTT_TOPIC);
+  printf("         \tThe values are not printed with -U or -Q, but streamed by -o.\n");
+  printf("  -P PORT\tServe the last values and the counters of errors for Prometheus on http://:PORT/metrics.\n");
+  printf("  -C\tCalibrate the waits of the measurement of each AM2321, and save them to /var/lib/am2321/*.calib.\n");
+  printf("         \tThe directory is overridden by the environment variable AM2321_CALIBRATION_DIR.\n");
+  printf("  -D FILE\tDecode the capture FILE written by -w or the history FILE written by -H, and print the values. (--decode)\n");
+  printf("  -S\tScan the bus of -b, or all buses, for AM2321s also behind TCA9548As, and print the config of them. (--scan)\n");
+  printf("         \tThe devices at 0x70 to 0x77 which look like TCA9548A are written as the mux. Do not scan the bus with the others there.\n");
+  printf("  -h\tShow this message.\n\n");
+  printf("Report bugs to mrkoh_t.bug-report@mem-notfound.net\n");
+}
+
+static const struct option long_options[] = {
+  { "csv", no_argument, NULL, 'c' },
+  { "json", no_argument, NULL, 'j' },
+  { "readable", no_argument, NULL, 'r' },
+  { "daemon", no_argument, NULL, 'd' },
+  { "interval", required_argument, NULL, 'i' },
+  { "max-age", required_argument, NULL, 'm' },
+  { "fast", no_argument, NULL, 'F' },
+  { "bus", required_argument, NULL, 'b' },
+  { "address", required_argument, NULL, 'a' },
+  { "model", required_argument, NULL, 't' },
+  { "config", required_argument, NULL, 'f' },
+  { "publish", required_argument, NULL, 'p' },
+  { "quiet", no_argument, NULL, 'n' },
+  { "interleave", no_argument, NULL, 'I' },
+  { "rdwr", no_argument, NULL, 'R' },
+  { "bus-lock", no_argument, NULL, 'L' },
+  { "affinity", required_argument, NULL, 'A' },
+  { "fifo", required_argument, NULL, 'T' },
+  { "capture", required_argument, NULL, 'w' },
+  { "history", required_argument, NULL, 'H' },
+  { "changes-only", no_argument, NULL, 'u' },
+  { "output", required_argument, NULL, 'o' },
+  { "window", required_argument, NULL, 'W' },
+  { "deadband", required_argument, NULL, 'B' },
+  { "udp", required_argument, NULL, 'U' },
+  { "mqtt", required_argument, NULL, 'Q' },
+  { "metrics-port", required_argument, NULL, 'P' },
+  { "calibrate", no_argument, NULL, 'C' },
+  { "decode", required_argument, NULL, 'D' },
+  { "scan", no_argument, NULL, 'S' },
+  { "help", no_argument, NULL, 'h' },
+  { NULL, 0, NULL, 0 },
+};
+
+int main(int argc, char* argv[]) {
+
+  static char stdout_buf[BUFSIZ];
+  int arg, format = 'r', output = 0, daemon_mode = 0, rdwr = 0, calibrate = 0, port = 0, pipelined = 0, quiet = 0, bus = 1, address = AM2321_ID;
+  int scan = 0, bus_given = 0, buses[256], nbuses, deadband = 0, changes = 0, i;
+  int cpus[64], ncpus = 0, priority = 0, lock = 0, fast = 0, variant = AM2321_VARIANT_AM2321;
+  char *arg_end;
+  long interval = AM2321_WAIT_REFRESH;
+  double window = 0.0;
+  long long max_age = AM2321_MAX_AGE, age;
+  const char *config = NULL, *shm_name = NULL, *capture = NULL, *history = NULL, *decode = NULL, *publish = NULL;
+  int mqtt = 0;
+  struct am2321 am2321_data;
+  struct am2321_bus lock_bus;
+  struct am2321_engine engine;
+
+  while ((arg = getopt_long(argc, argv, "cjrdi:m:Fb:a:t:f:IRLA:T:p:nw:H:uo:W:B:U:Q:P:CD:Sh", long_options, NULL)) != -1) {
+    switch (arg) {
+      case 'd':
+        daemon_mode = 1;
+        break;
+      case 'i':
+        interval = (long)(strtod(optarg, NULL) * 1000000);
+        break;
+      case 'm':
+        max_age = (long long)(strtod(optarg, NULL) * 1000000);
+        break;
+      case 'F':
+        fast = 1;
+        break;
+      case 'b':
+        bus = (int)strtol(optarg, NULL, 0);
+        bus_given = 1;
+        break;
+      case 'a':
+        address = (int)strtol(optarg, NULL, 0);
+        break;
+      case 't':
+        if ((variant = find_variant_am2321(optarg)) == -1) {
+          return 1;
+        }
+        break;
+      case 'f':
+        config = optarg;
+        break;
+      case 'I':
+        pipelined = 1;
+        break;
+      case 'R':
+        rdwr = 1;
+        break;
+      case 'L':
+        lock = 1;
+        break;
+      case 'A':
+        for (ncpus = 0; *optarg != '\0' && ncpus < (int)(sizeof(cpus) / sizeof(cpus[0])); optarg = arg_end + (*arg_end == ',')) {
+          cpus[ncpus++] = (int)strtol(optarg, &arg_end, 0);
+          if (arg_end == optarg || cpus[ncpus - 1] < 0 || CPU_SETSIZE <= cpus[ncpus - 1]) {
+            printk(KERN_ERR "am2321 : Invalid CPU in %s.\n", optarg);
+            return 1;
+          }
+        }
+        break;
+      case 'T':
+        priority = (int)strtol(optarg, NULL, 0);
+        if (priority < sched_get_priority_min(SCHED_FIFO) || sched_get_priority_max(SCHED_FIFO) < priority) {
+          printk(KERN_ERR "am2321 : Invalid priority %s of SCHED_FIFO.\n", optarg);
+          return 1;
+        }
+        break;
+      case 'p':
+        shm_name = optarg;
+        break;
+      case 'n':
+        quiet = 1;
+        break;
+      case 'w':
+        capture = optarg;
+        break;
+      case 'H':
+        history = optarg;
+        break;
+      case 'u':
+        changes = 1;
+        break;
+      case 'o':
+        if ((output = parse_output_am2321(optarg)) == -1) {
+          printk(KERN_ERR "am2321 : Unknown output format %s.\n", optarg);
+          return 1;
+        }
+        break;
+      case 'W':
+        window = strtod(optarg, NULL);
+        break;
+      case 'B':
+        deadband = (int)(strtod(optarg, NULL) * 10 + 0.5);
+        break;
+      case 'U':
+      case 'Q':
+        publish = optarg;
+        mqtt = arg == 'Q';
+        break;
+      case 'P':
+        port = (int)strtol(optarg, NULL, 0);
+        break;
+      case 'C':
+        calibrate = 1;
+        break;
+      case 'D':
+        decode = optarg;
+        break;
+      case 'S':
+        scan = 1;
+        break;
+      case 'h':
+      case '?':
+        print_help();
+        return 1;
+      default:
+        format = arg;
+        break;
+    }
+  }
+  if (interval < AM2321_WAIT_REFRESH) {
+    printk(KERN_WARNING "am2321 : Interval is shorter than the refresh time of am2321. Use %d sec.\n", AM2321_WAIT_REFRESH / 1000000);
+    interval = AM2321_WAIT_REFRESH;
+  }
+
+  if (decode != NULL) {
+    return decode_capture_am2321(decode, format) == -1 ? 1 : 0;
+  }
+  if (scan) {
+    buses[0] = bus;
+    if ((nbuses = bus_given ? 1 : list_buses_am2321(buses, sizeof(buses) / sizeof(buses[0]))) == 0) {
+      printk(KERN_ERR "am2321 : No I2C bus is found.\n");
+      return 1;
+    }
+    return scan_am2321(buses, nbuses) <= 0 ? 1 : 0;
+  }
+  if (fast && (daemon_mode || config != NULL || output != 0 || publish != NULL || calibrate)) {
+    printk(KERN_ERR "am2321 : The fast mode is only for the one-shot.\n");
+    return 1;
+  }
+  if (0.0 < window && output == 0) {
+    output = AM2321_OUTPUT_NDJSON;
+  }
+  if ((0.0 < window || 0 < deadband) && output == AM2321_OUTPUT_BINARY) {
+    printk(KERN_ERR "am2321 : The aggregates and the deadband are not supported in the binary output.\n");
+    return 1;
+  }
+  if (0.0 < window && 0 < deadband && output == AM2321_OUTPUT_CSV) {
+    printk(KERN_ERR "am2321 : The deadband is not supported with the aggregates in CSV, which has the other columns.\n");
+    return 1;
+  }
+
+  if (daemon_mode || config != NULL || output != 0 || publish != NULL || calibrate) {
+    // The buffer of stdout is not allocated at the first output of the samples.
+    setvbuf(stdout, stdout_buf, isatty(STDOUT_FILENO) ? _IOLBF : _IOFBF, sizeof(stdout_buf));
+    memset(&engine, 0, sizeof(engine));
+    engine.format = format;
+    engine.interval = interval;
+    engine.pipelined = pipelined;
+    engine.rdwr = rdwr;
+    engine.variant = variant;
+    engine.lock = lock;
+    engine.quiet = quiet || publish != NULL;
+    engine.cpus = ncpus != 0 ? cpus : NULL;
+    engine.ncpus = ncpus;
+    engine.priority = priority;
+    engine.count = daemon_mode ? 0 : 1;
+    if (config != NULL) {
+      if (load_config_engine(&engine, config) == -1) {
+        close_engine(&engine);
+        return 1;
+      }
+    } else {
+      add_sensor_engine(&engine, "", bus, address, -1, -1, variant);
+    }
+    if (open_engine(&engine) == -1) {
+      printf("Failed open the session to AM2321.\n");
+      close_engine(&engine);
+      return 1;
+    }
+    if (calibrate) {
+      arg = calibrate_engine(&engine);
+      close_engine(&engine);
+      return arg == -1 ? 1 : 0;
+    }
+    if (shm_name != NULL && (engine.ring = create_ring_am2321(shm_name)) == NULL) {
+      close_engine(&engine);
+      return 1;
+    }
+    if (capture != NULL && (engine.capture = open_capture_am2321(capture)) == NULL) {
+      close_engine(&engine);
+      return 1;
+    }
+    if (history != NULL && (engine.history = open_history_am2321(history, engine.nsensors, changes ? AM2321_HISTORY_CHANGES : 0)) == NULL) {
+      close_engine(&engine);
+      return 1;
+    }
+    if (changes) {
+      if ((engine.last = malloc(engine.nsensors * sizeof(uint32_t))) == NULL) {
+        close_engine(&engine);
+        return 1;
+      }
+      // Not any values of 10 times.
+      memset(engine.last, 0xff, engine.nsensors * sizeof(uint32_t));
+    }
+    if (output != 0 && (engine.writer = open_writer_am2321(STDOUT_FILENO, 0.0 < window ? output | AM2321_OUTPUT_STATS : output)) == NULL) {
+      close_engine(&engine);
+      return 1;
+    }
+    if (output != 0 && (0.0 < window || 0 < deadband)) {
+      if ((engine.stats = calloc(engine.nsensors, sizeof(struct am2321_stats))) == NULL) {
+        close_writer_am2321(engine.writer);
+        close_engine(&engine);
+        return 1;
+      }
+      engine.window = (uint64_t)(window * 1000000000.0);
+      engine.deadband = deadband;
+      // EWMA over the number of the samples in the window.
+      for (i = 0; i < engine.nsensors; i++) {
+        init_stats_am2321(&engine.stats[i], 0.0 < window ? 2.0 / (window * 1000000.0 / interval + 1.0) : 1.0);
+      }
+    }
+    if (port != 0 && (engine.exporter = open_exporter_am2321(port, engine.sensors, engine.nsensors)) == NULL) {
+      if (engine.writer != NULL) {
+        close_writer_am2321(engine.writer);
+      }
+      free(engine.stats);
+      close_engine(&engine);
+      return 1;
+    }
+    if (publish != NULL && (engine.publisher = open_publisher_am2321(publish, mqtt)) == NULL) {
+      if (engine.exporter != NULL) {
+        close_exporter_am2321(engine.exporter);
+      }
+      if (engine.writer != NULL) {
+        close_writer_am2321(engine.writer);
+      }
+      free(engine.stats);
+      close_engine(&engine);
+      return 1;
+    }
+    run_engine(&engine);
+    if (engine.publisher != NULL) {
+      close_publisher_am2321(engine.publisher);
+    }
+    if (engine.exporter != NULL) {
+      close_exporter_am2321(engine.exporter);
+    }
+    if (engine.stats != NULL) {
+      // The windows not closed yet.
+      for (i = 0; engine.window != 0 && i < engine.nsensors; i++) {
+        write_stats_am2321(engine.writer, &engine.stats[i], &engine.samples[i]);
+      }
+      free(engine.stats);
+    }
+    if (engine.writer != NULL) {
+      close_writer_am2321(engine.writer);
+    }
+    if (engine.ring != NULL) {
+      destroy_ring_am2321(engine.ring, shm_name);
+    }
+    if (engine.capture != NULL) {
+      close_capture_am2321(engine.capture);
+    }
+    if (engine.history != NULL) {
+      close_history_am2321(engine.history);
+    }
+    free(engine.last);
+    close_engine(&engine);
+    return 0;
+  }
+
+  memset(&am2321_data, 0, sizeof(am2321_data));
+  am2321_data.mux_address = -1;
+  am2321_data.bus = bus;
+  am2321_data.address = address;
+  am2321_data.variant = variant;
+  // The warm-up measurement is needed only when the last conversion is too old.
+  age = load_state_am2321(&am2321_data);
+  // AM2321 returns the same conversion until the refresh time. So the fast mode prints it
+  // from the state, without opening the bus.
+  if (fast && 0 <= age && age < AM2321_WAIT_REFRESH && check_crc(&am2321_data) == 0) {
+    print_am2321(&am2321_data, format);
+    return 0;
+  }
+
+  if (open_am2321(&am2321_data, bus, address, variant, -1, 0) == -1) {
+    printf("Failed open the session to AM2321.\n");
+    return 1;
+  }
+  memset(&lock_bus, 0, sizeof(lock_bus));
+  lock_bus.bus = bus;
+  lock_bus.lock_fd = -1;
+  if (lock) {
+    open_lock_am2321(&lock_bus);
+  }
+  share_bus_am2321(&am2321_data, lock_bus.lock_fd, NULL, NULL);
+  load_calibration_am2321(&am2321_data);
+
+  if (age < 0 || max_age < age) {
+    measure_retry(&am2321_data);
+    age = 0;
+  }
+  if (age < AM2321_WAIT_REFRESH) {
+    usleep(AM2321_WAIT_REFRESH - age);
+  }
+  if (measure_retry(&am2321_data) == -1) {
+    printf("Failed measure data from AM2321.\n");
+  } else {
+    save_state_am2321(&am2321_data);
+    print_am2321(&am2321_data, format);
+  }
+  close_am2321(&am2321_data);
+  if (lock_bus.lock_fd != -1) {
+    close(lock_bus.lock_fd);
+  }
+#if AM2321_TIMING
+  print_timing_am2321(stderr);
+#endif
+
+  return 0;
+}
@@ -0,0 +1,442 @@
+/*!
+ *
+ * Decode of the frames received from AM2321 : CRC, error code and the values.
+ *
+ * Included from am2321.h. The functions are built into libam2321 by default.
+ * When AM2321_HEADER_ONLY is defined before the include, they are defined
+ * here as static inline instead, so the hot decode path of the collector is
+ * inlined without the call into the library :
+ *
+ *   #define AM2321_HEADER_ONLY
+ *   #include "am2321.h"
+ *
+ * The frames of the other variants, e.g. DHT12, are converted to the frame
+ * of AM2321 once at the read by the converter of the descriptor, e.g.
+ * convert_sum_am2321(), so the decode of the values, the captures and the
+ * collectors are the same for all variants.
+ *
+ * @file am2321-decode.h
+ */
+#ifndef AM2321_DECODE_H
+#define AM2321_DECODE_H
+
+#include "am2321.h"
+
+#define AM2321_X10_LEN 16             // Buffer size for format_x10().
+
+#if defined(AM2321_HEADER_ONLY)
+  #define AM2321_INLINE static inline
+#else
+  #define AM2321_INLINE
+#endif
+
+#if defined(AM2321_HEADER_ONLY) || defined(AM2321_DECODE_IMPLEMENTATION)
+#if !MODULE && !defined(printk)
+  #define printk(...) fprintf(stderr, __VA_ARGS__)
+  #define KERN_NOTICE ""
+  #define KERN_ERR ""
+#endif
+
+/*!
+ * @brief Calculate the value of humidity in 0.1 %RH, without floating point.
+ *
+ * @param[in] am2321_data The data of received from AM2321.
+ *
+ * @return The value of calculated humidity of 10 times.
+ */
+AM2321_INLINE int calc_hum_x10(struct am2321 *am2321_data) {
+
+  const uint8_t *data = (const uint8_t *)am2321_data->register_data;
+
+  return (data[2] << 8) | data[3];
+}
+
+/*!
+ * @brief Calculate the value of temperature in 0.1 degC, without floating point.
+ *
+ * AM2321 sets the MSB of the temperature when it is negative.
+ *
+ * @param[in] am2321_data The data of received from AM2321.
+ *
+ * @return The value of calculated temperature of 10 times.
+ */
+AM2321_INLINE int calc_temp_x10(struct am2321 *am2321_data) {
+
+  const uint8_t *data = (const uint8_t *)am2321_data->register_data;
+  int value = ((data[4] & 0x7f) << 8) | data[5];
+
+  return (data[4] & 0x80) ? -value : value;
+}
+
+/*!
+ * @brief Calculate the discomfort index of 10 times from the values of 10 times.
+ *
+ * 0.81T + 0.01H(0.99T - 14.3) + 46.3 is calculated in 1/1000000 unit as
+ * 9t(11h + 9000) - 14300h + 46300000 with t = 10T and h = 10H, so that every
+ * product fits in 16 bit x 16 bit = 32 bit. The values are clamped to the
+ * range of AM2321 (-40.0 to 80.0 degC, 0.0 to 100.0 %RH) not to overflow.
+ * The result is rounded half up. The bulk decoder uses exactly the same steps.
+ *
+ * @param[in] temp Temperature of 10 times.
+ * @param[in] hum  Humidity of 10 times.
+ *
+ * @return The discomfort index of 10 times.
+ */
+AM2321_INLINE int discomfort_x10(int temp, int hum) {
+
+  int t = temp < -400 ? -400 : 800 < temp ? 800 : temp;
+  int h = hum < 0 || 32767 < hum ? 0 : 1000 < hum ? 1000 : hum;
+  int32_t micro = 9 * t * (11 * h + 9000) - 14300 * h + 46300000;
+
+  // Offset by 1000.0 to divide the positive value.
+  return (micro + 50000 + 100000000) / 100000 - 1000;
+}
+
+/*!
+ * @brief Calculate the discomfort index of 10 times, without floating point.
+ *
+ * @param[in] am2321_data The data of received from AM2321.
+ *
+ * @return The value of calculated discomfort index of 10 times.
+ */
+AM2321_INLINE int calc_discomfort_x10(struct am2321 *am2321_data) {
+
+  return discomfort_x10(calc_temp_x10(am2321_data), calc_hum_x10(am2321_data));
+}
+
+/*!
+ * @brief Format the value of 10 times as the decimal with 1 digit after the point.
+ *
+ * This is used instead of printf("%.1f") not to use floating point.
+ *
+ * @param[out] buf   Buffer of AM2321_X10_LEN bytes at least.
+ * @param[in]  value The value of 10 times.
+ *
+ * @return Length of the formatted string.
+ */
+AM2321_INLINE int format_x10(char *buf, int value) {
+
+  char digits[12];
+  unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+  int len = 0, n = 0;
+
+  if (value < 0) {
+    buf[len++] = '-';
+  }
+  digits[n++] = '0' + magnitude % 10;
+  magnitude /= 10;
+  do {
+    digits[n++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude != 0);
+  while (n > 1) {
+    buf[len++] = digits[--n];
+  }
+  buf[len++] = '.';
+  buf[len++] = digits[0];
+  buf[len] = '\0';
+
+  return len;
+}
+
+#if !MODULE
+/*!
+ * @brief Calculate the value of temperature and humidity.
+ *
+ * @param[in] high High-order bit received from AM2321.
+ * @param[in] low  Low-order bit received from AM2321.
+ *
+ * @return The value of calculated.
+ */
+AM2321_INLINE double calc_data(unsigned char high, unsigned char low) {
+
+  return ((high << 8) | low) / 10.0;
+}
+
+/*!
+ * @brief Calculate the value of humidity.
+ *
+ * @param[in] am2321_data The data of received from AM2321.
+ *
+ * @return The value of calculated humidity.
+ */
+AM2321_INLINE double calc_hum(struct am2321 *am2321_data) {
+
+  return calc_hum_x10(am2321_data) / 10.0;
+}
+
+/*!
+ * @brief Calculate the value of temperature.
+ *
+ * @param[in] am2321_data The data of received from AM2321.
+ *
+ * @return The value of calculated temperature.
+ */
+AM2321_INLINE double calc_temp(struct am2321 *am2321_data) {
+
+  return calc_temp_x10(am2321_data) / 10.0;
+}
+
+/*!
+ * @brief Calcute the value of discomfort index from AM2321.
+ * See : http://ja.wikipedia.org/wiki/%E4%B8%8D%E5%BF%AB%E6%8C%87%E6%95%B0
+ *
+ * @param[in] am2321_data The data of received from AM2321.
+ *
+ * @return The value of calculated discomfort index.
+ */
+AM2321_INLINE double calc_discomfort(struct am2321 *am2321_data) {
+
+  double hum, temp;
+  hum = calc_hum(am2321_data);
+  temp = calc_temp(am2321_data);
+
+  return 0.81 * temp + 0.01 * hum * (0.99 * temp - 14.3) + 46.3;
+}
+#endif
+
+/*!
+ * @brief Check the error from received data from AM2321.
+ *
+ * AM2321 sets the MSB of the function code at the error, and returns the
+ * error code in place of the length.
+ *
+ * @param[in] am2321_data The data of received from AM2321.
+ *
+ * @return The data is not error : 0, The data is error : -1
+ */
+AM2321_INLINE int check_err(struct am2321 *am2321_data) {
+
+  const uint8_t *data = (const uint8_t *)am2321_data->register_data;
+
+  if (data[0] & 0x80) {
+    printk(KERN_ERR "am2321 : Received error code : 0x%0x\n", data[1]);
+    return -1;
+  } else {
+    return 0;
+  }
+}
+
+/*
+ * Tables of CRC-16 (Modbus) generated by the preprocessor.
+ *
+ * The CRC is linear, so each entry is XOR of the entries of its bits.
+ * crc16_table[k][1 << b] is the CRC of the bit b followed by k zero bytes,
+ * thus crc16_table[0] is the usual byte-wise table, and crc16_table[1..3]
+ * are the tables for slicing-by-4.
+ */
+#define CRC16_BIT(i, b, v) ((((i) >> (b)) & 1) ? (v) : 0)
+#define CRC16_ENTRY(i, v0, v1, v2, v3, v4, v5, v6, v7) \
+  (CRC16_BIT(i, 0, v0) ^ CRC16_BIT(i, 1, v1) ^ CRC16_BIT(i, 2, v2) ^ CRC16_BIT(i, 3, v3) \
+  ^ CRC16_BIT(i, 4, v4) ^ CRC16_BIT(i, 5, v5) ^ CRC16_BIT(i, 6, v6) ^ CRC16_BIT(i, 7, v7))
+#define CRC16_T0(i) CRC16_ENTRY(i, 0xc0c1, 0xc181, 0xc301, 0xc601, 0xcc01, 0xd801, 0xf001, 0xa001)
+#define CRC16_T1(i) CRC16_ENTRY(i, 0x9001, 0x6001, 0xc002, 0xc007, 0xc00d, 0xc019, 0xc031, 0xc061)
+#define CRC16_T2(i) CRC16_ENTRY(i, 0xc051, 0xc0a1, 0xc141, 0xc281, 0xc501, 0xca01, 0xd401, 0xe801)
+#define CRC16_T3(i) CRC16_ENTRY(i, 0xfc01, 0xb801, 0x3001, 0x6002, 0xc004, 0xc00b, 0xc015, 0xc029)
+#define CRC16_ROW(t, n) \
+  t((n) + 0x0), t((n) + 0x1), t((n) + 0x2), t((n) + 0x3), t((n) + 0x4), t((n) + 0x5), t((n) + 0x6), t((n) + 0x7), \
+  t((n) + 0x8), t((n) + 0x9), t((n) + 0xa), t((n) + 0xb), t((n) + 0xc), t((n) + 0xd), t((n) + 0xe), t((n) + 0xf)
+#define CRC16_TABLE(t) { \
+  CRC16_ROW(t, 0x00), CRC16_ROW(t, 0x10), CRC16_ROW(t, 0x20), CRC16_ROW(t, 0x30), \
+  CRC16_ROW(t, 0x40), CRC16_ROW(t, 0x50), CRC16_ROW(t, 0x60), CRC16_ROW(t, 0x70), \
+  CRC16_ROW(t, 0x80), CRC16_ROW(t, 0x90), CRC16_ROW(t, 0xa0), CRC16_ROW(t, 0xb0), \
+  CRC16_ROW(t, 0xc0), CRC16_ROW(t, 0xd0), CRC16_ROW(t, 0xe0), CRC16_ROW(t, 0xf0) }
+
+static const uint16_t crc16_table[4][256] = {
+  CRC16_TABLE(CRC16_T0),
+  CRC16_TABLE(CRC16_T1),
+  CRC16_TABLE(CRC16_T2),
+  CRC16_TABLE(CRC16_T3),
+};
+
+/*!
+ * @brief Calculate CRC-16 (Modbus) bit by bit, without tables.
+ *
+ * Kept as the reference of crc16_modbus().
+ *
+ * @param[in] data The data to calculate.
+ * @param[in] len  Length of the data.
+ *
+ * @return CRC of the data.
+ */
+AM2321_INLINE uint16_t crc16_modbus_bitwise(const uint8_t *data, size_t len) {
+
+  uint16_t crc = 0xffff;
+  size_t i;
+  int j;
+
+  for (i = 0; i < len; i++) {
+    crc ^= data[i];
+    for (j = 0; j < 8; j++) {
+      if (crc & 1) {
+        crc = (crc >> 1) ^ 0xa001;
+      } else {
+        crc = crc >> 1;
+      }
+    }
+  }
+  return crc;
+}
+
+/*!
+ * @brief Calculate CRC-16 (Modbus) byte by byte with the table.
+ *
+ * @param[in] data The data to calculate.
+ * @param[in] len  Length of the data.
+ *
+ * @return CRC of the data.
+ */
+AM2321_INLINE uint16_t crc16_modbus_bytewise(const uint8_t *data, size_t len) {
+
+  uint16_t crc = 0xffff;
+
+  while (len--) {
+    crc = (crc >> 8) ^ crc16_table[0][(crc ^ *data++) & 0xff];
+  }
+  return crc;
+}
+
+/*!
+ * @brief Calculate CRC-16 (Modbus) of the frame of AM2321.
+ *
+ * Four bytes are processed at once by slicing-by-4, and the rest byte by byte.
+ * This is used for both of the received frames and the frames to write.
+ *
+ * @param[in] data The data to calculate.
+ * @param[in] len  Length of the data.
+ *
+ * @return CRC of the data.
+ */
+AM2321_INLINE uint16_t crc16_modbus(const uint8_t *data, size_t len) {
+
+  uint16_t crc = 0xffff;
+
+  for (; len >= 4; data += 4, len -= 4) {
+    crc ^= data[0] | (data[1] << 8);
+    crc = crc16_table[3][crc & 0xff] ^ crc16_table[2][crc >> 8]
+      ^ crc16_table[1][data[2]] ^ crc16_table[0][data[3]];
+  }
+  while (len--) {
+    crc = (crc >> 8) ^ crc16_table[0][(crc ^ *data++) & 0xff];
+  }
+  return crc;
+}
+
+/*!
+ * @brief Calculate and check the CRC from received data from AM2321.
+ *
+ * @param[in] am2321_data The data of received from AM2321.
+ *
+ * @return CRC check is OK : 0, CRC check is NG : -1
+ */
+AM2321_INLINE int check_crc(struct am2321 *am2321_data) {
+
+  const uint8_t *data = (const uint8_t *)am2321_data->register_data;
+  uint16_t rcv_crcsum = (data[7] << 8) | data[6];
+  uint16_t clc_crcsum = crc16_modbus(data, 6);
+
+  if (rcv_crcsum != clc_crcsum) {
+    printk(KERN_NOTICE "am2321 : Failed CRC check sum. Receive CRC : 0x%0x, Calc CRC : 0x%0x\n", rcv_crcsum, clc_crcsum);
+    return -1;
+  }
+  return 0;
+}
+#else
+AM2321_INLINE int calc_hum_x10(struct am2321 *am2321_data);
+AM2321_INLINE int calc_temp_x10(struct am2321 *am2321_data);
+AM2321_INLINE int discomfort_x10(int temp, int hum);
+AM2321_INLINE int calc_discomfort_x10(struct am2321 *am2321_data);
+AM2321_INLINE int format_x10(char *buf, int value);
+#if !MODULE
+AM2321_INLINE double calc_data(unsigned char high, unsigned char low);
+AM2321_INLINE double calc_hum(struct am2321 *am2321_data);
+AM2321_INLINE double calc_temp(struct am2321 *am2321_data);
+AM2321_INLINE double calc_discomfort(struct am2321 *am2321_data);
+#endif
+AM2321_INLINE int check_err(struct am2321 *am2321_data);
+AM2321_INLINE uint16_t crc16_modbus_bitwise(const uint8_t *data, size_t len);
+AM2321_INLINE uint16_t crc16_modbus_bytewise(const uint8_t *data, size_t len);
+AM2321_INLINE uint16_t crc16_modbus(const uint8_t *data, size_t len);
+AM2321_INLINE int check_crc(struct am2321 *am2321_data);
+#endif
+
+/*!
+ * @brief Convert the frame of AM2321 read from the sensor. See am2321_descriptor.convert.
+ *
+ * The frame of AM2321 is kept as it is, and checked by check_crc() later.
+ *
+ * @param[in,out] frame The frame read, in the buffer of 8 bytes.
+ *
+ * @return Successed : 0
+ */
+static inline int convert_modbus_am2321(char *frame) {
+
+  (void)frame;
+  return 0;
+}
+
+/*!
+ * @brief Convert the frame of DHT12 read from the sensor to the frame of AM2321. See am2321_descriptor.convert.
+ *
+ * The frame is checked by its sum here, and rewritten with the values of
+ * 10 times and the CRC of AM2321.
+ *
+ * @param[in,out] frame The frame of 5 bytes read, in the buffer of 8 bytes.
+ *
+ * @return Successed : 0, The sum is mismatched : -1
+ */
+static inline int convert_sum_am2321(char *frame) {
+
+  uint8_t *data = (uint8_t *)frame;
+  uint16_t crc;
+  int hum, temp;
+
+  if ((uint8_t)(data[0] + data[1] + data[2] + data[3]) != data[4]) {
+    return -1;
+  }
+  // DHT12 sets the MSB of the decimal of the temperature when it is negative.
+  hum = data[0] * 10 + data[1] % 10;
+  temp = data[2] * 10 + (data[3] & 0x7f) % 10;
+  data[0] = 0x03;
+  data[1] = 0x04;
+  data[4] = ((temp >> 8) & 0x7f) | (data[3] & 0x80);
+  data[5] = temp & 0xff;
+  data[2] = hum >> 8;
+  data[3] = hum & 0xff;
+  crc = crc16_modbus(data, 6);
+  data[6] = crc & 0xff;
+  data[7] = crc >> 8;
+  return 0;
+}
+
+/*!
+ * The descriptors of the variants, in the order of AM2321_VARIANT_*.
+ *
+ * AM2320, AM2321 and AM2322 differ only in the waits. AM2320 needs 1.5 ms
+ * after the request. DHT12 is always awake, and its registers are read
+ * by the register address written, without the function code.
+ */
+static const struct am2321_descriptor am2321_descriptors[AM2321_VARIANTS] = {
+  { "am2321", AM2321_ID, AM2321_FRAME_MODBUS, 1, 1,
+    { AM2321_WAIT_WAKEUP, AM2321_WAIT_WRITEMODE, AM2321_WAIT_READMODE }, { 0x03, 0x00, 0x04 }, 3, 8, convert_modbus_am2321 },
+  { "am2320", AM2321_ID, AM2321_FRAME_MODBUS, 1, 1,
+    { AM2321_WAIT_WAKEUP, AM2321_WAIT_WRITEMODE, 1500 }, { 0x03, 0x00, 0x04 }, 3, 8, convert_modbus_am2321 },
+  { "am2322", AM2321_ID, AM2321_FRAME_MODBUS, 1, 1,
+    { AM2321_WAIT_WAKEUP, AM2321_WAIT_WRITEMODE, AM2321_WAIT_READMODE }, { 0x03, 0x00, 0x04 }, 3, 8, convert_modbus_am2321 },
+  { "dht12", AM2321_ID, AM2321_FRAME_SUM, 0, 0,
+    { 0, 0, AM2321_WAIT_READMODE }, { 0x00 }, 1, 5, convert_sum_am2321 },
+};
+
+/*!
+ * @brief Get the descriptor of the variant of AM2321.
+ *
+ * @param[in] am2321_data The session to AM2321, opened by open_am2321().
+ *
+ * @return The descriptor.
+ */
+static inline const struct am2321_descriptor *descriptor_am2321(const struct am2321 *am2321_data) {
+
+  return am2321_data->descriptor;
+}
+
+#endif
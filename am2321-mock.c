@@ -0,0 +1,378 @@
+/*!
+ *
+ * Mock of the I2C slave functions of lib/i2c-ctl.h, with the simulated AM2321.
+ * See am2321-mock.h.
+ *
+ * @file am2321-mock.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "lib/i2c-ctl.h"
+#include "am2321.h"
+#include "am2321-mock.h"
+
+#define AM2321_MOCK_REGISTERS 0x20
+#define AM2321_MOCK_MODEL 0x2321
+#define AM2321_MOCK_VERSION 0x01
+#define AM2321_MOCK_IDLE 3000000    // AM2321 returns to suspend mode after 3sec.
+
+/*!
+ * States of the simulated AM2321.
+ */
+enum am2321_mock_state {
+  AM2321_MOCK_SLEEP = 0,
+  AM2321_MOCK_WAKING,       // Woken up, but does not ACK until config.wakeup.
+  AM2321_MOCK_WRITEMODE,    // Waits for the request.
+  AM2321_MOCK_REQUESTED,    // Converts, and the frame is ready at config.convert.
+};
+
+/*!
+ * The simulated AM2321, behind an I2CSlave.
+ */
+struct am2321_mock_slave {
+
+  int address;
+  int opened;
+  int state;                // AM2321_MOCK_*
+  uint64_t since;           // Time of the last change of the state. (usec)
+  unsigned int seed;
+  uint8_t start;            // Register of the request.
+  uint8_t len;              // Length of the request.
+  uint8_t control;          // Control register of the other addresses, e.g. TCA9548A.
+  uint8_t registers[AM2321_MOCK_REGISTERS];
+};
+
+static struct am2321_mock_config mock_config = {
+  AM2321_MOCK_BUS_TIME, 0.0, 0.0, 400, 900, 10, 245, 500, 0,
+};
+static pthread_once_t mock_once = PTHREAD_ONCE_INIT;
+static uint64_t mock_syscalls;
+static uint32_t mock_serial;
+
+/*!
+ * @brief Get the time of CLOCK_MONOTONIC in microseconds.
+ */
+static uint64_t now_mock(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*!
+ * @brief Load the config from the environment variable AM2321_MOCK.
+ */
+static void load_config_mock(void) {
+
+  char *env = getenv("AM2321_MOCK"), *copy, *item, *save, *value;
+
+  if (env == NULL || (copy = strdup(env)) == NULL) {
+    return;
+  }
+  for (item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+    if ((value = strchr(item, '=')) == NULL) {
+      continue;
+    }
+    *value++ = '\0';
+    if (strcmp(item, "latency") == 0) {
+      mock_config.latency = atoi(value);
+    } else if (strcmp(item, "nack") == 0) {
+      mock_config.nack = atof(value);
+    } else if (strcmp(item, "crc") == 0) {
+      mock_config.crc = atof(value);
+    } else if (strcmp(item, "wakeup") == 0) {
+      mock_config.wakeup = atoi(value);
+    } else if (strcmp(item, "ready") == 0) {
+      mock_config.ready = atoi(value);
+    } else if (strcmp(item, "convert") == 0) {
+      mock_config.convert = atoi(value);
+    } else if (strcmp(item, "temperature") == 0) {
+      mock_config.temperature = atoi(value);
+    } else if (strcmp(item, "humidity") == 0) {
+      mock_config.humidity = atoi(value);
+    } else if (strcmp(item, "dht12") == 0) {
+      mock_config.dht12 = atoi(value);
+    } else {
+      fprintf(stderr, "am2321 : Unknown config of the mock : %s\n", item);
+    }
+  }
+  free(copy);
+}
+
+/*!
+ * @brief Set the config of the simulated AM2321s. It takes effect at once.
+ *
+ * @param[in] config The config.
+ */
+void config_mock_am2321(const struct am2321_mock_config *config) {
+
+  pthread_once(&mock_once, load_config_mock);
+  mock_config = *config;
+}
+
+/*!
+ * @brief Get the config of the simulated AM2321s.
+ *
+ * @param[out] config The config.
+ */
+void get_config_mock_am2321(struct am2321_mock_config *config) {
+
+  pthread_once(&mock_once, load_config_mock);
+  *config = mock_config;
+}
+
+/*!
+ * @brief Get the count of the syscalls which lib/i2c-ctl.c would call.
+ *
+ * init_i2c_slave() is counted as 2 (open and ioctl of I2C_SLAVE),
+ * term_i2c_slave() as 1 (close), and each transfer as 1.
+ *
+ * @return The count.
+ */
+uint64_t syscalls_mock_am2321(void) {
+
+  return __atomic_load_n(&mock_syscalls, __ATOMIC_RELAXED);
+}
+
+/*!
+ * @brief Spend the latency of the transfer of the bytes, as the bus does.
+ */
+static void transfer_mock(int len) {
+
+  int latency = mock_config.latency;
+  uint64_t end;
+
+  __atomic_fetch_add(&mock_syscalls, 1, __ATOMIC_RELAXED);
+  if (latency == AM2321_MOCK_BUS_TIME) {
+    // The address and the data, 9 bits each at 10usec.
+    latency = (len + 1) * 90;
+  }
+  end = now_mock() + latency;
+  while (now_mock() < end);
+}
+
+/*!
+ * @brief Get true at the rate.
+ */
+static int chance_mock(struct am2321_mock_slave *slave, double rate) {
+
+  return rate > 0.0 && rand_r(&slave->seed) < rate * ((double)RAND_MAX + 1.0);
+}
+
+/*!
+ * @brief Update the registers of the humidity and the temperature, with a little noise.
+ */
+static void convert_mock(struct am2321_mock_slave *slave) {
+
+  int hum = mock_config.humidity + rand_r(&slave->seed) % 5 - 2;
+  int temp = mock_config.temperature + rand_r(&slave->seed) % 3 - 1;
+  int magnitude = temp < 0 ? -temp : temp;
+
+  hum = hum < 0 ? 0 : 1000 < hum ? 1000 : hum;
+  slave->registers[0x00] = hum >> 8;
+  slave->registers[0x01] = hum & 0xff;
+  // AM2321 sets the MSB of the temperature when it is negative.
+  slave->registers[0x02] = ((magnitude >> 8) & 0x7f) | (temp < 0 ? 0x80 : 0);
+  slave->registers[0x03] = magnitude & 0xff;
+}
+
+I2CSlave *gen_i2c_slave(char *dev_name, char *name, int addr, int retry, int timeout) {
+
+  struct am2321_mock_slave *slave;
+  uint32_t id;
+
+  (void)dev_name;
+  (void)name;
+  (void)retry;
+  (void)timeout;
+  pthread_once(&mock_once, load_config_mock);
+  if ((slave = calloc(1, sizeof(struct am2321_mock_slave))) == NULL) {
+    return NULL;
+  }
+  id = __atomic_add_fetch(&mock_serial, 1, __ATOMIC_RELAXED);
+  slave->address = addr;
+  slave->seed = id * 2654435761u;
+  slave->registers[0x08] = AM2321_MOCK_MODEL >> 8;
+  slave->registers[0x09] = AM2321_MOCK_MODEL & 0xff;
+  slave->registers[0x0a] = AM2321_MOCK_VERSION;
+  slave->registers[0x0b] = id >> 24;
+  slave->registers[0x0c] = id >> 16;
+  slave->registers[0x0d] = id >> 8;
+  slave->registers[0x0e] = id;
+  convert_mock(slave);
+  return (I2CSlave *)slave;
+}
+
+int init_i2c_slave(I2CSlave *s) {
+
+  struct am2321_mock_slave *slave = (struct am2321_mock_slave *)s;
+
+  __atomic_fetch_add(&mock_syscalls, 2, __ATOMIC_RELAXED);
+  slave->opened = 1;
+  return 0;
+}
+
+int term_i2c_slave(I2CSlave *s) {
+
+  struct am2321_mock_slave *slave = (struct am2321_mock_slave *)s;
+
+  __atomic_fetch_add(&mock_syscalls, 1, __ATOMIC_RELAXED);
+  slave->opened = 0;
+  return 0;
+}
+
+int destroy_i2c_slave(I2CSlave *s) {
+
+  free(s);
+  return 0;
+}
+
+/*!
+ * @brief Write to the simulated DHT12. Only the register address is accepted.
+ */
+static int write_dht12_mock(struct am2321_mock_slave *slave, const uint8_t *buf, int len, uint64_t now) {
+
+  if (chance_mock(slave, mock_config.nack)) {
+    errno = EREMOTEIO;
+    return -1;
+  }
+  if (len == 0) {
+    return 0;
+  }
+  if (len != 1 || buf[0] != 0x00) {
+    errno = EREMOTEIO;
+    return -1;
+  }
+  slave->start = 0;
+  slave->len = 5;
+  slave->state = AM2321_MOCK_REQUESTED;
+  slave->since = now;
+  return 0;
+}
+
+/*!
+ * @brief Read the frame of DHT12 from the simulated one : the integers and the decimals, and the sum.
+ */
+static void read_dht12_mock(struct am2321_mock_slave *slave, uint8_t *frame) {
+
+  int hum = (slave->registers[0x00] << 8) | slave->registers[0x01];
+  int temp = ((slave->registers[0x02] & 0x7f) << 8) | slave->registers[0x03];
+
+  frame[0] = hum / 10;
+  frame[1] = hum % 10;
+  frame[2] = temp / 10;
+  // DHT12 sets the MSB of the decimal of the temperature when it is negative.
+  frame[3] = (temp % 10) | (slave->registers[0x02] & 0x80);
+  frame[4] = frame[0] + frame[1] + frame[2] + frame[3];
+}
+
+int write_i2c_slave(I2CSlave *s, char *data, int len) {
+
+  struct am2321_mock_slave *slave = (struct am2321_mock_slave *)s;
+  const uint8_t *buf = (const uint8_t *)data;
+  uint64_t now;
+  int state;
+
+  if (!slave->opened) {
+    errno = EBADF;
+    return -1;
+  }
+  transfer_mock(len);
+  if (slave->address != AM2321_ID) {
+    if (len > 0) {
+      slave->control = buf[len - 1];
+    }
+    return 0;
+  }
+  now = now_mock();
+  if (mock_config.dht12) {
+    return write_dht12_mock(slave, buf, len, now);
+  }
+  state = slave->state;
+  if (state != AM2321_MOCK_SLEEP && AM2321_MOCK_IDLE < now - slave->since) {
+    state = AM2321_MOCK_SLEEP;
+  }
+
+  // AM2321 in suspend mode wakes up, but NACKs.
+  if (state == AM2321_MOCK_SLEEP) {
+    slave->state = AM2321_MOCK_WAKING;
+    slave->since = now;
+    errno = EREMOTEIO;
+    return -1;
+  }
+  if (chance_mock(slave, mock_config.nack)) {
+    errno = EREMOTEIO;
+    return -1;
+  }
+  if (len == 0) {
+    if (state == AM2321_MOCK_WAKING && now - slave->since < (uint64_t)mock_config.wakeup) {
+      errno = EREMOTEIO;
+      return -1;
+    }
+    slave->state = AM2321_MOCK_WRITEMODE;
+    slave->since = now;
+    return 0;
+  }
+  // Only the read of the registers : 0x03, start, length.
+  if (state != AM2321_MOCK_WRITEMODE || now - slave->since < (uint64_t)mock_config.ready
+      || len != 3 || buf[0] != 0x03 || AM2321_MOCK_REGISTERS < buf[1] + buf[2] || buf[2] == 0) {
+    errno = EREMOTEIO;
+    return -1;
+  }
+  slave->start = buf[1];
+  slave->len = buf[2];
+  slave->state = AM2321_MOCK_REQUESTED;
+  slave->since = now;
+  return 0;
+}
+
+int read_i2c_slave(I2CSlave *s, char *data, int len) {
+
+  struct am2321_mock_slave *slave = (struct am2321_mock_slave *)s;
+  uint8_t frame[AM2321_MOCK_REGISTERS + 4];
+  uint16_t crc;
+  int n, size;
+
+  if (!slave->opened) {
+    errno = EBADF;
+    return -1;
+  }
+  transfer_mock(len);
+  if (slave->address != AM2321_ID) {
+    memset(data, slave->control, len);
+    return 0;
+  }
+  if (slave->state != AM2321_MOCK_REQUESTED || chance_mock(slave, mock_config.nack)) {
+    errno = EREMOTEIO;
+    return -1;
+  }
+
+  convert_mock(slave);
+  if (mock_config.dht12) {
+    read_dht12_mock(slave, frame);
+    size = 5;
+  } else {
+    frame[0] = 0x03;
+    frame[1] = slave->len;
+    memcpy(frame + 2, slave->registers + slave->start, slave->len);
+    crc = crc16_modbus(frame, slave->len + 2);
+    frame[slave->len + 2] = crc & 0xff;
+    frame[slave->len + 3] = crc >> 8;
+    size = slave->len + 4;
+  }
+  // The frame is not ready yet, or broken on the bus. DHT12 is always ready.
+  if ((!mock_config.dht12 && now_mock() - slave->since < (uint64_t)mock_config.convert) || chance_mock(slave, mock_config.crc)) {
+    frame[rand_r(&slave->seed) % size] ^= 1 << (rand_r(&slave->seed) % 8);
+  }
+  n = size < len ? size : len;
+  memcpy(data, frame, n);
+  memset(data + n, 0xff, len - n);
+  slave->state = AM2321_MOCK_SLEEP;
+  return 0;
+}
@@ -0,0 +1,53 @@
+/*!
+ *
+ * Mock of the I2C slave functions of lib/i2c-ctl.h, with the simulated AM2321.
+ *
+ * am2321-mock.c is linked in place of lib/i2c-ctl.c, e.g. by the benchmark
+ * or by "make I2C_CTL=am2321-mock.c", to measure libam2321 without the
+ * hardware. Each I2CSlave generated is an AM2321 in memory, which behaves
+ * as the real one does :
+ *
+ *   - It is in suspend mode first, and NACKs the wakeup.
+ *   - It NACKs the write mode before config.wakeup after the wakeup.
+ *   - It NACKs the request before config.ready after the write mode.
+ *   - The frame read before config.convert after the request is broken.
+ *   - It is in suspend mode again after the frame is read.
+ *
+ * With config.dht12, it behaves as DHT12 instead, which is always awake and
+ * returns the 5 bytes with the sum after the register address is written.
+ * The other addresses behave as TCA9548A : the last byte written is read
+ * back as the control register.
+ * The config is set by config_mock_am2321(), or by the environment variable
+ * AM2321_MOCK at the first gen_i2c_slave(), e.g.
+ * AM2321_MOCK="latency=0,nack=0.01,crc=0.001".
+ *
+ * @file am2321-mock.h
+ */
+#ifndef AM2321_MOCK_H
+#define AM2321_MOCK_H
+
+#include <stdint.h>
+
+#define AM2321_MOCK_BUS_TIME -1   // Latency : The time of the transfer on the bus of 100kHz.
+
+/*!
+ * The config of the simulated AM2321s.
+ */
+struct am2321_mock_config {
+
+  int latency;              // Latency of each transfer in microseconds, or AM2321_MOCK_BUS_TIME.
+  double nack;              // Rate of the transfers NACKed at random. 0.0 to 1.0
+  double crc;               // Rate of the frames broken at random. 0.0 to 1.0
+  int wakeup;               // Microseconds from the wakeup until AM2321 ACKs.
+  int ready;                // Microseconds from the write mode until AM2321 accepts the request.
+  int convert;              // Microseconds from the request until the frame is ready.
+  int temperature;          // Temperature of 10 times.
+  int humidity;             // Humidity of 10 times.
+  int dht12;                // Simulate DHT12 in place of AM2321.
+};
+
+void config_mock_am2321(const struct am2321_mock_config *config);
+void get_config_mock_am2321(struct am2321_mock_config *config);
+uint64_t syscalls_mock_am2321(void);
+
+#endif
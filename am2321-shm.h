@@ -0,0 +1,192 @@
+/*!
+ *
+ * Ring buffer of the samples from AM2321 in POSIX shared memory.
+ *
+ * The am2321 daemon started with -p NAME is the only producer, and any
+ * number of consumers read the samples from /dev/shm/NAME without syscalls
+ * and without the access to the I2C bus :
+ *
+ *   struct am2321_ring *ring = am2321_ring_attach("am2321");
+ *   struct am2321_sample sample;
+ *
+ *   if (am2321_ring_latest(ring, &sample) == 0) {
+ *     printf("%s : %.1f\n", sample.name, sample.temperature);
+ *   }
+ *   am2321_ring_detach(ring);
+ *
+ * @file am2321-shm.h
+ */
+#ifndef AM2321_SHM_H
+#define AM2321_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define AM2321_SHM_MAGIC 0x4d533232   // "22SM"
+#define AM2321_SHM_VERSION 1
+#define AM2321_SHM_CAPACITY 1024      // Slots of the ring. Must be the power of 2.
+
+/*!
+ * A sample from AM2321.
+ */
+struct am2321_sample {
+
+  uint64_t timestamp;       // Time of the frame is received. (CLOCK_MONOTONIC, nsec)
+  uint64_t realtime;        // Same time in CLOCK_REALTIME. (nsec)
+  char name[32];            // Name of AM2321 in the config.
+  int32_t bus;
+  int32_t address;
+  char register_data[8];    // The raw frame received from AM2321.
+  double temperature;
+  double humidity;
+  double discomfort;
+};
+
+/*!
+ * A slot of the ring. seq is odd while the producer is writing the sample,
+ * and is 2 * (position + 1) after the sample at the position is written.
+ */
+struct am2321_slot {
+
+  uint64_t seq;
+  struct am2321_sample sample;
+};
+
+/*!
+ * The header of the shared memory, followed by the slots.
+ */
+struct am2321_ring {
+
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;
+  uint32_t slot_size;
+  uint64_t head;            // Count of the samples written.
+  uint64_t reserved[5];     // The slots begin at the next cache line.
+  struct am2321_slot slots[];
+};
+
+/*!
+ * @brief Get the size of the shared memory of the ring.
+ *
+ * @param[in] capacity Slots of the ring.
+ *
+ * @return The size in bytes.
+ */
+static inline size_t am2321_ring_size(uint32_t capacity) {
+
+  return sizeof(struct am2321_ring) + sizeof(struct am2321_slot) * capacity;
+}
+
+/*!
+ * @brief Attach the ring published by the am2321 daemon, read only.
+ *
+ * @param[in] name Name of the shared memory. (-p NAME of the daemon)
+ *
+ * @return The ring, or NULL if failed.
+ */
+static inline struct am2321_ring *am2321_ring_attach(const char *name) {
+
+  struct am2321_ring *ring;
+  struct stat st;
+  char path[256];
+  int fd;
+
+  path[0] = '/';
+  strncpy(path + 1, name, sizeof(path) - 2);
+  path[sizeof(path) - 1] = '\0';
+  if ((fd = shm_open(path, O_RDONLY, 0)) == -1) {
+    return NULL;
+  }
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct am2321_ring)) {
+    close(fd);
+    return NULL;
+  }
+  ring = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED) {
+    return NULL;
+  }
+  if (ring->magic != AM2321_SHM_MAGIC || ring->version != AM2321_SHM_VERSION
+      || ring->slot_size != sizeof(struct am2321_slot)
+      || (size_t)st.st_size < am2321_ring_size(ring->capacity)) {
+    munmap(ring, st.st_size);
+    return NULL;
+  }
+  return ring;
+}
+
+/*!
+ * @brief Detach the ring attached by am2321_ring_attach().
+ *
+ * @param[in] ring The ring.
+ */
+static inline void am2321_ring_detach(struct am2321_ring *ring) {
+
+  munmap(ring, am2321_ring_size(ring->capacity));
+}
+
+/*!
+ * @brief Get the count of the samples written to the ring.
+ *
+ * The samples from head - capacity to head - 1 can be read.
+ *
+ * @param[in] ring The ring.
+ *
+ * @return The count.
+ */
+static inline uint64_t am2321_ring_head(const struct am2321_ring *ring) {
+
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+/*!
+ * @brief Read the sample at the position from the ring.
+ *
+ * @param[in]  ring     The ring.
+ * @param[in]  position Position of the sample. 0 is the first sample written.
+ * @param[out] sample   The sample read.
+ *
+ * @return Successed : 0, Not written yet or overwritten already : -1
+ */
+static inline int am2321_ring_read(const struct am2321_ring *ring, uint64_t position, struct am2321_sample *sample) {
+
+  const struct am2321_slot *slot = &ring->slots[position & (ring->capacity - 1)];
+  uint64_t seq = 2 * (position + 1);
+
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) {
+    return -1;
+  }
+  memcpy(sample, &slot->sample, sizeof(struct am2321_sample));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+    return -1;
+  }
+  return 0;
+}
+
+/*!
+ * @brief Read the latest sample from the ring.
+ *
+ * @param[in]  ring   The ring.
+ * @param[out] sample The sample read.
+ *
+ * @return Successed : 0, No sample : -1
+ */
+static inline int am2321_ring_latest(const struct am2321_ring *ring, struct am2321_sample *sample) {
+
+  uint64_t head;
+
+  while ((head = am2321_ring_head(ring)) != 0) {
+    if (am2321_ring_read(ring, head - 1, sample) == 0) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+#endif
@@ -1,6 +1,9 @@
 /*!
  *
- * Receive and print the value of temperature and humidity from AM2321 sold by Akizuki-denshi.
+ * Receive the value of temperature and humidity from AM2321 sold by Akizuki-denshi.
+ *
+ * This is libam2321 in userland, and the kernel module am2321.ko when
+ * built by Kbuild. The command is in am2321-cli.c.
  *
  * @file am2321.c
  *
@@ -8,41 +11,86 @@
  * @author Kodai Tooi
  * @version 1.0
  */
-#include "lib/i2c-ctl.h"
-#include <unistd.h>
+#define AM2321_DECODE_IMPLEMENTATION  // The decode functions of am2321-decode.h are defined here.
 
 #if MODULE
   #include <linux/kernel.h>
   #include <linux/module.h>
   #include <linux/errno.h>
   #include <linux/fs.h>
+  #include <linux/types.h>
+  #include <linux/ktime.h>
+  #include <linux/i2c.h>
+  #include <linux/delay.h>
+  #include <linux/slab.h>
+  #include <linux/poll.h>
+  #include <linux/wait.h>
+  #include <linux/spinlock.h>
+  #include <linux/uaccess.h>
+  #include <linux/workqueue.h>
+  #include "am2321.h"
+  //カーネルでも動くようにするための、関数・型の再定義
+  #define usleep(usec) usleep_range((usec), (usec) + (usec) / 10 + 10)
+  #define monotonic_ns() ktime_get_ns()
+  // The adapter is locked by the I2C core in each transfer.
+  #define lock_bus_am2321(fd) ((void)(fd))
+  #define unlock_bus_am2321(fd) ((void)(fd))
+  #define lock_session_am2321(am2321_data) 0
+
+  static inline int write_i2c_slave(I2CSlave *i2c_slave, char *data, int len) {
+
+    return i2c_master_send(i2c_slave, data, len) == len ? 0 : -1;
+  }
+
+  static inline int read_i2c_slave(I2CSlave *i2c_slave, char *data, int len) {
+
+    return i2c_master_recv(i2c_slave, data, len) == len ? 0 : -1;
+  }
 #else
+  #include <unistd.h>
   #include <string.h>
   #include <stdio.h>
   #include <stdlib.h>
+  #include <stdint.h>
+  #include <math.h>
+  #include <time.h>
+  #include <fcntl.h>
+  #include <errno.h>
+  #include <sys/file.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/timerfd.h>
   //ユーザランドでも動くようにするための、関数・定数の再定義
   #define printk(...) fprintf(stderr, __VA_ARGS__)
   #define KERN_INFO ""
   #define KERN_NOTICE ""
   #define KERN_WARNING ""
   #define KERN_ERR ""
+  #include "am2321.h"
 #endif
 
-#define I2C_DEV "/dev/i2c-%d"
-
-#define AM2321_ID 0x5c
-#define AM2321_DEV_NAME "am2321"
-#define I2C_SLAVE_MAX_RETRY 5
-#define AM2321_WAIT_WAKEUP 800      // 800 to 3000
-#define AM2321_WAIT_WRITEMODE 1500  // up to 1500
-#define AM2321_WAIT_READMODE 30     // up to 30
-#define AM2321_WAIT_REFRESH 2000000 // up to 2000000(= 2sec)
-
-struct am2321 {
-
-  char register_data[8];
-  // register_data の取得時刻とか。
-};
+#define AM2321_RETRY_BACKOFF 10000       // Base of exponential backoff of retry. (= 10msec)
+#define AM2321_RETRY_BACKOFF_MAX 1000000 // up to 1000000(= 1sec)
+#define AM2321_CALIBRATE_TRIALS 8   // Measurements which must succeed to accept the wait.
+#define AM2321_CALIBRATE_STEP 10    // Resolution of the calibration in microseconds.
+#define AM2321_CALIBRATE_SPACING 100000 // Interval between the trials of the calibration.
+#define AM2321_FALLBACK_FAILURES 3  // Failures in the last 32 measurements to fall back to the safe waits.
+#define AM2321_STATE_DIR "/run/am2321"   // Cleared by the reboot, as the conversion. See dir_am2321().
+#define AM2321_STATE_FILE "%s/%d-%02x.state"
+#define AM2321_STATE_MAGIC 0x32333231 // "1232"
+#define AM2321_CALIBRATION_DIR "/var/lib/am2321"  // See dir_am2321().
+#define AM2321_CALIBRATION_FILE "%s/%d-%02x.calib"
+#define AM2321_CALIBRATION_MUX_FILE "%s/%d-%02x-%02x-%d.calib" // Behind TCA9548A.
+#define AM2321_CALIBRATION_MAGIC 0x32333243 // "C232"
+#define AM2321_CAPTURE_MAGIC "AM2321RF"
+#define AM2321_CAPTURE_VERSION 1
+#define AM2321_CAPTURE_FLUSH 10000000   // Max time to keep the records in the buffer. (= 10sec)
+#define AM2321_DECODE_BATCH 1024      // Frames decoded at once by decode_capture_am2321().
+#define AM2321_HISTORY_FLUSH 600000000 // Max time to keep the records of the history not written. (= 10min)
+#define AM2321_HISTORY_RECORD_MAX 19  // The varints of 16, 64, 17 and 17 bits.
+#define AM2321_OUTPUT_FLUSH 1000000   // Max time to keep the records in the buffer of the writer. (= 1sec)
+#define AM2321_OUTPUT_RECORD_MAX 1024 // Max length of a record of the writer.
+#define AM2321_STATS_FIELDS 7         // min, max, mean, ewma, p50, p90 and p99.
 
 #if MODULE
 static struct am2321 *cur_data;
@@ -84,273 +132,3182 @@ int wakeup_am2321(I2CSlave *i2c_slave) {
   return 0;
 }
 
-/*!
- * @brief Calculate the value of temperature and humidity.
- *
- * @param[in] high High-order bit received from AM2321.
- * @param[in] low  Low-order bit received from AM2321.
+#if !MODULE
+/*
+ * Bulk decoder of the frames.
  *
- * @return The value of calculated.
+ * The frames are transposed into the planes of bytes, i.e. the structure of
+ * arrays, and 8 (SSE2, NEON) or 16 (AVX2) frames are decoded at once in the
+ * lanes of 16 bit. CRC is calculated bit by bit in all lanes in parallel.
+ * The rest of the frames are decoded by the scalar code, which gives the
+ * same results.
+ */
+#if defined(__AVX2__)
+  #include <immintrin.h>
+  #define AM2321_BULK_LANES 16
+#elif defined(__SSE2__)
+  #include <emmintrin.h>
+  #define AM2321_BULK_LANES 8
+#elif defined(__ARM_NEON)
+  #include <arm_neon.h>
+  #define AM2321_BULK_LANES 8
+#else
+  #define AM2321_BULK_LANES 1
+#endif
+
+/*!
+ * @brief Decode a frame by the scalar code.
  */
-double calc_data(char high, char low) {
+static void decode_bulk_scalar(const char *frame, struct am2321_bulk *out, size_t i) {
+
+  const uint8_t *data = (const uint8_t *)frame;
+  struct am2321 am2321_data;
 
-  return ((high << 8) + low) / 10.0;
+  memcpy(am2321_data.register_data, frame, sizeof(am2321_data.register_data));
+  out->temperature[i] = calc_temp_x10(&am2321_data);
+  out->humidity[i] = calc_hum_x10(&am2321_data);
+  out->discomfort[i] = discomfort_x10(out->temperature[i], out->humidity[i]);
+  out->status[i] = (crc16_modbus(data, 6) != ((data[7] << 8) | data[6]) ? AM2321_BULK_CRC : 0)
+    | (data[0] & 0x80 ? AM2321_BULK_ERR : 0);
 }
 
+#if defined(__SSE2__)
 /*!
- * @brief Calculate the value of humidity.
- *
- * @param[in] am2321_data The data of received from AM2321.
- *
- * @return The value of calculated humidity.
+ * @brief Transpose 8 frames into 8 planes of the bytes in 16 bit lanes.
+ */
+static inline void transpose_bulk_sse2(const char (*frames)[8], __m128i plane[8]) {
+
+  const __m128i zero = _mm_setzero_si128();
+  __m128i t0, t1, t2, t3, u0, u1, u2, u3, v;
+
+  t0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)frames[0]), _mm_loadl_epi64((const __m128i *)frames[1]));
+  t1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)frames[2]), _mm_loadl_epi64((const __m128i *)frames[3]));
+  t2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)frames[4]), _mm_loadl_epi64((const __m128i *)frames[5]));
+  t3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)frames[6]), _mm_loadl_epi64((const __m128i *)frames[7]));
+  u0 = _mm_unpacklo_epi16(t0, t1);
+  u1 = _mm_unpackhi_epi16(t0, t1);
+  u2 = _mm_unpacklo_epi16(t2, t3);
+  u3 = _mm_unpackhi_epi16(t2, t3);
+
+  v = _mm_unpacklo_epi32(u0, u2);
+  plane[0] = _mm_unpacklo_epi8(v, zero);
+  plane[1] = _mm_unpackhi_epi8(v, zero);
+  v = _mm_unpackhi_epi32(u0, u2);
+  plane[2] = _mm_unpacklo_epi8(v, zero);
+  plane[3] = _mm_unpackhi_epi8(v, zero);
+  v = _mm_unpacklo_epi32(u1, u3);
+  plane[4] = _mm_unpacklo_epi8(v, zero);
+  plane[5] = _mm_unpackhi_epi8(v, zero);
+  v = _mm_unpackhi_epi32(u1, u3);
+  plane[6] = _mm_unpacklo_epi8(v, zero);
+  plane[7] = _mm_unpackhi_epi8(v, zero);
+}
+#endif
+
+#if defined(__AVX2__)
+/*!
+ * @brief Divide 32 bit lanes of 0 to 2^29 by 100000, as (x * 2814749768) >> 48.
+ */
+static inline __m256i div100000_avx2(__m256i x) {
+
+  const __m256i m = _mm256_set1_epi32((int)2814749768u);
+  __m256i even = _mm256_srli_epi64(_mm256_mul_epu32(x, m), 48);
+  __m256i odd = _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), m), 48);
+
+  return _mm256_or_si256(even, _mm256_slli_epi64(odd, 32));
+}
+
+/*!
+ * @brief Decode 16 frames. See discomfort_x10() for the steps of the discomfort index.
+ */
+static void decode_bulk_16(const char (*frames)[8], struct am2321_bulk *out, size_t i) {
+
+  const __m256i one = _mm256_set1_epi16(1), poly = _mm256_set1_epi16((short)0xa001);
+  __m128i lo[8], hi[8], status;
+  __m256i plane[8], crc, ok, err, temp, hum, t, h, a, b, ql, qh, di, status16;
+  int j, k;
+
+  transpose_bulk_sse2(frames, lo);
+  transpose_bulk_sse2(frames + 8, hi);
+  for (j = 0; j < 8; j++) {
+    plane[j] = _mm256_set_m128i(hi[j], lo[j]);
+  }
+
+  crc = _mm256_set1_epi16((short)0xffff);
+  for (j = 0; j < 6; j++) {
+    crc = _mm256_xor_si256(crc, plane[j]);
+    for (k = 0; k < 8; k++) {
+      __m256i mask = _mm256_cmpeq_epi16(_mm256_and_si256(crc, one), one);
+      crc = _mm256_xor_si256(_mm256_srli_epi16(crc, 1), _mm256_and_si256(mask, poly));
+    }
+  }
+  ok = _mm256_cmpeq_epi16(crc, _mm256_or_si256(plane[6], _mm256_slli_epi16(plane[7], 8)));
+  err = _mm256_srli_epi16(_mm256_and_si256(plane[0], _mm256_set1_epi16(0x80)), 6);
+  status16 = _mm256_or_si256(_mm256_andnot_si256(ok, one), err);
+
+  hum = _mm256_or_si256(_mm256_slli_epi16(plane[2], 8), plane[3]);
+  temp = _mm256_or_si256(_mm256_slli_epi16(plane[4], 8), plane[5]);
+  a = _mm256_srai_epi16(temp, 15);
+  temp = _mm256_sub_epi16(_mm256_xor_si256(_mm256_and_si256(temp, _mm256_set1_epi16(0x7fff)), a), a);
+
+  t = _mm256_min_epi16(_mm256_max_epi16(temp, _mm256_set1_epi16(-400)), _mm256_set1_epi16(800));
+  h = _mm256_min_epi16(_mm256_max_epi16(hum, _mm256_setzero_si256()), _mm256_set1_epi16(1000));
+  a = _mm256_mullo_epi16(t, _mm256_set1_epi16(9));
+  b = _mm256_add_epi16(_mm256_mullo_epi16(h, _mm256_set1_epi16(11)), _mm256_set1_epi16(9000));
+  // 9t * (11h + 9000) + h * -14300 in 32 bit lanes.
+  ql = _mm256_madd_epi16(_mm256_unpacklo_epi16(a, h), _mm256_unpacklo_epi16(b, _mm256_set1_epi16(-14300)));
+  qh = _mm256_madd_epi16(_mm256_unpackhi_epi16(a, h), _mm256_unpackhi_epi16(b, _mm256_set1_epi16(-14300)));
+  ql = div100000_avx2(_mm256_add_epi32(ql, _mm256_set1_epi32(46300000 + 50000 + 100000000)));
+  qh = div100000_avx2(_mm256_add_epi32(qh, _mm256_set1_epi32(46300000 + 50000 + 100000000)));
+  di = _mm256_sub_epi16(_mm256_packs_epi32(ql, qh), _mm256_set1_epi16(1000));
+
+  _mm256_storeu_si256((__m256i *)(out->temperature + i), temp);
+  _mm256_storeu_si256((__m256i *)(out->humidity + i), hum);
+  _mm256_storeu_si256((__m256i *)(out->discomfort + i), di);
+  status = _mm_packs_epi16(_mm256_castsi256_si128(status16), _mm256_extracti128_si256(status16, 1));
+  _mm_storeu_si128((__m128i *)(out->status + i), status);
+}
+
+#elif defined(__SSE2__)
+/*!
+ * @brief Divide 32 bit lanes of 0 to 2^29 by 100000, as (x * 2814749768) >> 48.
+ */
+static inline __m128i div100000_sse2(__m128i x) {
+
+  const __m128i m = _mm_set1_epi32((int)2814749768u);
+  __m128i even = _mm_srli_epi64(_mm_mul_epu32(x, m), 48);
+  __m128i odd = _mm_srli_epi64(_mm_mul_epu32(_mm_srli_epi64(x, 32), m), 48);
+
+  return _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+}
+
+/*!
+ * @brief Decode 8 frames. See discomfort_x10() for the steps of the discomfort index.
+ */
+static void decode_bulk_8(const char (*frames)[8], struct am2321_bulk *out, size_t i) {
+
+  const __m128i one = _mm_set1_epi16(1), poly = _mm_set1_epi16((short)0xa001);
+  __m128i plane[8], crc, ok, err, temp, hum, t, h, a, b, ql, qh, di, status16;
+  int j, k;
+
+  transpose_bulk_sse2(frames, plane);
+
+  crc = _mm_set1_epi16((short)0xffff);
+  for (j = 0; j < 6; j++) {
+    crc = _mm_xor_si128(crc, plane[j]);
+    for (k = 0; k < 8; k++) {
+      __m128i mask = _mm_cmpeq_epi16(_mm_and_si128(crc, one), one);
+      crc = _mm_xor_si128(_mm_srli_epi16(crc, 1), _mm_and_si128(mask, poly));
+    }
+  }
+  ok = _mm_cmpeq_epi16(crc, _mm_or_si128(plane[6], _mm_slli_epi16(plane[7], 8)));
+  err = _mm_srli_epi16(_mm_and_si128(plane[0], _mm_set1_epi16(0x80)), 6);
+  status16 = _mm_or_si128(_mm_andnot_si128(ok, one), err);
+
+  hum = _mm_or_si128(_mm_slli_epi16(plane[2], 8), plane[3]);
+  temp = _mm_or_si128(_mm_slli_epi16(plane[4], 8), plane[5]);
+  a = _mm_srai_epi16(temp, 15);
+  temp = _mm_sub_epi16(_mm_xor_si128(_mm_and_si128(temp, _mm_set1_epi16(0x7fff)), a), a);
+
+  t = _mm_min_epi16(_mm_max_epi16(temp, _mm_set1_epi16(-400)), _mm_set1_epi16(800));
+  h = _mm_min_epi16(_mm_max_epi16(hum, _mm_setzero_si128()), _mm_set1_epi16(1000));
+  a = _mm_mullo_epi16(t, _mm_set1_epi16(9));
+  b = _mm_add_epi16(_mm_mullo_epi16(h, _mm_set1_epi16(11)), _mm_set1_epi16(9000));
+  // 9t * (11h + 9000) + h * -14300 in 32 bit lanes.
+  ql = _mm_madd_epi16(_mm_unpacklo_epi16(a, h), _mm_unpacklo_epi16(b, _mm_set1_epi16(-14300)));
+  qh = _mm_madd_epi16(_mm_unpackhi_epi16(a, h), _mm_unpackhi_epi16(b, _mm_set1_epi16(-14300)));
+  ql = div100000_sse2(_mm_add_epi32(ql, _mm_set1_epi32(46300000 + 50000 + 100000000)));
+  qh = div100000_sse2(_mm_add_epi32(qh, _mm_set1_epi32(46300000 + 50000 + 100000000)));
+  di = _mm_sub_epi16(_mm_packs_epi32(ql, qh), _mm_set1_epi16(1000));
+
+  _mm_storeu_si128((__m128i *)(out->temperature + i), temp);
+  _mm_storeu_si128((__m128i *)(out->humidity + i), hum);
+  _mm_storeu_si128((__m128i *)(out->discomfort + i), di);
+  _mm_storel_epi64((__m128i *)(out->status + i), _mm_packs_epi16(status16, status16));
+}
+
+#elif defined(__ARM_NEON)
+/*!
+ * @brief Divide 32 bit lanes of 0 to 2^29 by 100000, as (x * 2814749768) >> 48.
+ */
+static inline uint32x4_t div100000_neon(uint32x4_t x) {
+
+  const uint32x2_t m = vdup_n_u32(2814749768u);
+  uint32x2_t lo = vmovn_u64(vshrq_n_u64(vmull_u32(vget_low_u32(x), m), 48));
+  uint32x2_t hi = vmovn_u64(vshrq_n_u64(vmull_u32(vget_high_u32(x), m), 48));
+
+  return vcombine_u32(lo, hi);
+}
+
+/*!
+ * @brief Decode 8 frames. See discomfort_x10() for the steps of the discomfort index.
  */
-double calc_hum(struct am2321 *am2321_data) {
+static void decode_bulk_8(const char (*frames)[8], struct am2321_bulk *out, size_t i) {
+
+  const uint16x8_t one = vdupq_n_u16(1), poly = vdupq_n_u16(0xa001);
+  const int32x4_t offset = vdupq_n_s32(46300000 + 50000 + 100000000);
+  uint8x16x4_t bytes;
+  uint8x16x2_t half;
+  uint16x8_t plane[8], crc, ok, err, hum, status16;
+  int16x8_t temp, sign, t, h, a, b;
+  int32x4_t ql, qh;
+  int16x4_t dl, dh;
+  int j, k;
+
+  // Bytes 0 to 3 and 4 to 7 of the frames are interleaved in bytes.val[j].
+  bytes = vld4q_u8((const uint8_t *)frames);
+  for (j = 0; j < 4; j++) {
+    half = vuzpq_u8(bytes.val[j], bytes.val[j]);
+    plane[j] = vmovl_u8(vget_low_u8(half.val[0]));
+    plane[j + 4] = vmovl_u8(vget_low_u8(half.val[1]));
+  }
+
+  crc = vdupq_n_u16(0xffff);
+  for (j = 0; j < 6; j++) {
+    crc = veorq_u16(crc, plane[j]);
+    for (k = 0; k < 8; k++) {
+      crc = veorq_u16(vshrq_n_u16(crc, 1), vandq_u16(vtstq_u16(crc, one), poly));
+    }
+  }
+  ok = vceqq_u16(crc, vorrq_u16(plane[6], vshlq_n_u16(plane[7], 8)));
+  err = vshrq_n_u16(vandq_u16(plane[0], vdupq_n_u16(0x80)), 6);
+  status16 = vorrq_u16(vbicq_u16(one, ok), err);
+
+  hum = vorrq_u16(vshlq_n_u16(plane[2], 8), plane[3]);
+  temp = vreinterpretq_s16_u16(vorrq_u16(vshlq_n_u16(plane[4], 8), plane[5]));
+  sign = vshrq_n_s16(temp, 15);
+  temp = vsubq_s16(veorq_s16(vandq_s16(temp, vdupq_n_s16(0x7fff)), sign), sign);
 
-  return calc_data(am2321_data->register_data[2], am2321_data->register_data[3]);
+  t = vminq_s16(vmaxq_s16(temp, vdupq_n_s16(-400)), vdupq_n_s16(800));
+  h = vminq_s16(vmaxq_s16(vreinterpretq_s16_u16(hum), vdupq_n_s16(0)), vdupq_n_s16(1000));
+  a = vmulq_n_s16(t, 9);
+  b = vmlaq_n_s16(vdupq_n_s16(9000), h, 11);
+  // 9t * (11h + 9000) - 14300h in 32 bit lanes.
+  ql = vmlsl_n_s16(vmull_s16(vget_low_s16(a), vget_low_s16(b)), vget_low_s16(h), 14300);
+  qh = vmlsl_n_s16(vmull_s16(vget_high_s16(a), vget_high_s16(b)), vget_high_s16(h), 14300);
+  ql = vreinterpretq_s32_u32(div100000_neon(vreinterpretq_u32_s32(vaddq_s32(ql, offset))));
+  qh = vreinterpretq_s32_u32(div100000_neon(vreinterpretq_u32_s32(vaddq_s32(qh, offset))));
+  dl = vqmovn_s32(vsubq_s32(ql, vdupq_n_s32(1000)));
+  dh = vqmovn_s32(vsubq_s32(qh, vdupq_n_s32(1000)));
+
+  vst1q_s16(out->temperature + i, temp);
+  vst1q_u16(out->humidity + i, hum);
+  vst1q_s16(out->discomfort + i, vcombine_s16(dl, dh));
+  vst1_u8(out->status + i, vmovn_u16(status16));
 }
+#endif
 
 /*!
- * @brief Calculate the value of temperature.
+ * @brief Validate and decode the frames in bulk.
  *
- * @param[in] am2321_data The data of received from AM2321.
+ * Each frame is checked as check_crc() and check_err() do, but without the
+ * messages, and decoded to the values of 10 times as calc_temp_x10(),
+ * calc_hum_x10() and calc_discomfort_x10() do.
+ *
+ * @param[in]  frames The frames received from AM2321. (register_data)
+ * @param[in]  n      Number of the frames.
+ * @param[out] out    The arrays to store the values, of n elements each.
  *
- * @return The value of calculated temperature.
+ * @return Number of the frames whose status is OK.
  */
-double calc_temp(struct am2321 *am2321_data) {
+size_t decode_bulk_am2321(const char (*frames)[8], size_t n, struct am2321_bulk *out) {
+
+  size_t i = 0, valid = 0;
+
+#if AM2321_BULK_LANES == 16
+  for (; i + 16 <= n; i += 16) {
+    decode_bulk_16(frames + i, out, i);
+  }
+#elif AM2321_BULK_LANES == 8
+  for (; i + 8 <= n; i += 8) {
+    decode_bulk_8(frames + i, out, i);
+  }
+#endif
+  for (; i < n; i++) {
+    decode_bulk_scalar(frames[i], out, i);
+  }
 
-  return calc_data(am2321_data->register_data[4], am2321_data->register_data[5]);
+  for (i = 0; i < n; i++) {
+    valid += out->status[i] == 0;
+  }
+  return valid;
 }
+#endif
 
+#if !MODULE
 /*!
- * @brief Calcute the value of discomfort index from AM2321.
- * See : http://ja.wikipedia.org/wiki/%E4%B8%8D%E5%BF%AB%E6%8C%87%E6%95%B0
+ * @brief Get the time of CLOCK_MONOTONIC.
  *
- * @param[in] am2321_data The data of received from AM2321.
+ * @return The time in nanoseconds.
+ */
+uint64_t monotonic_ns(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*!
+ * @brief Get the time of CLOCK_REALTIME.
  *
- * @return The value of calculated discomfort index.
+ * @return The time in nanoseconds.
  */
-double calc_discomfort(struct am2321 *am2321_data) {
+uint64_t realtime_ns(void) {
 
-  double hum, temp;
-  hum = calc_hum(am2321_data);
-  temp = calc_temp(am2321_data);
+  struct timespec ts;
 
-  return 0.81 * temp + 0.01 * hum * (0.99 * temp - 14.3) + 46.3;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 /*!
- * @brief Check the error from received data from AM2321.
+ * @brief Lock the bus to share it with the other I2C clients, for a transfer.
  *
- * @param[in] am2321_data The data of received from AM2321.
+ * The lock is flock(LOCK_EX) on /dev/i2c-<bus>, which the other clients
+ * also take around their transfers. It is advisory, so the clients which
+ * do not take it are not blocked.
  *
- * @return The data is not error : 0, The data is error : -1
+ * @param[in] fd The file descriptor of /dev/i2c-<bus>. -1 : Not locked.
  */
-int check_err(struct am2321 *am2321_data) {
+void lock_bus_am2321(int fd) {
 
-  if (am2321_data->register_data[2] >= 0x80) {
-    printk(KERN_ERR "am2321 : Received error code : 0x%0x\n", am2321_data->register_data[2]);
-    return -1;
-  } else {
-    return 0;
+  if (fd == -1) {
+    return;
   }
+  while (flock(fd, LOCK_EX) == -1 && errno == EINTR);
 }
 
 /*!
- * @brief Calculate and check the CRC from received data from AM2321.
- *
- * @param[in] am2321_data The data of received from AM2321.
+ * @brief Unlock the bus locked by lock_bus_am2321().
  *
- * @return CRC check is OK : 0, CRC check is NG : -1
+ * @param[in] fd The file descriptor of /dev/i2c-<bus>. -1 : Not locked.
  */
-int check_crc(struct am2321 *am2321_data) {
-
-  int rcv_crcsum = (am2321_data->register_data[7] << 8) + am2321_data->register_data[6];
-  int clc_crcsum = 0xffff;
-  int i, j, ret;
+void unlock_bus_am2321(int fd) {
 
-  for (i = 0; i < 6; i++) {
-    clc_crcsum ^= (unsigned short)am2321_data->register_data[i];
-    for (j = 0; j < 8; j++) {
-      if (clc_crcsum & 1) {
-        clc_crcsum = clc_crcsum >> 1;
-        clc_crcsum ^= 0xa001;
-      } else {
-        clc_crcsum = clc_crcsum >> 1;
-      }
-    }
+  if (fd != -1) {
+    flock(fd, LOCK_UN);
   }
+}
 
-  if (rcv_crcsum == clc_crcsum) {
-    ret = 0;
-  } else {
-    printk(KERN_NOTICE "am2321 : Failed CRC check sum. Receive CRC : 0x%0x, Calc CRC : 0x%0x\n", rcv_crcsum, clc_crcsum);
-    ret = -1;
-  }
+/*!
+ * @brief Share the bus of AM2321 with the other I2C clients.
+ *
+ * The bus is locked by lock_bus_am2321() only during each transfer of the
+ * measurement, and unlocked during the waits, so that the other clients
+ * transfer while AM2321 is waking up or converting. The other clients may
+ * switch the channel of the mux in front of AM2321 during the waits, so
+ * the select is called with the bus locked before each transfer.
+ *
+ * @param[in,out] am2321_data The session to AM2321.
+ * @param[in]     fd          The file descriptor of /dev/i2c-<bus>, kept by the caller. -1 : Not shared.
+ * @param[in]     select      Select the channel of AM2321 in the lock. NULL : No mux.
+ * @param[in]     arg         The argument of select.
+ */
+void share_bus_am2321(struct am2321 *am2321_data, int fd, am2321_select_t select, void *arg) {
 
-  return ret;
+  am2321_data->lock_fd = fd;
+  am2321_data->select = select;
+  am2321_data->select_arg = arg;
 }
 
 /*!
- * @brief Measure the value of temperature, humidity and discomfort index from AM2321.
+ * @brief Lock the bus shared for a transfer of the session, and select the channel of AM2321.
  *
- * @param[out] am2321_data Collect the data to this object from AM2321.
+ * @param[in,out] am2321_data The session to AM2321.
  *
- * @return Successed : 0, Failed : -1
+ * @return Successed : 0, Failed : -1. The bus is not locked at the failure.
  */
-int measure(struct am2321 *am2321_data) {
-
-  char i2c_dev_name[64], write_data[3];
-  I2CSlave *am2321;
+static int lock_session_am2321(struct am2321 *am2321_data) {
 
-  sprintf(i2c_dev_name, I2C_DEV, 1);
-  am2321 = gen_i2c_slave(i2c_dev_name, AM2321_DEV_NAME, AM2321_ID, 1, 3000);
-  if (init_i2c_slave(am2321) == -1) {
+  lock_bus_am2321(am2321_data->lock_fd);
+  if (am2321_data->select != NULL && am2321_data->select(am2321_data, am2321_data->select_arg) == -1) {
+    unlock_bus_am2321(am2321_data->lock_fd);
     return -1;
   }
+  return 0;
+}
 
-  // Step 1 : Wakeup AM2321.
-  if (wakeup_am2321(am2321) == -1) {
-    return -1;
-  }
+#if AM2321_TIMING
+/*
+ * Histograms of the latency of each phase, in the manner of HdrHistogram.
+ *
+ * The values in nanoseconds of CLOCK_MONOTONIC_RAW are counted in the buckets
+ * of 16 linear sub-buckets per power of 2, so the error is 1/16 at most.
+ */
+#define AM2321_TIMING_SUB_BITS 4
+#define AM2321_TIMING_MAX_BITS 40   // Values are clamped to 2^40 nsec. (= about 18min)
+#define AM2321_TIMING_BUCKETS ((AM2321_TIMING_MAX_BITS - AM2321_TIMING_SUB_BITS + 1) << AM2321_TIMING_SUB_BITS)
 
-  // Step 2 : Write data to measuring temperature and humidity from sensor.
-  if (write_mode_am2321(am2321) == -1) {
-    return -1;
+struct am2321_histogram {
+
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[AM2321_TIMING_BUCKETS];
+};
+
+static struct am2321_histogram am2321_timing[AM2321_PHASES];
+
+static const char *am2321_phase_names[AM2321_PHASES] = {
+  "open", "wakeup", "wait_wakeup", "writemode", "wait_writemode",
+  "request", "wait_readmode", "read", "measure", "retry",
+};
+
+/*!
+ * @brief Get the bucket of the value.
+ */
+static inline int bucket_timing(uint64_t value) {
+
+  int e;
+
+  if (value >> AM2321_TIMING_MAX_BITS) {
+    value = (1ULL << AM2321_TIMING_MAX_BITS) - 1;
   }
-  usleep(AM2321_WAIT_WRITEMODE);
-  write_data[0] = 0x03; // Function code : 0x03 -> Read register of AM2321
-                        //                 0x10 -> Write multiple data to register of AM2321
-  write_data[1] = 0x00; // Top of address for read register of AM2321.
-  write_data[2] = 0x04; // Size of data.
-  if (write_i2c_slave(am2321, write_data, 3) == -1) {
-    return -1;
+  if (value < (1 << AM2321_TIMING_SUB_BITS)) {
+    return (int)value;
   }
+  e = 63 - __builtin_clzll(value);
+  return ((e - AM2321_TIMING_SUB_BITS + 1) << AM2321_TIMING_SUB_BITS)
+    + (int)((value >> (e - AM2321_TIMING_SUB_BITS)) & ((1 << AM2321_TIMING_SUB_BITS) - 1));
+}
 
-  // Step 3 : Recive data from AM2321.
-  usleep(AM2321_WAIT_READMODE);
-  if (read_i2c_slave(am2321, am2321_data->register_data, 8) == -1) {
-    return -1;
-  }
+/*!
+ * @brief Get the highest value counted in the bucket.
+ */
+static inline uint64_t highest_timing(int bucket) {
 
-  if (term_i2c_slave(am2321) == -1) {
-    return -1;
-  }
+  int e = (bucket >> AM2321_TIMING_SUB_BITS) + AM2321_TIMING_SUB_BITS - 1;
+  uint64_t sub = bucket & ((1 << AM2321_TIMING_SUB_BITS) - 1);
 
-  if (destroy_i2c_slave(am2321) == -1) {
-    return -1;
+  if (bucket < (1 << AM2321_TIMING_SUB_BITS)) {
+    return bucket;
   }
+  return (((1ULL << AM2321_TIMING_SUB_BITS) + sub + 1) << (e - AM2321_TIMING_SUB_BITS)) - 1;
+}
 
-  if (check_err(am2321_data) == -1) {
-    return -1;
-  }
+/*!
+ * @brief Count the latency of the phase. Called from the workers at once.
+ *
+ * @param[in] phase AM2321_PHASE_*
+ * @param[in] value The latency in nanoseconds.
+ */
+void record_timing_am2321(int phase, uint64_t value) {
 
-  if (check_crc(am2321_data) == -1) {
-    return -1;
-  }
-  return 0;
+  struct am2321_histogram *histogram = &am2321_timing[phase];
+  uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+  __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->buckets[bucket_timing(value)], 1, __ATOMIC_RELAXED);
+  while (max < value && !__atomic_compare_exchange_n(&histogram->max, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
 }
 
-#if MODULE
-int init_module(void) {
+/*!
+ * @brief Get the value at the quantile of the phase.
+ *
+ * @param[in] phase    AM2321_PHASE_*
+ * @param[in] quantile 0.0 to 1.0
+ *
+ * @return The value in nanoseconds. 0 if not counted yet.
+ */
+uint64_t quantile_timing_am2321(int phase, double quantile) {
 
-  if ( register_chrdev(0x2321, "am2321_humidity", &am2321_humidity_fops ) ) {
-    printk(KERN_INFO "am2321_humidity : louise chan ha genjitsu ja nai!?\n" );
-    return -EBUSY;
+  struct am2321_histogram *histogram = &am2321_timing[phase];
+  uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED), seen = 0, max;
+  uint64_t rank = (uint64_t)(quantile * count + 0.5);
+  int i;
+
+  if (count == 0) {
+    return 0;
   }
-  if (register_chrdev(0x2322, "am2321_temperature", &am2321_temperature_fops ) ) {
-    printk( KERN_INFO "am2321_temperature : louise chan ha genjitsu ja nai!?\n" );
-    return -EBUSY;
+  if (rank == 0) {
+    rank = 1;
+  }
+  max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+  for (i = 0; i < AM2321_TIMING_BUCKETS; i++) {
+    if (rank <= (seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED))) {
+      return highest_timing(i) < max ? highest_timing(i) : max;
+    }
   }
-  cur_data = kmalloc(sizeof(struct am2321_data), GFP_KERNEL);
+  return max;
+}
 
-  return 0;
+/*!
+ * @brief Get the count and the sum of the latencies of the phase.
+ *
+ * @param[in]  phase AM2321_PHASE_*
+ * @param[out] count Count of the latencies.
+ * @param[out] sum   Sum of the latencies in nanoseconds.
+ */
+void summary_timing_am2321(int phase, uint64_t *count, uint64_t *sum) {
+
+  *count = __atomic_load_n(&am2321_timing[phase].count, __ATOMIC_RELAXED);
+  *sum = __atomic_load_n(&am2321_timing[phase].sum, __ATOMIC_RELAXED);
 }
 
-void cleanup_module(void){
+/*!
+ * @brief Get the name of the phase.
+ *
+ * @param[in] phase AM2321_PHASE_*
+ *
+ * @return The name, e.g. "wait_wakeup".
+ */
+const char *phase_name_am2321(int phase) {
 
-  unregister_chrdev(0x2321, "am2321_humidity");
-  unregister_chrdev(0x2322, "am2321_temperature");
-  kfree(cur_data);
-  printk(KERN_INFO "am2321 : Harukeginia no louise he todoke !!\n" );
+  return am2321_phase_names[phase];
 }
-#else
 
-int measure_retry(struct am2321* am2321_data) {
+/*!
+ * @brief Print the summary of the histograms of all phases in microseconds.
+ *
+ * @param[in] stream The stream to print.
+ */
+void print_timing_am2321(FILE *stream) {
 
-  int count = 0;
+  int phase;
 
-  while (measure(am2321_data) == -1) {
-    if (I2C_SLAVE_MAX_RETRY < ++count) {
-      printk(KERN_WARNING "am2321 : Failed measure from am2321.\n");
-      return -1;
+  fprintf(stream, "%-15s %10s %10s %10s %10s %10s %10s %10s\n", "phase(usec)", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+  for (phase = 0; phase < AM2321_PHASES; phase++) {
+    uint64_t count = __atomic_load_n(&am2321_timing[phase].count, __ATOMIC_RELAXED);
+
+    if (count == 0) {
+      continue;
     }
-    printk(KERN_NOTICE "am2321 : Failed measure from am2321. retry %d of %d\n", count, I2C_SLAVE_MAX_RETRY);
-    usleep(300000);
+    fprintf(stream, "%-15s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", am2321_phase_names[phase]
+      , (unsigned long long)count, __atomic_load_n(&am2321_timing[phase].sum, __ATOMIC_RELAXED) / 1000.0 / count
+      , quantile_timing_am2321(phase, 0.5) / 1000.0, quantile_timing_am2321(phase, 0.9) / 1000.0
+      , quantile_timing_am2321(phase, 0.99) / 1000.0, quantile_timing_am2321(phase, 0.999) / 1000.0
+      , __atomic_load_n(&am2321_timing[phase].max, __ATOMIC_RELAXED) / 1000.0);
   }
+}
+#endif
+
+/*!
+ * @brief Open the I2C slave device of the session again, keeping its state.
+ *
+ * The counters, the health, the calibrated waits and the bus lock of the
+ * session are kept, so the session recovers from the device lost.
+ *
+ * @param[in,out] am2321_data The session to open.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+static int reopen_am2321(struct am2321 *am2321_data) {
+
+  char i2c_dev_name[64];
 
+  close_am2321(am2321_data);
+  sprintf(i2c_dev_name, I2C_DEV, am2321_data->bus);
+  am2321_data->i2c_slave = gen_i2c_slave(i2c_dev_name, AM2321_DEV_NAME, am2321_data->address, 1, 3000);
+  if (am2321_data->i2c_slave == NULL) {
+    printk(KERN_ERR "am2321 : Failed generate I2C slave for %s.\n", i2c_dev_name);
+    return -1;
+  }
+  if (TIMED_AM2321(AM2321_PHASE_OPEN, init_i2c_slave(am2321_data->i2c_slave)) == -1) {
+    printk(KERN_ERR "am2321 : Failed open %s.\n", i2c_dev_name);
+    destroy_i2c_slave(am2321_data->i2c_slave);
+    am2321_data->i2c_slave = NULL;
+    return -1;
+  }
   return 0;
 }
 
-void print_help(void) {
+/*!
+ * @brief Open the session to AM2321.
+ *
+ * The I2C slave device is opened only once here, and kept in am2321_data
+ * until close_am2321() is called. So measure() on the session does only
+ * the transaction of wakeup, write and read.
+ *
+ * The whole session is initialized here, so am2321_data need not be
+ * cleared by the caller. The name is set by the caller after this. The
+ * descriptor and the converter of the variant are resolved here once.
+ *
+ * @param[out] am2321_data The session to open.
+ * @param[in]  bus         Number of I2C bus. (/dev/i2c-<bus>)
+ * @param[in]  address     I2C slave address of AM2321.
+ * @param[in]  variant     AM2321_VARIANT_* of the sensor.
+ * @param[in]  mux_address I2C slave address of TCA9548A in front of AM2321. -1 : No mux.
+ * @param[in]  mux_channel Channel of TCA9548A connected to AM2321.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int open_am2321(struct am2321 *am2321_data, int bus, int address, int variant, int mux_address, int mux_channel) {
+
+  memset(am2321_data, 0, sizeof(struct am2321));
+  am2321_data->bus = bus;
+  am2321_data->address = address;
+  am2321_data->variant = variant;
+  am2321_data->mux_address = mux_address;
+  am2321_data->mux_channel = mux_channel;
+  am2321_data->lock_fd = -1;
 
-  printf("Usage: am2321 [OPTION]\n");
-  printf("Receive the data from AM2321 which is I2C Slave device and print the value of temperature, humidity, discomfort index.\n\n");
-  printf("  -c\tPrint the value in CSV format.\n");
-  printf("  -j\tPrint the value in JSON format.\n");
-  printf("  -r\tPrint the value in human readable format.\n");
-  printf("  -h\tShow this message.\n\n");
-  printf("Report bugs to mrkoh_t.bug-report@mem-notfound.net\n");
+  if (variant < 0 || AM2321_VARIANTS <= variant) {
+    printk(KERN_ERR "am2321 : Unknown variant %d.\n", variant);
+    // The descriptor of the session is always valid.
+    am2321_data->variant = AM2321_VARIANT_AM2321;
+  }
+  am2321_data->descriptor = &am2321_descriptors[am2321_data->variant];
+  am2321_data->convert = am2321_data->descriptor->convert;
+  if (am2321_data->variant != variant) {
+    return -1;
+  }
+  return reopen_am2321(am2321_data);
 }
 
-int main(int argc, char* argv[]) {
+/*!
+ * @brief Close the session to AM2321 opened by open_am2321().
+ *
+ * @param[in] am2321_data The session to close.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int close_am2321(struct am2321 *am2321_data) {
 
-  int arg, format;
-  double temp, hum, discomfort;
-  struct am2321 am2321_data;
+  int ret = 0;
 
-  while ((arg = getopt(argc, argv, "cjrh")) != -1) {
-    format = arg;
+  if (am2321_data->i2c_slave == NULL) {
+    return 0;
   }
-  if (format == 'h') {
-    print_help();
-    return 1;
+  if (term_i2c_slave(am2321_data->i2c_slave) == -1) {
+    ret = -1;
   }
-  measure_retry(&am2321_data);
-  usleep(AM2321_WAIT_REFRESH);
-  if (measure_retry(&am2321_data) == -1) {
-    printf("Failed measure data from AM2321.\n");
-  } else {
-    temp = calc_temp(&am2321_data);
-    hum = calc_hum(&am2321_data);
-    discomfort = calc_discomfort(&am2321_data);
-
-    switch(format) {
-      case 'c':
-        printf("%.1f,%.1f,%.1f\n"
-          , temp
-          , hum
-          , discomfort
-        );
-        break;
-      case 'j':
-        printf("{\"Templature\":%.1f,\"Humidity\":%.1f,\"Discomfort\":%.1f}\n"
-          , temp
-          , hum
-          , discomfort
-        );
-        break;
-      case 'r':
-      default:
-        printf("Templature : %.1f\nHumidity   : %.1f\nDiscomfort : %.1f\n"
-          , temp
-          , hum
-          , discomfort
-        );
-        break;
-    }
+  if (destroy_i2c_slave(am2321_data->i2c_slave) == -1) {
+    ret = -1;
   }
+  am2321_data->i2c_slave = NULL;
 
-  return 0;
+  return ret;
 }
 #endif
 
+/*!
+ * @brief Get the wait of AM2321, calibrated or safe of the descriptor.
+ *
+ * @param[in] am2321_data The session to AM2321.
+ * @param[in] wait        AM2321_CAL_*
+ *
+ * @return The wait in microseconds.
+ */
+int wait_am2321(struct am2321 *am2321_data, int wait) {
+
+  return am2321_data->wait[wait] > 0 ? am2321_data->wait[wait] : descriptor_am2321(am2321_data)->wait[wait];
+}
+
+/*!
+ * @brief Record the result of the measurement with the calibrated waits.
+ *
+ * When AM2321_FALLBACK_FAILURES of the last 32 measurements are failed,
+ * the calibrated waits are discarded and the safe values are used again.
+ *
+ * @param[in,out] am2321_data The session to AM2321.
+ * @param[in]     failed      The measurement is failed.
+ */
+static void history_am2321(struct am2321 *am2321_data, int failed) {
+
+  if (am2321_data->wait[AM2321_CAL_WAKEUP] == 0 && am2321_data->wait[AM2321_CAL_WRITEMODE] == 0
+      && am2321_data->wait[AM2321_CAL_READMODE] == 0) {
+    return;
+  }
+  am2321_data->history = (am2321_data->history << 1) | (failed ? 1 : 0);
+  if (AM2321_FALLBACK_FAILURES <= __builtin_popcount(am2321_data->history)) {
+    printk(KERN_WARNING "am2321 : Too many failures with the calibrated waits on 0x%02x. Fall back to the safe waits.\n", am2321_data->address);
+    memset(am2321_data->wait, 0, sizeof(am2321_data->wait));
+    am2321_data->history = 0;
+  }
+}
+
+/*!
+ * @brief Finish the measurement with the frame just read to register_data.
+ *
+ * @param[in,out] am2321_data The session to AM2321.
+ *
+ * @return Successed : 0, Failed : AM2321_ERR_CRC or AM2321_ERR_DEVICE
+ */
+int check_frame_am2321(struct am2321 *am2321_data) {
+
+  am2321_data->timestamp = monotonic_ns();
+  am2321_data->step = AM2321_STEP_FAILED;
+
+  // CRC is checked first, because the error code in the broken frame is meaningless.
+  if (am2321_data->convert(am2321_data->register_data) == -1
+      || check_crc(am2321_data) == -1) {
+    __atomic_fetch_add(&am2321_data->crc_errors, 1, __ATOMIC_RELAXED);
+    history_am2321(am2321_data, 1);
+    return AM2321_ERR_CRC;
+  }
+
+  if (check_err(am2321_data) == -1) {
+    __atomic_fetch_add(&am2321_data->device_errors[am2321_data->register_data[1] & 0x07], 1, __ATOMIC_RELAXED);
+    history_am2321(am2321_data, 1);
+    return AM2321_ERR_DEVICE;
+  }
+  history_am2321(am2321_data, 0);
+  am2321_data->step = AM2321_STEP_IDLE;
+  return 0;
+}
+
+/*!
+ * @brief Begin the measurement from AM2321 step by step.
+ *
+ * The measurement is advanced by step_am2321(). So the caller can do other
+ * things, e.g. the steps of other AM2321s, while AM2321 is waiting.
+ * The variants always awake, e.g. DHT12, begin at the request.
+ *
+ * @param[in,out] am2321_data The session to AM2321.
+ */
+void begin_am2321(struct am2321 *am2321_data) {
+
+  am2321_data->step = descriptor_am2321(am2321_data)->wakeup ? AM2321_STEP_WAKEUP : AM2321_STEP_REQUEST;
+}
+
+/*!
+ * @brief Do the transfer of the next step. See step_am2321().
+ */
+static int transfer_step_am2321(struct am2321 *am2321_data) {
+
+  const struct am2321_descriptor *descriptor = descriptor_am2321(am2321_data);
+  I2CSlave *am2321 = am2321_data->i2c_slave;
+  int step = am2321_data->step;
+
+  // Kept when returned by the failure.
+  am2321_data->step = AM2321_STEP_FAILED;
+  if (am2321 == NULL) {
+    printk(KERN_ERR "am2321 : The session to am2321 is not opened.\n");
+    return AM2321_ERR_NODEV;
+  }
+
+  switch (step) {
+    // Step 1 : Wakeup AM2321.
+    // AM2321 in suspend mode does not ACK this, so the failure is ignored.
+    case AM2321_STEP_WAKEUP:
+      TIMED_AM2321(AM2321_PHASE_WAKEUP, write_i2c_slave(am2321, NULL, 0));
+      am2321_data->step = AM2321_STEP_WRITEMODE;
+      return wait_am2321(am2321_data, AM2321_CAL_WAKEUP);
+
+    // Step 2 : Write data to measuring temperature and humidity from sensor.
+    case AM2321_STEP_WRITEMODE:
+      if (TIMED_AM2321(AM2321_PHASE_WRITEMODE, write_mode_am2321(am2321)) == -1) {
+        history_am2321(am2321_data, 1);
+        return AM2321_ERR_WAKEUP;
+      }
+      am2321_data->step = AM2321_STEP_REQUEST;
+      return wait_am2321(am2321_data, AM2321_CAL_WRITEMODE);
+
+    // The request of AM2321 is the function code 0x03 (Read register), the top of the
+    // address 0x00 and the size 0x04. (0x10 is Write multiple data to register.)
+    case AM2321_STEP_REQUEST:
+      if (TIMED_AM2321(AM2321_PHASE_REQUEST, write_i2c_slave(am2321, (char *)descriptor->request, descriptor->request_len)) == -1) {
+        history_am2321(am2321_data, 1);
+        return AM2321_ERR_WAKEUP;
+      }
+      am2321_data->step = AM2321_STEP_READ;
+      return wait_am2321(am2321_data, AM2321_CAL_READMODE);
+
+    // Step 3 : Recive data from AM2321.
+    case AM2321_STEP_READ:
+      if (TIMED_AM2321(AM2321_PHASE_READ, read_i2c_slave(am2321, am2321_data->register_data, descriptor->frame_len)) == -1) {
+        history_am2321(am2321_data, 1);
+        return AM2321_ERR_IO;
+      }
+      return check_frame_am2321(am2321_data);
+
+    default:
+      printk(KERN_ERR "am2321 : The measurement of am2321 is not begun.\n");
+      return AM2321_ERR_IO;
+  }
+}
+
+/*!
+ * @brief Do the next step of the measurement begun by begin_am2321().
+ *
+ * The bus shared by share_bus_am2321() is locked only during the transfer of the step,
+ * and the channel of AM2321 is selected in the lock.
+ *
+ * @param[in,out] am2321_data The session to AM2321. Collect the data to this object.
+ *
+ * @return Microseconds to wait before the next step : positive, Successed : 0,
+ *         Failed : AM2321_ERR_*. After the success or failure, the step of am2321_data is
+ *         AM2321_STEP_IDLE or AM2321_STEP_FAILED.
+ */
+int step_am2321(struct am2321 *am2321_data) {
+
+  int ret;
+
+  if (lock_session_am2321(am2321_data) == -1) {
+    am2321_data->step = AM2321_STEP_FAILED;
+    return AM2321_ERR_IO;
+  }
+  ret = transfer_step_am2321(am2321_data);
+  unlock_bus_am2321(am2321_data->lock_fd);
+
+  return ret;
+}
+
+/*!
+ * @brief Run the steps of the measurement from the current step until the end.
+ *
+ * @param[in,out] am2321_data The session to AM2321.
+ *
+ * @return Successed : 0, Failed : AM2321_ERR_*
+ */
+int run_am2321(struct am2321 *am2321_data) {
+
+  int wait;
+
+  while ((wait = step_am2321(am2321_data)) > 0) {
+    TIMED_AM2321(AM2321_PHASE_WAIT(am2321_data->step), usleep(wait));
+  }
+  return wait;
+}
+
+/*!
+ * @brief Measure the value of temperature, humidity and discomfort index from AM2321.
+ *
+ * The session must be opened by open_am2321() before.
+ *
+ * @param[in,out] am2321_data The session to AM2321. Collect the data to this object.
+ *
+ * @return Successed : 0, Failed : AM2321_ERR_*
+ */
+int measure(struct am2321 *am2321_data) {
+
+  begin_am2321(am2321_data);
+  return TIMED_AM2321(AM2321_PHASE_MEASURE, run_am2321(am2321_data));
+}
+
+/*!
+ * @brief Read the model, the version and the device ID of AM2321 to the session.
+ *
+ * The registers 0x08 to 0x0e are read in one request. AM2321 reads 10
+ * registers at most in a request, so they can not be read together with
+ * the humidity and the temperature at 0x00 to 0x03. They never change, so
+ * this is done once per session, e.g. at the start of the daemon.
+ * Nothing is printed at the failure, not to flood the scan of the buses.
+ * The variants without the registers, e.g. DHT12, fail with AM2321_ERR_DEVICE.
+ *
+ * @param[in,out] am2321_data The session to AM2321. Collect the registers to this object.
+ *
+ * @return Successed : 0, Failed : AM2321_ERR_*
+ */
+int discover_am2321(struct am2321 *am2321_data) {
+
+  static char request[3] = { 0x03, 0x08, 0x07 };  // Read 7 registers from 0x08.
+  I2CSlave *am2321 = am2321_data->i2c_slave;
+  uint8_t frame[11];      // Function code, length, 7 registers and CRC.
+  int ret;
+
+  if (am2321 == NULL) {
+    return AM2321_ERR_NODEV;
+  }
+  if (!descriptor_am2321(am2321_data)->registers) {
+    return AM2321_ERR_DEVICE;
+  }
+  // AM2321 in suspend mode does not ACK the wakeup.
+  if (lock_session_am2321(am2321_data) == -1) {
+    return AM2321_ERR_IO;
+  }
+  write_i2c_slave(am2321, NULL, 0);
+  unlock_bus_am2321(am2321_data->lock_fd);
+  usleep(wait_am2321(am2321_data, AM2321_CAL_WAKEUP));
+  if (lock_session_am2321(am2321_data) == -1) {
+    return AM2321_ERR_IO;
+  }
+  ret = write_i2c_slave(am2321, NULL, 0);
+  unlock_bus_am2321(am2321_data->lock_fd);
+  if (ret == -1) {
+    return AM2321_ERR_WAKEUP;
+  }
+  usleep(wait_am2321(am2321_data, AM2321_CAL_WRITEMODE));
+  if (lock_session_am2321(am2321_data) == -1) {
+    return AM2321_ERR_IO;
+  }
+  ret = write_i2c_slave(am2321, request, sizeof(request));
+  unlock_bus_am2321(am2321_data->lock_fd);
+  if (ret == -1) {
+    return AM2321_ERR_WAKEUP;
+  }
+  usleep(wait_am2321(am2321_data, AM2321_CAL_READMODE));
+  if (lock_session_am2321(am2321_data) == -1) {
+    return AM2321_ERR_IO;
+  }
+  ret = read_i2c_slave(am2321, (char *)frame, sizeof(frame));
+  unlock_bus_am2321(am2321_data->lock_fd);
+  if (ret == -1) {
+    return AM2321_ERR_IO;
+  }
+
+  if (((frame[10] << 8) | frame[9]) != crc16_modbus(frame, 9)) {
+    return AM2321_ERR_CRC;
+  }
+  if (frame[0] != 0x03 || frame[1] != 7) {
+    return AM2321_ERR_DEVICE;
+  }
+  am2321_data->model = (frame[2] << 8) | frame[3];
+  am2321_data->version = frame[4];
+  am2321_data->device_id = ((uint32_t)frame[5] << 24) | (frame[6] << 16) | (frame[7] << 8) | frame[8];
+  __atomic_store_n(&am2321_data->discovered, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+#if MODULE
+static int bus = 1;
+module_param(bus, int, 0444);
+MODULE_PARM_DESC(bus, "Number of I2C bus of AM2321. (default : 1)");
+
+static int address = AM2321_ID;
+module_param(address, int, 0444);
+MODULE_PARM_DESC(address, "I2C slave address of AM2321. (default : 0x5c)");
+
+MODULE_AUTHOR("Kodai Tooi");
+MODULE_DESCRIPTION("Temperature and humidity of AM2321");
+MODULE_LICENSE("Dual MIT/GPL");
+
+static struct am2321 work_data;         // Measured by am2321_refresh().
+static unsigned long cur_seq;           // Count of the data published to cur_data.
+static DEFINE_SPINLOCK(cur_lock);       // Lock of cur_data and cur_seq.
+static DECLARE_WAIT_QUEUE_HEAD(cur_wait);
+static struct delayed_work refresh_work;
+static int humidity_major, temperature_major;
+
+/*!
+ * @brief Measure from AM2321 and publish to cur_data every AM2321_WAIT_REFRESH.
+ *
+ * The readers of the char devices never wait for AM2321, they just read cur_data.
+ * The first data is the result of the previous conversion, so it is not published.
+ *
+ * @param[in] work refresh_work
+ */
+static void am2321_refresh(struct work_struct *work) {
+
+  static int warmed_up = 0;
+  int ret;
+
+  ret = measure(&work_data);
+  if (ret < 0) {
+    printk(KERN_NOTICE "am2321 : Failed measure from am2321. Keep the last data.\n");
+  } else if (warmed_up) {
+    spin_lock(&cur_lock);
+    memcpy(cur_data->register_data, work_data.register_data, sizeof(cur_data->register_data));
+    cur_data->timestamp = work_data.timestamp;
+    cur_seq++;
+    spin_unlock(&cur_lock);
+    wake_up_interruptible(&cur_wait);
+  } else {
+    warmed_up = 1;
+  }
+  schedule_delayed_work(&refresh_work, usecs_to_jiffies(AM2321_WAIT_REFRESH));
+}
+
+static int am2321_open(struct inode *inode, struct file *file) {
+
+  unsigned long *seq = kzalloc(sizeof(unsigned long), GFP_KERNEL);
+
+  if (seq == NULL) {
+    return -ENOMEM;
+  }
+  file->private_data = seq;   // Count of the data read by this file.
+  return 0;
+}
+
+static int am2321_release(struct inode *inode, struct file *file) {
+
+  kfree(file->private_data);
+  return 0;
+}
+
+/*!
+ * @brief Read the cached value of humidity or temperature as "12.3\n".
+ *
+ * Returns at once, unless no data is measured yet after loading the module.
+ * Each read from the offset 0 returns the latest value, so the reader polls
+ * and reads with pread(fd, buf, len, 0).
+ */
+static ssize_t am2321_read(struct file *file, char __user *buf, size_t count, loff_t *ppos, int (*calc)(struct am2321 *)) {
+
+  unsigned long *seq = file->private_data;
+  struct am2321 data;
+  char line[16];
+  int value, len;
+
+  if (*ppos != 0) {
+    return 0;
+  }
+  if (READ_ONCE(cur_seq) == 0) {
+    if (file->f_flags & O_NONBLOCK) {
+      return -EAGAIN;
+    }
+    if (wait_event_interruptible(cur_wait, READ_ONCE(cur_seq) != 0)) {
+      return -ERESTARTSYS;
+    }
+  }
+
+  spin_lock(&cur_lock);
+  memcpy(data.register_data, cur_data->register_data, sizeof(data.register_data));
+  *seq = cur_seq;
+  spin_unlock(&cur_lock);
+
+  value = calc(&data);
+  len = format_x10(line, value);
+  line[len++] = '\n';
+  if (count < (size_t)len) {
+    len = count;
+  }
+  if (copy_to_user(buf, line, len)) {
+    return -EFAULT;
+  }
+  *ppos += len;
+  return len;
+}
+
+static ssize_t am2321_humidity_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+
+  return am2321_read(file, buf, count, ppos, calc_hum_x10);
+}
+
+static ssize_t am2321_temperature_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+
+  return am2321_read(file, buf, count, ppos, calc_temp_x10);
+}
+
+/*!
+ * @brief Notify the new data which is not read by the file yet.
+ */
+static __poll_t am2321_poll(struct file *file, poll_table *wait) {
+
+  unsigned long *seq = file->private_data;
+
+  poll_wait(file, &cur_wait, wait);
+  return *seq != READ_ONCE(cur_seq) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static const struct file_operations am2321_humidity_fops = {
+  .owner = THIS_MODULE,
+  .open = am2321_open,
+  .release = am2321_release,
+  .read = am2321_humidity_read,
+  .poll = am2321_poll,
+  .llseek = default_llseek,
+};
+
+static const struct file_operations am2321_temperature_fops = {
+  .owner = THIS_MODULE,
+  .open = am2321_open,
+  .release = am2321_release,
+  .read = am2321_temperature_read,
+  .poll = am2321_poll,
+  .llseek = default_llseek,
+};
+
+int init_module(void) {
+
+  struct i2c_adapter *adapter;
+  struct i2c_board_info info = { I2C_BOARD_INFO(AM2321_DEV_NAME, 0) };
+
+  cur_data = kzalloc(sizeof(struct am2321), GFP_KERNEL);
+  if (cur_data == NULL) {
+    return -ENOMEM;
+  }
+
+  adapter = i2c_get_adapter(bus);
+  if (adapter == NULL) {
+    printk(KERN_ERR "am2321 : I2C bus %d is not found.\n", bus);
+    kfree(cur_data);
+    return -ENODEV;
+  }
+  info.addr = address;
+  work_data.i2c_slave = i2c_new_client_device(adapter, &info);
+  i2c_put_adapter(adapter);
+  if (IS_ERR(work_data.i2c_slave)) {
+    printk(KERN_ERR "am2321 : Failed add am2321 0x%02x to I2C bus %d.\n", address, bus);
+    kfree(cur_data);
+    return PTR_ERR(work_data.i2c_slave);
+  }
+  work_data.bus = bus;
+  work_data.address = address;
+  work_data.descriptor = &am2321_descriptors[AM2321_VARIANT_AM2321];
+  work_data.convert = work_data.descriptor->convert;
+
+  if ((humidity_major = register_chrdev(0, "am2321_humidity", &am2321_humidity_fops)) < 0) {
+    printk(KERN_INFO "am2321_humidity : louise chan ha genjitsu ja nai!?\n" );
+    i2c_unregister_device(work_data.i2c_slave);
+    kfree(cur_data);
+    return -EBUSY;
+  }
+  if ((temperature_major = register_chrdev(0, "am2321_temperature", &am2321_temperature_fops)) < 0) {
+    printk( KERN_INFO "am2321_temperature : louise chan ha genjitsu ja nai!?\n" );
+    unregister_chrdev(humidity_major, "am2321_humidity");
+    i2c_unregister_device(work_data.i2c_slave);
+    kfree(cur_data);
+    return -EBUSY;
+  }
+  printk(KERN_INFO "am2321 : am2321_humidity : major %d, am2321_temperature : major %d\n", humidity_major, temperature_major);
+
+  INIT_DELAYED_WORK(&refresh_work, am2321_refresh);
+  schedule_delayed_work(&refresh_work, 0);
+
+  return 0;
+}
+
+void cleanup_module(void){
+
+  cancel_delayed_work_sync(&refresh_work);
+  unregister_chrdev(humidity_major, "am2321_humidity");
+  unregister_chrdev(temperature_major, "am2321_temperature");
+  i2c_unregister_device(work_data.i2c_slave);
+  kfree(cur_data);
+  printk(KERN_INFO "am2321 : Harukeginia no louise he todoke !!\n" );
+}
+#else
+
+/*!
+ * @brief Get the name of the class of the failure.
+ *
+ * @param[in] err AM2321_ERR_*
+ *
+ * @return The name.
+ */
+const char *strerror_am2321(int err) {
+
+  switch (err) {
+    case AM2321_ERR_WAKEUP:
+      return "not woken up";
+    case AM2321_ERR_CRC:
+      return "CRC mismatch";
+    case AM2321_ERR_DEVICE:
+      return "error code";
+    case AM2321_ERR_NODEV:
+      return "no device";
+    default:
+      return "I/O error";
+  }
+}
+
+/*!
+ * @brief Get the time to wait before the retry by exponential backoff with jitter.
+ *
+ * @param[in]     count Count of the backoff before.
+ * @param[in,out] seed  Seed of the jitter.
+ *
+ * @return Microseconds to wait.
+ */
+long backoff_am2321(int count, unsigned int *seed) {
+
+  long wait = AM2321_RETRY_BACKOFF;
+
+  while (0 < count-- && wait < AM2321_RETRY_BACKOFF_MAX) {
+    wait <<= 1;
+  }
+  if (AM2321_RETRY_BACKOFF_MAX < wait) {
+    wait = AM2321_RETRY_BACKOFF_MAX;
+  }
+  // Between the half and the whole, so that the retries of AM2321s do not collide again.
+  return wait / 2 + rand_r(seed) % (wait / 2 + 1);
+}
+
+/*!
+ * @brief Get the health score of AM2321.
+ *
+ * @param[in] am2321_data The session to AM2321.
+ *
+ * @return 0 (failed in all the last measurements) to AM2321_HEALTH_MAX (no faults).
+ */
+int health_am2321(const struct am2321 *am2321_data) {
+
+  return AM2321_HEALTH_MAX - am2321_data->health.penalty;
+}
+
+/*!
+ * @brief Get the state of the health of AM2321.
+ *
+ * @param[in] am2321_data The session to AM2321.
+ *
+ * @return AM2321_HEALTHY, AM2321_FLAKY or AM2321_QUARANTINED
+ */
+int state_health_am2321(const struct am2321 *am2321_data) {
+
+  if (AM2321_HEALTH_DEAD <= am2321_data->health.failed) {
+    return AM2321_QUARANTINED;
+  }
+  return health_am2321(am2321_data) < AM2321_HEALTH_FLAKY ? AM2321_FLAKY : AM2321_HEALTHY;
+}
+
+/*!
+ * @brief Get the retries of measure_retry() allowed to AM2321 by its health.
+ *
+ * The flaky AM2321 is retried once, and the quarantined one is not retried,
+ * so that they do not spend the bus time of the healthy ones.
+ *
+ * @param[in] am2321_data The session to AM2321.
+ *
+ * @return Count of the retries.
+ */
+int budget_am2321(const struct am2321 *am2321_data) {
+
+  switch (state_health_am2321(am2321_data)) {
+    case AM2321_HEALTHY:
+      return I2C_SLAVE_MAX_RETRY;
+    case AM2321_FLAKY:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/*!
+ * @brief Check whether AM2321 is to be measured, or is in the backoff of its failures.
+ *
+ * @param[in] am2321_data The session to AM2321.
+ * @param[in] now         The time of CLOCK_MONOTONIC in nanoseconds.
+ *
+ * @return To be measured : 1, In the backoff : 0
+ */
+int due_am2321(const struct am2321 *am2321_data, uint64_t now) {
+
+  return am2321_data->health.due <= now;
+}
+
+/*!
+ * @brief Update the health of AM2321 by the result of the measurement.
+ *
+ * The faults of the measurement are the CRC mismatches, the error codes
+ * and the retries counted since the last update. Each fault costs a quarter
+ * of the score of the measurement, and the failure costs all of it. The
+ * health score is the EWMA of them, which weighs the last one by 1/4.
+ * After the second failure in a row, AM2321 is not measured until
+ * the backoff, which is doubled from 4 sec at each failure up to
+ * AM2321_HEALTH_PROBE. The success clears the backoff.
+ *
+ * @param[in,out] am2321_data The session to AM2321.
+ * @param[in]     ret         Result of the measurement. Successed : 0, Failed : negative
+ */
+void update_health_am2321(struct am2321 *am2321_data, int ret) {
+
+  struct am2321_health *health = &am2321_data->health;
+  uint64_t faults = am2321_data->crc_errors + am2321_data->retries;
+  int score, i;
+  long long backoff;
+
+  for (i = 0; i < 8; i++) {
+    faults += am2321_data->device_errors[i];
+  }
+  if (ret < 0) {
+    score = 0;
+    health->failed++;
+  } else {
+    score = faults - health->faults < 4 ? AM2321_HEALTH_MAX - (int)(faults - health->faults) * AM2321_HEALTH_MAX / 4 : 0;
+    health->failed = 0;
+  }
+  health->faults = faults;
+  __atomic_store_n(&health->penalty, (health->penalty * 3 + AM2321_HEALTH_MAX - score) / 4, __ATOMIC_RELAXED);
+
+  health->due = 0;
+  if (2 <= health->failed) {
+    backoff = (long long)AM2321_WAIT_REFRESH << (health->failed < 16 ? health->failed - 1 : 15);
+    health->due = monotonic_ns() + (AM2321_HEALTH_PROBE < backoff ? AM2321_HEALTH_PROBE : backoff) * 1000ULL;
+  }
+}
+
+/*!
+ * @brief Escalate the NACKs after the wakeup to the missing device.
+ *
+ * AM2321 which is awake ACKs the write mode after the wakeup retried, so
+ * the second NACK in a row is the device missing at the address, which is
+ * retried by the backoff and reopen of AM2321_ERR_NODEV.
+ *
+ * @param[in]     ret   Result of the measurement.
+ * @param[in,out] nacks Count of AM2321_ERR_WAKEUP in a row.
+ *
+ * @return ret, or AM2321_ERR_NODEV.
+ */
+static int escalate_am2321(int ret, int *nacks) {
+
+  if (ret != AM2321_ERR_WAKEUP) {
+    *nacks = 0;
+    return ret;
+  }
+  return ++*nacks < 2 ? ret : AM2321_ERR_NODEV;
+}
+
+/*!
+ * @brief The body of measure_retry().
+ */
+static int retry_am2321(struct am2321* am2321_data) {
+
+  unsigned int seed = (unsigned int)monotonic_ns() ^ am2321_data->address;
+  int count = 0, backoff = 0, nacks = 0, budget = budget_am2321(am2321_data), ret;
+
+  ret = measure(am2321_data);
+  while ((ret = escalate_am2321(ret, &nacks)) < 0) {
+    if (budget < ++count) {
+      printk(KERN_WARNING "am2321 : Failed measure from am2321.\n");
+      return -1;
+    }
+    printk(KERN_NOTICE "am2321 : Failed measure from am2321 (%s). retry %d of %d\n", strerror_am2321(ret), count, budget);
+    __atomic_fetch_add(&am2321_data->retries, 1, __ATOMIC_RELAXED);
+
+    switch (ret) {
+      case AM2321_ERR_WAKEUP:
+        usleep(AM2321_WAIT_WAKEUP);
+        ret = measure(am2321_data);
+        break;
+      // AM2321 sleeps again after the frame is read, so the frame is read again from the wakeup.
+      case AM2321_ERR_CRC:
+        ret = measure(am2321_data);
+        break;
+      case AM2321_ERR_NODEV:
+        usleep(backoff_am2321(backoff++, &seed));
+        if (reopen_am2321(am2321_data) == -1) {
+          ret = AM2321_ERR_NODEV;
+        } else {
+          ret = measure(am2321_data);
+        }
+        break;
+      default:
+        usleep(backoff_am2321(backoff++, &seed));
+        ret = measure(am2321_data);
+        break;
+    }
+  }
+
+  return 0;
+}
+
+/*!
+ * @brief Measure from AM2321 with retry on the opened session.
+ *
+ * The retry depends on the class of the failure :
+ *  - AM2321 is not woken up yet : Wake it up again after AM2321_WAIT_WAKEUP.
+ *  - CRC mismatch : Measure again at once from the wakeup. AM2321 goes back
+ *    to sleep after the frame is read, so it must be woken up again before
+ *    the frame is requested, and the frame cannot be just read again.
+ *  - The device is missing : Reopen the session after the backoff.
+ *  - Error code and I/O error : Measure again after the backoff.
+ * The backoff is exponential with jitter. See backoff_am2321().
+ * The count of the retries is limited by the health of AM2321. See budget_am2321().
+ *
+ * @param[in,out] am2321_data The session to AM2321. Collect the data to this object.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int measure_retry(struct am2321* am2321_data) {
+
+  return TIMED_AM2321(AM2321_PHASE_RETRY, retry_am2321(am2321_data));
+}
+
+/*!
+ * @brief Set the deadline of the next step, and arm the timerfd at the deadline.
+ */
+static void arm_async_am2321(struct am2321_async *async, uint64_t deadline) {
+
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(its));
+  async->deadline = deadline;
+  // Zero disarms the timer. The deadline in the past fires at once.
+  its.it_value.tv_sec = deadline / 1000000000;
+  its.it_value.tv_nsec = deadline % 1000000000;
+  timerfd_settime(async->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*!
+ * @brief Create the asynchronous measurement on the session opened by open_am2321().
+ *
+ * @param[out] async       The asynchronous measurement.
+ * @param[in]  am2321_data The session to AM2321.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int open_async_am2321(struct am2321_async *async, struct am2321 *am2321_data) {
+
+  memset(async, 0, sizeof(struct am2321_async));
+  async->am2321_data = am2321_data;
+  async->seed = (unsigned int)monotonic_ns() ^ am2321_data->address;
+  if ((async->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+    printk(KERN_ERR "am2321 : Failed create the timer of am2321.\n");
+    return -1;
+  }
+  return 0;
+}
+
+/*!
+ * @brief Close the timerfd of the asynchronous measurement. The session is not closed.
+ *
+ * @param[in] async The asynchronous measurement.
+ */
+void close_async_am2321(struct am2321_async *async) {
+
+  close(async->fd);
+  async->fd = -1;
+}
+
+/*!
+ * @brief Begin the asynchronous measurement. The first step is due at once.
+ *
+ * @param[in,out] async The asynchronous measurement.
+ */
+void begin_async_am2321(struct am2321_async *async) {
+
+  async->count = 0;
+  async->backoff = 0;
+  async->reopen = 0;
+  async->nacks = 0;
+  begin_am2321(async->am2321_data);
+  arm_async_am2321(async, monotonic_ns());
+}
+
+/*!
+ * @brief Advance the asynchronous measurement. Never sleeps.
+ *
+ * Call this when async->fd is readable, or async->deadline is passed. It
+ * does nothing before the deadline. The failures are retried as
+ * measure_retry() does, but the waits are the deadlines instead of sleeps.
+ *
+ * @param[in,out] async The asynchronous measurement.
+ *
+ * @return Measuring : AM2321_PENDING, Successed : 0, Failed after the retries : AM2321_ERR_*
+ */
+int step_async_am2321(struct am2321_async *async) {
+
+  struct am2321 *am2321_data = async->am2321_data;
+  uint64_t now = monotonic_ns(), expirations;
+  int ret;
+
+  // Drain the expiration. EAGAIN is fine.
+  if (read(async->fd, &expirations, sizeof(expirations)) == -1) {
+    expirations = 0;
+  }
+  if (async->deadline == 0) {
+    printk(KERN_ERR "am2321 : The measurement of am2321 is not begun.\n");
+    return AM2321_ERR_IO;
+  }
+  if (now < async->deadline) {
+    return AM2321_PENDING;
+  }
+
+  if (async->reopen) {
+    async->reopen = 0;
+    if (reopen_am2321(am2321_data) == -1) {
+      ret = AM2321_ERR_NODEV;
+    } else {
+      begin_am2321(am2321_data);
+      ret = step_am2321(am2321_data);
+    }
+  } else {
+    ret = step_am2321(am2321_data);
+  }
+  if (0 < ret) {
+    arm_async_am2321(async, now + (uint64_t)ret * 1000);
+    return AM2321_PENDING;
+  }
+  if (ret == 0) {
+    arm_async_am2321(async, 0);
+    return 0;
+  }
+
+  ret = escalate_am2321(ret, &async->nacks);
+  if (budget_am2321(am2321_data) < ++async->count) {
+    printk(KERN_WARNING "am2321 : Failed measure from am2321.\n");
+    arm_async_am2321(async, 0);
+    return ret;
+  }
+  __atomic_fetch_add(&am2321_data->retries, 1, __ATOMIC_RELAXED);
+  switch (ret) {
+    case AM2321_ERR_WAKEUP:
+      begin_am2321(am2321_data);
+      arm_async_am2321(async, now + AM2321_WAIT_WAKEUP * 1000ULL);
+      break;
+    // AM2321 sleeps again after the frame is read, so the frame is read again from the wakeup.
+    case AM2321_ERR_CRC:
+      begin_am2321(am2321_data);
+      arm_async_am2321(async, now);
+      break;
+    case AM2321_ERR_NODEV:
+      async->reopen = 1;
+      arm_async_am2321(async, now + backoff_am2321(async->backoff++, &async->seed) * 1000ULL);
+      break;
+    default:
+      begin_am2321(am2321_data);
+      arm_async_am2321(async, now + backoff_am2321(async->backoff++, &async->seed) * 1000ULL);
+      break;
+  }
+  return AM2321_PENDING;
+}
+
+/*!
+ * @brief Write the file by renaming the temporary file into place.
+ *
+ * The temporary file is created newly by mkstemp(), so a link planted at
+ * the path is replaced, not followed. The directory is created if missing.
+ *
+ * @param[in] path Path of the file.
+ * @param[in] data Contents of the file.
+ * @param[in] len  Length of the contents.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+static int replace_file_am2321(const char *path, const void *data, size_t len) {
+
+  char tmp[160], *slash;
+  int fd, ret = 0;
+
+  if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp)) {
+    return -1;
+  }
+  if ((slash = strrchr(tmp, '/')) != NULL && slash != tmp) {
+    *slash = '\0';
+    mkdir(tmp, 0755);
+    *slash = '/';
+  }
+  if ((fd = mkstemp(tmp)) == -1) {
+    return -1;
+  }
+  if (fchmod(fd, 0644) == -1 || write(fd, data, len) != (ssize_t)len) {
+    ret = -1;
+  }
+  if (close(fd) == -1 || ret == -1 || rename(tmp, path) == -1) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/*!
+ * @brief Read the file, only when it is owned by this user and written by no one else.
+ *
+ * The links are not followed, so the files planted by the other users are never trusted.
+ *
+ * @param[in]  path Path of the file.
+ * @param[out] data Buffer of the contents.
+ * @param[in]  len  Size of the buffer.
+ *
+ * @return Length read, or -1 if failed.
+ */
+static ssize_t read_owned_file_am2321(const char *path, void *data, size_t len) {
+
+  struct stat st;
+  ssize_t ret = -1;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1) {
+    return -1;
+  }
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid() && !(st.st_mode & (S_IWGRP | S_IWOTH))) {
+    ret = read(fd, data, len);
+  }
+  close(fd);
+  return ret;
+}
+
+/*!
+ * The state of the last conversion of AM2321, saved between invocations.
+ */
+struct am2321_state {
+
+  uint32_t magic;
+  int32_t bus;
+  int32_t address;
+  char register_data[8];
+  uint64_t monotonic;   // Time of the last conversion. (CLOCK_MONOTONIC, nsec)
+  uint64_t realtime;    // Time of the last conversion. (CLOCK_REALTIME, nsec)
+};
+
+/*!
+ * @brief Get the directory of the state files or the calibration files.
+ *
+ * The environment variable of the same name, AM2321_STATE_DIR or
+ * AM2321_CALIBRATION_DIR, overrides the default, e.g. for the benchmark or
+ * the unprivileged user, except in the setuid programs.
+ *
+ * @param[in] name The name of the environment variable.
+ * @param[in] dir  The default directory.
+ *
+ * @return The directory.
+ */
+static const char *dir_am2321(const char *name, const char *dir) {
+
+  const char *env = getenv(name);
+
+  if (env == NULL || env[0] == '\0' || getuid() != geteuid()) {
+    return dir;
+  }
+  return env;
+}
+
+/*!
+ * @brief Save the time of the last conversion of AM2321 to the state file.
+ *
+ * AM2321 returns the result of the previous conversion, and starts the next
+ * conversion at each reading. So the time of this reading is the time of the
+ * conversion returned by the next reading.
+ *
+ * @param[in] am2321_data The session to AM2321 measured just now.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int save_state_am2321(struct am2321 *am2321_data) {
+
+  char path[128];
+  struct am2321_state state;
+
+  memset(&state, 0, sizeof(state));
+  state.magic = AM2321_STATE_MAGIC;
+  state.bus = am2321_data->bus;
+  state.address = am2321_data->address;
+  memcpy(state.register_data, am2321_data->register_data, sizeof(state.register_data));
+  state.monotonic = am2321_data->timestamp;
+  state.realtime = realtime_ns() - (monotonic_ns() - am2321_data->timestamp);
+
+  if (snprintf(path, sizeof(path), AM2321_STATE_FILE, dir_am2321("AM2321_STATE_DIR", AM2321_STATE_DIR), am2321_data->bus, am2321_data->address) >= (int)sizeof(path)
+      || replace_file_am2321(path, &state, sizeof(state)) == -1) {
+    printk(KERN_NOTICE "am2321 : Failed write the state file %s.\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+/*!
+ * @brief Get the age of the last conversion of AM2321 from the state file.
+ *
+ * The state is treated as stale when CLOCK_MONOTONIC and CLOCK_REALTIME
+ * disagree about the age, which happens after the reboot. The frame of the
+ * last sample is restored from the state, so that it can be printed without
+ * the bus. Only the bus and the address are needed, not the opened session.
+ * The state file not owned by this user is ignored.
+ *
+ * @param[in,out] am2321_data The session to AM2321. The frame of the last sample is restored to this object.
+ *
+ * @return Age of the last conversion in microseconds, or -1 if unknown.
+ */
+long long load_state_am2321(struct am2321 *am2321_data) {
+
+  char path[128];
+  struct am2321_state state;
+  ssize_t len;
+  long long mono_age, real_age;
+
+  if (snprintf(path, sizeof(path), AM2321_STATE_FILE, dir_am2321("AM2321_STATE_DIR", AM2321_STATE_DIR), am2321_data->bus, am2321_data->address) >= (int)sizeof(path)) {
+    return -1;
+  }
+  len = read_owned_file_am2321(path, &state, sizeof(state));
+
+  if (len != sizeof(state) || state.magic != AM2321_STATE_MAGIC
+      || state.bus != am2321_data->bus || state.address != am2321_data->address) {
+    return -1;
+  }
+
+  mono_age = ((long long)monotonic_ns() - (long long)state.monotonic) / 1000;
+  real_age = ((long long)realtime_ns() - (long long)state.realtime) / 1000;
+  if (mono_age < 0 || real_age - mono_age > 1000000 || mono_age - real_age > 1000000) {
+    return -1;
+  }
+  memcpy(am2321_data->register_data, state.register_data, sizeof(state.register_data));
+
+  return mono_age;
+}
+
+/*!
+ * The calibrated waits of AM2321, saved by save_calibration_am2321().
+ */
+struct am2321_calibration {
+
+  uint32_t magic;
+  int32_t bus;
+  int32_t address;
+  int32_t mux_address;
+  int32_t mux_channel;
+  int32_t variant;          // AM2321_VARIANT_*. The waits of the other model are not reused.
+  int32_t wait[AM2321_CAL_WAITS];
+};
+
+/*!
+ * @brief Get the path of the calibration file of AM2321.
+ *
+ * @return Successed : 0, Too long : -1
+ */
+static int calibration_path_am2321(struct am2321 *am2321_data, char *path, size_t len) {
+
+  const char *dir = dir_am2321("AM2321_CALIBRATION_DIR", AM2321_CALIBRATION_DIR);
+  int n;
+
+  if (am2321_data->mux_address < 0) {
+    n = snprintf(path, len, AM2321_CALIBRATION_FILE, dir, am2321_data->bus, am2321_data->address);
+  } else {
+    n = snprintf(path, len, AM2321_CALIBRATION_MUX_FILE, dir, am2321_data->bus, am2321_data->address
+      , am2321_data->mux_address, am2321_data->mux_channel);
+  }
+  return n < (int)len ? 0 : -1;
+}
+
+/*!
+ * @brief Save the calibrated waits of AM2321 to the calibration file.
+ *
+ * @param[in] am2321_data The session to AM2321 calibrated.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int save_calibration_am2321(struct am2321 *am2321_data) {
+
+  char path[128];
+  struct am2321_calibration calibration;
+  int i;
+
+  memset(&calibration, 0, sizeof(calibration));
+  calibration.magic = AM2321_CALIBRATION_MAGIC;
+  calibration.bus = am2321_data->bus;
+  calibration.address = am2321_data->address;
+  calibration.mux_address = am2321_data->mux_address;
+  calibration.mux_channel = am2321_data->mux_channel;
+  calibration.variant = am2321_data->variant;
+  for (i = 0; i < AM2321_CAL_WAITS; i++) {
+    calibration.wait[i] = am2321_data->wait[i];
+  }
+
+  if (calibration_path_am2321(am2321_data, path, sizeof(path)) == -1
+      || replace_file_am2321(path, &calibration, sizeof(calibration)) == -1) {
+    printk(KERN_ERR "am2321 : Failed write the calibration file %s.\n", path);
+    return -1;
+  }
+  return 0;
+}
+
+/*!
+ * @brief Load the calibrated waits of AM2321 from the calibration file.
+ *
+ * The safe waits are kept if the file does not exist, is not owned by this
+ * user, or is calibrated for the other model.
+ *
+ * @param[in,out] am2321_data The session to AM2321.
+ *
+ * @return Loaded : 0, Not calibrated : -1
+ */
+int load_calibration_am2321(struct am2321 *am2321_data) {
+
+  char path[128];
+  struct am2321_calibration calibration;
+  int i;
+  ssize_t len;
+
+  if (calibration_path_am2321(am2321_data, path, sizeof(path)) == -1) {
+    return -1;
+  }
+  len = read_owned_file_am2321(path, &calibration, sizeof(calibration));
+
+  if (len != sizeof(calibration) || calibration.magic != AM2321_CALIBRATION_MAGIC
+      || calibration.variant != am2321_data->variant
+      || calibration.bus != am2321_data->bus || calibration.address != am2321_data->address
+      || calibration.mux_address != am2321_data->mux_address
+      || (am2321_data->mux_address >= 0 && calibration.mux_channel != am2321_data->mux_channel)) {
+    return -1;
+  }
+  for (i = 0; i < AM2321_CAL_WAITS; i++) {
+    // Never longer than the safe value.
+    am2321_data->wait[i] = 0 < calibration.wait[i] && calibration.wait[i] < descriptor_am2321(am2321_data)->wait[i] ? calibration.wait[i] : 0;
+  }
+  am2321_data->history = 0;
+  return 0;
+}
+
+/*!
+ * @brief Measure AM2321_CALIBRATE_TRIALS times with the value of the wait, for calibrate_am2321().
+ *
+ * @return All succeeded : 0, Failed : -1
+ */
+static int trial_am2321(struct am2321 *am2321_data, int wait, int value) {
+
+  int i;
+
+  am2321_data->wait[wait] = value;
+  for (i = 0; i < AM2321_CALIBRATE_TRIALS; i++) {
+    usleep(AM2321_CALIBRATE_SPACING);
+    // Not to fall back to the safe waits during the trials.
+    am2321_data->history = 0;
+    if (measure(am2321_data) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*!
+ * @brief Calibrate the waits of AM2321.
+ *
+ * For each wait in turn, the smallest value with which AM2321_CALIBRATE_TRIALS
+ * measurements all succeed is searched by binary search between 0 and the
+ * safe value. 25% of the value is added as the margin.
+ *
+ * @param[in,out] am2321_data The session to AM2321. The waits are set to this object.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int calibrate_am2321(struct am2321 *am2321_data) {
+
+  int wait, low, high, mid;
+
+  memset(am2321_data->wait, 0, sizeof(am2321_data->wait));
+  if (trial_am2321(am2321_data, AM2321_CAL_WAKEUP, 0) == -1) {
+    printk(KERN_ERR "am2321 : Failed measure from am2321 0x%02x with the safe waits.\n", am2321_data->address);
+    return -1;
+  }
+
+  for (wait = 0; wait < AM2321_CAL_WAITS; wait++) {
+    low = 0;
+    high = descriptor_am2321(am2321_data)->wait[wait];
+    while (AM2321_CALIBRATE_STEP < high - low) {
+      mid = low + (high - low) / 2;
+      if (trial_am2321(am2321_data, wait, mid) == 0) {
+        high = mid;
+      } else {
+        low = mid;
+      }
+    }
+    high += high / 4 + AM2321_CALIBRATE_STEP;
+    am2321_data->wait[wait] = high < descriptor_am2321(am2321_data)->wait[wait] ? high : 0;
+  }
+
+  // Verify all waits together.
+  if (trial_am2321(am2321_data, AM2321_CAL_WAKEUP, am2321_data->wait[AM2321_CAL_WAKEUP]) == -1) {
+    printk(KERN_ERR "am2321 : Failed verify the calibrated waits of am2321 0x%02x.\n", am2321_data->address);
+    memset(am2321_data->wait, 0, sizeof(am2321_data->wait));
+    return -1;
+  }
+  am2321_data->history = 0;
+  return 0;
+}
+
+/*!
+ * The header at the top of the capture file of the raw frames.
+ */
+struct am2321_capture_header {
+
+  char magic[8];            // AM2321_CAPTURE_MAGIC
+  uint32_t version;
+  uint32_t record_size;
+};
+
+/*!
+ * The append-only capture of the raw frames, buffered to write in blocks.
+ */
+struct am2321_capture {
+
+  int fd;
+  off_t size;               // Size of the file, at the boundary of the records.
+  size_t len;
+  uint64_t buffered_at;     // Time of the oldest record in the buffer.
+  char buf[4096 - 4096 % sizeof(struct am2321_frame_record)];
+};
+
+/*!
+ * @brief Write the records of the capture in the buffer to the file.
+ *
+ * The record written in part by the failed write is truncated, so the
+ * records appended later are not misaligned.
+ *
+ * @param[in,out] capture The capture.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int flush_capture_am2321(struct am2321_capture *capture) {
+
+  ssize_t ret;
+  size_t done = 0;
+
+  while (done < capture->len) {
+    if ((ret = write(capture->fd, capture->buf + done, capture->len - done)) == -1) {
+      printk(KERN_ERR "am2321 : Failed write the capture.\n");
+      if (done != 0 && ftruncate(capture->fd, capture->size) == -1) {
+        printk(KERN_ERR "am2321 : Failed truncate the torn record of the capture.\n");
+      }
+      capture->len = 0;
+      return -1;
+    }
+    done += ret;
+  }
+  capture->size += capture->len;
+  capture->len = 0;
+  return 0;
+}
+
+/*!
+ * @brief Append the record to the capture.
+ *
+ * The records are written when the buffer is full, or when the oldest
+ * record is kept longer than AM2321_CAPTURE_FLUSH.
+ *
+ * @param[in,out] capture The capture.
+ * @param[in]     record  The record.
+ */
+void append_capture_am2321(struct am2321_capture *capture, const struct am2321_frame_record *record) {
+
+  uint64_t now = monotonic_ns();
+
+  if (capture->len == 0) {
+    capture->buffered_at = now;
+  }
+  memcpy(capture->buf + capture->len, record, sizeof(struct am2321_frame_record));
+  capture->len += sizeof(struct am2321_frame_record);
+  if (sizeof(capture->buf) <= capture->len || capture->buffered_at + AM2321_CAPTURE_FLUSH * 1000ULL <= now) {
+    flush_capture_am2321(capture);
+  }
+}
+
+/*!
+ * @brief Open the capture file to append the raw frames.
+ *
+ * The existing file is appended only if its header is of this version and
+ * of this size of the record. The record torn at the end, e.g. by the
+ * crash, is truncated before the records are appended.
+ *
+ * @param[in] path Path of the capture file.
+ *
+ * @return The capture, or NULL if failed.
+ */
+struct am2321_capture *open_capture_am2321(const char *path) {
+
+  struct am2321_capture *capture;
+  struct am2321_capture_header header, found;
+  struct am2321_frame_record anchor;
+  uint64_t realtime;
+  struct stat st;
+  off_t size;
+
+  if ((capture = calloc(1, sizeof(struct am2321_capture))) == NULL) {
+    return NULL;
+  }
+  if ((capture->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) == -1 || fstat(capture->fd, &st) == -1) {
+    printk(KERN_ERR "am2321 : Failed open the capture %s.\n", path);
+    if (capture->fd != -1) {
+      close(capture->fd);
+    }
+    free(capture);
+    return NULL;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, AM2321_CAPTURE_MAGIC, sizeof(header.magic));
+  header.version = AM2321_CAPTURE_VERSION;
+  header.record_size = sizeof(struct am2321_frame_record);
+
+  // The header torn at the creation is written again.
+  size = st.st_size < (off_t)sizeof(header) ? st.st_size : (off_t)sizeof(header);
+  if (pread(capture->fd, &found, size, 0) != size || memcmp(&found, &header, size) != 0) {
+    printk(KERN_ERR "am2321 : %s is not the capture of this version of am2321.\n", path);
+    close(capture->fd);
+    free(capture);
+    return NULL;
+  }
+  if (st.st_size < (off_t)sizeof(header)) {
+    size = 0;
+  } else {
+    size = st.st_size - (st.st_size - sizeof(header)) % sizeof(struct am2321_frame_record);
+  }
+  if (size != st.st_size) {
+    printk(KERN_WARNING "am2321 : Truncate the torn record at the end of the capture %s.\n", path);
+    if (ftruncate(capture->fd, size) == -1) {
+      printk(KERN_ERR "am2321 : Failed truncate the capture %s.\n", path);
+      close(capture->fd);
+      free(capture);
+      return NULL;
+    }
+  }
+  capture->size = size;
+  if (size == 0) {
+    memcpy(capture->buf, &header, sizeof(header));
+    capture->len = sizeof(header);
+    flush_capture_am2321(capture);
+  }
+
+  memset(&anchor, 0, sizeof(anchor));
+  anchor.timestamp = monotonic_ns();
+  anchor.sensor = AM2321_CAPTURE_ANCHOR;
+  realtime = realtime_ns();
+  memcpy(anchor.frame, &realtime, sizeof(anchor.frame));
+  append_capture_am2321(capture, &anchor);
+
+  return capture;
+}
+
+/*!
+ * @brief Flush and close the capture.
+ *
+ * @param[in] capture The capture.
+ */
+void close_capture_am2321(struct am2321_capture *capture) {
+
+  flush_capture_am2321(capture);
+  close(capture->fd);
+  free(capture);
+}
+
+/*!
+ * @brief Decode the capture file and print the values of all frames.
+ *
+ * The file is mapped to memory and the frames are decoded by
+ * decode_bulk_am2321() in the batches of AM2321_DECODE_BATCH. Each record is
+ * printed with its time in CLOCK_REALTIME, the index of the sensor and
+ * the result of check_err() and check_crc().
+ *
+ * @param[in] path   Path of the capture file.
+ * @param[in] format Output format. 'c' : CSV, 'j' : JSON, 'r' : Human readable.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int decode_capture_am2321(const char *path, int format) {
+
+  const struct am2321_capture_header *header;
+  const struct am2321_frame_record *record, *next, *end;
+  static char frames[AM2321_DECODE_BATCH][8];
+  static int16_t temperature[AM2321_DECODE_BATCH], discomfort[AM2321_DECODE_BATCH];
+  static uint16_t humidity[AM2321_DECODE_BATCH];
+  static uint8_t valid[AM2321_DECODE_BATCH];
+  char temp[AM2321_X10_LEN], hum[AM2321_X10_LEN], di[AM2321_X10_LEN];
+  struct am2321_bulk bulk;
+  size_t batch, i;
+  struct stat st;
+  int64_t offset = 0;
+  uint64_t realtime;
+  const char *status;
+  char *map;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+    printk(KERN_ERR "am2321 : Failed open the capture %s.\n", path);
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(struct am2321_capture_header)) {
+    printk(KERN_ERR "am2321 : %s is not the capture of am2321.\n", path);
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    printk(KERN_ERR "am2321 : Failed map the capture %s.\n", path);
+    return -1;
+  }
+  // The history of -H is also decoded.
+  if (memcmp(map, AM2321_HISTORY_MAGIC, sizeof(AM2321_HISTORY_MAGIC) - 1) == 0) {
+    munmap(map, st.st_size);
+    return decode_history_am2321(path, format);
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  header = (const struct am2321_capture_header *)map;
+  if (memcmp(header->magic, AM2321_CAPTURE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != AM2321_CAPTURE_VERSION || header->record_size != sizeof(struct am2321_frame_record)) {
+    printk(KERN_ERR "am2321 : %s is not the capture of am2321.\n", path);
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  bulk.temperature = temperature;
+  bulk.humidity = humidity;
+  bulk.discomfort = discomfort;
+  bulk.status = valid;
+  record = (const struct am2321_frame_record *)(map + sizeof(struct am2321_capture_header));
+  end = record + (st.st_size - sizeof(struct am2321_capture_header)) / sizeof(struct am2321_frame_record);
+  if (format == 'c') {
+    printf("time,sensor,bus,address,status,temperature,humidity,discomfort\n");
+  }
+  while (record < end) {
+    // Gather the frames of a batch, and decode them at once.
+    for (batch = 0, next = record; next < end && batch < AM2321_DECODE_BATCH; next++) {
+      if (next->sensor != AM2321_CAPTURE_ANCHOR) {
+        memcpy(frames[batch++], next->frame, sizeof(frames[0]));
+      }
+    }
+    decode_bulk_am2321((const char (*)[8])frames, batch, &bulk);
+
+    for (i = 0; record < next; record++) {
+      if (record->sensor == AM2321_CAPTURE_ANCHOR) {
+        memcpy(&realtime, record->frame, sizeof(realtime));
+        offset = (int64_t)(realtime - record->timestamp);
+        continue;
+      }
+      realtime = record->timestamp + offset;
+      format_x10(temp, temperature[i]);
+      format_x10(hum, humidity[i]);
+      format_x10(di, discomfort[i]);
+      if (record->status < 0) {
+        status = strerror_am2321(record->status);
+      } else if (valid[i] & AM2321_BULK_CRC) {
+        status = strerror_am2321(AM2321_ERR_CRC);
+      } else if (valid[i] & AM2321_BULK_ERR) {
+        status = strerror_am2321(AM2321_ERR_DEVICE);
+      } else {
+        status = "ok";
+      }
+
+      switch (format) {
+        case 'c':
+          printf("%llu.%09llu,%u,%u,0x%02x,%s,%s,%s,%s\n"
+            , (unsigned long long)(realtime / 1000000000), (unsigned long long)(realtime % 1000000000)
+            , record->sensor, record->bus, record->address, status
+            , temp, hum, di);
+          break;
+        case 'j':
+          printf("{\"Time\":%llu.%09llu,\"Sensor\":%u,\"Bus\":%u,\"Address\":%u,\"Status\":\"%s\",\"Templature\":%s,\"Humidity\":%s,\"Discomfort\":%s}\n"
+            , (unsigned long long)(realtime / 1000000000), (unsigned long long)(realtime % 1000000000)
+            , record->sensor, record->bus, record->address, status
+            , temp, hum, di);
+          break;
+        case 'r':
+        default:
+          printf("Time       : %llu.%09llu\nSensor     : %u (/dev/i2c-%u 0x%02x)\nStatus     : %s\n"
+            , (unsigned long long)(realtime / 1000000000), (unsigned long long)(realtime % 1000000000)
+            , record->sensor, record->bus, record->address, status);
+          printf("Templature : %s\nHumidity   : %s\nDiscomfort : %s\n"
+            , temp, hum, di);
+          break;
+      }
+      i++;
+    }
+  }
+  munmap(map, st.st_size);
+
+  return 0;
+}
+
+/*!
+ * The last values appended of a sensor to the history.
+ */
+struct am2321_history_sensor {
+
+  int temperature;
+  int humidity;
+  uint8_t appended;         // Any value is appended.
+  uint8_t in_block;         // Any value is appended in the current block.
+};
+
+/*!
+ * The history of the values, written in the blocks of AM2321_HISTORY_BLOCK.
+ *
+ * The current block is written in place until it is full, thus the flash
+ * memory is written once each AM2321_HISTORY_FLUSH, or when the block is full.
+ */
+struct am2321_history {
+
+  int fd;
+  int flags;                // AM2321_HISTORY_*
+  int nsensors;
+  off_t offset;             // Offset of the current block in the file.
+  uint64_t flushed_at;      // Time of the last write of the current block.
+  uint64_t last_ms;         // Milliseconds of the last record from the time of the block.
+  int dirty;                // The current block has the records not written.
+  struct am2321_history_header header;
+  struct am2321_history_sensor *sensors;
+  uint8_t buf[AM2321_HISTORY_BLOCK];
+};
+
+/*!
+ * @brief Append the unsigned integer in LEB128.
+ *
+ * @return Bytes appended.
+ */
+static inline int put_varint(uint8_t *buf, uint64_t value) {
+
+  int n = 0;
+
+  while (0x80 <= value) {
+    buf[n++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  buf[n++] = value;
+  return n;
+}
+
+/*!
+ * @brief Read the unsigned integer in LEB128.
+ *
+ * @return Bytes read, or 0 if it is over the end.
+ */
+static inline int get_varint(const uint8_t *buf, const uint8_t *end, uint64_t *value) {
+
+  int n = 0, shift = 0;
+
+  *value = 0;
+  while (buf + n < end && shift < 64) {
+    *value |= (uint64_t)(buf[n] & 0x7f) << shift;
+    if ((buf[n++] & 0x80) == 0) {
+      return n;
+    }
+    shift += 7;
+  }
+  return 0;
+}
+
+/*!
+ * @brief Map the signed integer to the unsigned one, the small magnitude to the small value.
+ */
+static inline uint64_t zigzag(int64_t value) {
+
+  return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value) {
+
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/*!
+ * @brief Write the current block of the history in place.
+ *
+ * The rest of the block after the records is written as zero.
+ *
+ * @param[in,out] history The history.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int flush_history_am2321(struct am2321_history *history) {
+
+  if (!history->dirty) {
+    return 0;
+  }
+  history->header.crc = crc16_modbus(history->buf + sizeof(struct am2321_history_header), history->header.length);
+  memcpy(history->buf, &history->header, sizeof(struct am2321_history_header));
+  history->flushed_at = monotonic_ns();
+  history->dirty = 0;
+  if (pwrite(history->fd, history->buf, AM2321_HISTORY_BLOCK, history->offset) != AM2321_HISTORY_BLOCK) {
+    printk(KERN_ERR "am2321 : Failed write the history.\n");
+    return -1;
+  }
+  return 0;
+}
+
+/*!
+ * @brief Write the current block, and begin the next block.
+ *
+ * @param[in,out] history The history.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+static int next_block_history(struct am2321_history *history) {
+
+  int i, ret = flush_history_am2321(history);
+
+  if (history->header.count != 0) {
+    history->offset += AM2321_HISTORY_BLOCK;
+  }
+  memset(&history->header, 0, sizeof(struct am2321_history_header));
+  memcpy(history->header.magic, AM2321_HISTORY_MAGIC, sizeof(history->header.magic));
+  memset(history->buf, 0, sizeof(history->buf));
+  history->last_ms = 0;
+  for (i = 0; i < history->nsensors; i++) {
+    history->sensors[i].in_block = 0;
+  }
+  return ret;
+}
+
+/*!
+ * @brief Append the measured values of AM2321 to the history.
+ *
+ * With AM2321_HISTORY_CHANGES, the values same as the last ones appended
+ * of the sensor are not appended.
+ *
+ * @param[in,out] history     The history.
+ * @param[in]     am2321_data The data of received from AM2321.
+ * @param[in]     sensor      Index of the sensor.
+ *
+ * @return 1 : Appended, 0 : Not changed, -1 : Failed write the history.
+ */
+int append_history_am2321(struct am2321_history *history, struct am2321 *am2321_data, int sensor) {
+
+  struct am2321_history_sensor *last = &history->sensors[sensor];
+  uint64_t now = monotonic_ns();
+  uint64_t time = realtime_ns() - (now - am2321_data->timestamp);
+  int temp = calc_temp_x10(am2321_data), hum = calc_hum_x10(am2321_data);
+  int ret = 0;
+  uint64_t ms;
+  uint8_t *p;
+
+  if ((history->flags & AM2321_HISTORY_CHANGES) && last->appended && last->temperature == temp && last->humidity == hum) {
+    return 0;
+  }
+
+  // The block is full, or the clock is set back.
+  if (history->header.count != 0
+      && (AM2321_HISTORY_BLOCK - sizeof(struct am2321_history_header) - history->header.length < AM2321_HISTORY_RECORD_MAX
+        || time < history->header.time + history->last_ms * 1000000)) {
+    ret = next_block_history(history);
+  }
+  if (history->header.count == 0) {
+    history->header.time = time;
+  }
+  ms = (time - history->header.time) / 1000000;
+
+  p = history->buf + sizeof(struct am2321_history_header) + history->header.length;
+  p += put_varint(p, sensor);
+  p += put_varint(p, ms - history->last_ms);
+  p += put_varint(p, zigzag(last->in_block ? temp - last->temperature : temp));
+  p += put_varint(p, zigzag(last->in_block ? hum - last->humidity : hum));
+  history->header.length = p - history->buf - sizeof(struct am2321_history_header);
+  history->header.count++;
+  history->last_ms = ms;
+  history->dirty = 1;
+  last->temperature = temp;
+  last->humidity = hum;
+  last->appended = 1;
+  last->in_block = 1;
+
+  if (history->flushed_at + AM2321_HISTORY_FLUSH * 1000ULL <= now && flush_history_am2321(history) == -1) {
+    ret = -1;
+  }
+  return ret == -1 ? -1 : 1;
+}
+
+/*!
+ * @brief Open the history file to append the values.
+ *
+ * The values are appended from the next block to the last one in the file.
+ *
+ * @param[in] path     Path of the history file.
+ * @param[in] nsensors Number of the sensors.
+ * @param[in] flags    AM2321_HISTORY_*
+ *
+ * @return The history, or NULL if failed.
+ */
+struct am2321_history *open_history_am2321(const char *path, int nsensors, int flags) {
+
+  struct am2321_history *history;
+  struct stat st;
+
+  if ((history = calloc(1, sizeof(struct am2321_history))) == NULL) {
+    return NULL;
+  }
+  if ((history->sensors = calloc(nsensors, sizeof(struct am2321_history_sensor))) == NULL) {
+    free(history);
+    return NULL;
+  }
+  if ((history->fd = open(path, O_RDWR | O_CREAT, 0644)) == -1 || fstat(history->fd, &st) == -1) {
+    printk(KERN_ERR "am2321 : Failed open the history %s.\n", path);
+    if (history->fd != -1) {
+      close(history->fd);
+    }
+    free(history->sensors);
+    free(history);
+    return NULL;
+  }
+  history->flags = flags;
+  history->nsensors = nsensors;
+  history->offset = (st.st_size + AM2321_HISTORY_BLOCK - 1) / AM2321_HISTORY_BLOCK * AM2321_HISTORY_BLOCK;
+  history->flushed_at = monotonic_ns();
+  next_block_history(history);
+
+  return history;
+}
+
+/*!
+ * @brief Write the current block and close the history.
+ *
+ * @param[in] history The history.
+ */
+void close_history_am2321(struct am2321_history *history) {
+
+  flush_history_am2321(history);
+  close(history->fd);
+  free(history->sensors);
+  free(history);
+}
+
+/*!
+ * @brief Decode the history file and print the values of all records.
+ *
+ * The blocks broken, e.g. by the power lost while writing, are skipped.
+ *
+ * @param[in] path   Path of the history file.
+ * @param[in] format Output format. 'c' : CSV, 'j' : JSON, 'r' : Human readable.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int decode_history_am2321(const char *path, int format) {
+
+  struct am2321_history_header header;
+  struct am2321_history_sensor *sensors;
+  char temp[AM2321_X10_LEN], hum[AM2321_X10_LEN], di[AM2321_X10_LEN];
+  const uint8_t *p, *end;
+  uint64_t sensor, delta, dtemp, dhum, ms, realtime;
+  struct stat st;
+  off_t block;
+  uint8_t *map;
+  int fd, i, n, m, l, k;
+
+  if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+    printk(KERN_ERR "am2321 : Failed open the history %s.\n", path);
+    return -1;
+  }
+  if (st.st_size < AM2321_HISTORY_BLOCK) {
+    printk(KERN_ERR "am2321 : %s is not the history of am2321.\n", path);
+    close(fd);
+    return -1;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    printk(KERN_ERR "am2321 : Failed map the history %s.\n", path);
+    return -1;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  // The index of the sensor is 16 bits.
+  if ((sensors = calloc(0x10000, sizeof(struct am2321_history_sensor))) == NULL) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  if (format == 'c') {
+    printf("time,sensor,temperature,humidity,discomfort\n");
+  }
+  for (block = 0; block + AM2321_HISTORY_BLOCK <= st.st_size; block += AM2321_HISTORY_BLOCK) {
+    memcpy(&header, map + block, sizeof(header));
+    p = map + block + sizeof(header);
+    if (memcmp(header.magic, AM2321_HISTORY_MAGIC, sizeof(header.magic)) != 0
+        || AM2321_HISTORY_BLOCK - sizeof(header) < header.length || crc16_modbus(p, header.length) != header.crc) {
+      printk(KERN_ERR "am2321 : Block at %lld of the history %s is broken.\n", (long long)block, path);
+      continue;
+    }
+    end = p + header.length;
+    ms = 0;
+    for (i = 0; i < 0x10000; i++) {
+      sensors[i].in_block = 0;
+    }
+    for (i = 0; i < header.count; i++) {
+      if ((n = get_varint(p, end, &sensor)) == 0 || (m = get_varint(p + n, end, &delta)) == 0
+          || (l = get_varint(p + n + m, end, &dtemp)) == 0 || (k = get_varint(p + n + m + l, end, &dhum)) == 0
+          || 0xffff < sensor) {
+        printk(KERN_ERR "am2321 : Block at %lld of the history %s is broken.\n", (long long)block, path);
+        break;
+      }
+      p += n + m + l + k;
+      ms += delta;
+      if (sensors[sensor].in_block) {
+        sensors[sensor].temperature += unzigzag(dtemp);
+        sensors[sensor].humidity += unzigzag(dhum);
+      } else {
+        sensors[sensor].temperature = unzigzag(dtemp);
+        sensors[sensor].humidity = unzigzag(dhum);
+        sensors[sensor].in_block = 1;
+      }
+      realtime = header.time + ms * 1000000;
+      format_x10(temp, sensors[sensor].temperature);
+      format_x10(hum, sensors[sensor].humidity);
+      format_x10(di, discomfort_x10(sensors[sensor].temperature, sensors[sensor].humidity));
+
+      switch (format) {
+        case 'c':
+          printf("%llu.%09llu,%u,%s,%s,%s\n"
+            , (unsigned long long)(realtime / 1000000000), (unsigned long long)(realtime % 1000000000)
+            , (unsigned int)sensor, temp, hum, di);
+          break;
+        case 'j':
+          printf("{\"Time\":%llu.%09llu,\"Sensor\":%u,\"Templature\":%s,\"Humidity\":%s,\"Discomfort\":%s}\n"
+            , (unsigned long long)(realtime / 1000000000), (unsigned long long)(realtime % 1000000000)
+            , (unsigned int)sensor, temp, hum, di);
+          break;
+        case 'r':
+        default:
+          printf("Time       : %llu.%09llu\nSensor     : %u\n"
+            , (unsigned long long)(realtime / 1000000000), (unsigned long long)(realtime % 1000000000)
+            , (unsigned int)sensor);
+          printf("Templature : %s\nHumidity   : %s\nDiscomfort : %s\n"
+            , temp, hum, di);
+          break;
+      }
+    }
+  }
+  free(sensors);
+  munmap(map, st.st_size);
+
+  return 0;
+}
+
+/*!
+ * @brief Print the value of temperature, humidity and discomfort index.
+ *
+ * The values are calculated and formatted in integer of 10 times, without
+ * floating point.
+ *
+ * @param[in] am2321_data The data of received from AM2321.
+ * @param[in] format      Output format. 'c' : CSV, 'j' : JSON, 'r' : Human readable.
+ */
+void print_am2321(struct am2321 *am2321_data, int format) {
+
+  char temp[AM2321_X10_LEN], hum[AM2321_X10_LEN], discomfort[AM2321_X10_LEN];
+  int temp_x10 = calc_temp_x10(am2321_data), hum_x10 = calc_hum_x10(am2321_data);
+
+  format_x10(temp, temp_x10);
+  format_x10(hum, hum_x10);
+  format_x10(discomfort, discomfort_x10(temp_x10, hum_x10));
+
+  switch(format) {
+    case 'c':
+      if (am2321_data->name[0] != '\0') {
+        printf("%s,", am2321_data->name);
+      }
+      printf("%s,%s,%s\n"
+        , temp
+        , hum
+        , discomfort
+      );
+      break;
+    case 'j':
+      if (am2321_data->name[0] != '\0') {
+        printf("{\"Name\":\"%s\",", am2321_data->name);
+      } else {
+        printf("{");
+      }
+      printf("\"Templature\":%s,\"Humidity\":%s,\"Discomfort\":%s}\n"
+        , temp
+        , hum
+        , discomfort
+      );
+      break;
+    case 'r':
+    default:
+      if (am2321_data->name[0] != '\0') {
+        printf("Name       : %s\n", am2321_data->name);
+      }
+      printf("Templature : %s\nHumidity   : %s\nDiscomfort : %s\n"
+        , temp
+        , hum
+        , discomfort
+      );
+      break;
+  }
+}
+
+/*
+ * Streaming writers of the values in continuous mode.
+ *
+ * The records are formatted into one reusable buffer by hand and written
+ * to the file descriptor by write(2) in batches, without stdio.
+ */
+struct am2321_writer {
+
+  int fd;
+  int format;               // AM2321_OUTPUT_*
+  int stats;                // Writes the aggregates by write_stats_am2321().
+  size_t len;
+  uint64_t buffered_at;     // Time of the oldest record in the buffer.
+  char buf[8192];
+};
+
+/*!
+ * @brief Get the format of the writer from its name.
+ *
+ * @param[in] name Name of the format. "ndjson", "csv", "influx" or "binary".
+ *
+ * @return AM2321_OUTPUT_*, or -1 if unknown.
+ */
+int parse_output_am2321(const char *name) {
+
+  if (strcmp(name, "ndjson") == 0) {
+    return AM2321_OUTPUT_NDJSON;
+  } else if (strcmp(name, "csv") == 0) {
+    return AM2321_OUTPUT_CSV;
+  } else if (strcmp(name, "influx") == 0) {
+    return AM2321_OUTPUT_INFLUX;
+  } else if (strcmp(name, "binary") == 0) {
+    return AM2321_OUTPUT_BINARY;
+  }
+  return -1;
+}
+
+/*!
+ * @brief Write the records in the buffer to the file descriptor.
+ *
+ * @param[in,out] writer The writer.
+ *
+ * @return Successed : 0, Failed : -1
+ */
+int flush_writer_am2321(struct am2321_writer *writer) {
+
+  ssize_t ret;
+  size_t done = 0;
+
+  while (done < writer->len) {
+    if ((ret = write(writer->fd, writer->buf + done, writer->len - done)) == -1) {
+      printk(KERN_ERR "am2321 : Failed write the output.\n");
+      writer->len = 0;
+      return -1;
+    }
+    done += ret;
+  }
+  writer->len = 0;
+  return 0;
+}
+
+/*!
+ * @brief Append the string to the buffer of the writer.
+ */
+static inline void put_str(struct am2321_writer *writer, const char *str) {
+
+  size_t len = strlen(str);
+
+  memcpy(writer->buf + writer->len, str, len);
+  writer->len += len;
+}
+
+/*!
+ * @brief Append the unsigned decimal to the buffer of the writer.
+ */
+static inline void put_uint(struct am2321_writer *writer, uint64_t value) {
+
+  char digits[20];
+  int n = 0;
+
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+  while (n > 0) {
+    writer->buf[writer->len++] = digits[--n];
+  }
+}
+
+/*!
+ * @brief Append the value of 10 times to the buffer of the writer.
+ */
+static inline void put_x10(struct am2321_writer *writer, int value) {
+
+  writer->len += format_x10(writer->buf + writer->len, value);
+}
+
+/*!
+ * @brief Append the time in nanoseconds as the seconds with 9 digits after the point.
+ */
+static inline void put_time(struct am2321_writer *writer, uint64_t ns) {
+
+  uint64_t frac = ns % 1000000000;
+  int i;
+
+  put_uint(writer, ns / 1000000000);
+  writer->buf[writer->len++] = '.';
+  for (i = 8; i >= 0; i--) {
+    writer->buf[writer->len + i] = '0' + frac % 10;
+    frac /= 10;
+  }
+  writer->len += 9;
+}
+
+/*!
+ * @brief Append the name as the tag value of InfluxDB line protocol.
+ */
+static inline void put_tag(struct am2321_writer *writer, const char *name) {
+
+  for (; *name != '\0'; name++) {
+    if (*name == ',' || *name == '=' || *name == ' ') {
+      writer->buf[writer->len++] = '\\';
+    }
+    writer->buf[writer->len++] = *name;
+  }
+}
+
+/*!
+ * @brief Fill the record of AM2321_OUTPUT_BINARY with the measured values of AM2321.
+ *
+ * @param[out] record      The record.
+ * @param[in]  am2321_data The data of received from AM2321.
+ * @param[in]  sensor      Index of the sensor.
+ */
+void fill_record_am2321(struct am2321_output_record *record, struct am2321 *am2321_data, int sensor) {
+
+  int temp = calc_temp_x10(am2321_data), hum = calc_hum_x10(am2321_data);
+
+  memset(record, 0, sizeof(struct am2321_output_record));
+  record->time = realtime_ns() - (monotonic_ns() - am2321_data->timestamp);
+  record->sensor = sensor;
+  record->bus = am2321_data->bus;
+  record->address = am2321_data->address;
+  record->temperature = temp;
+  record->humidity = hum;
+  record->discomfort = discomfort_x10(temp, hum);
+}
+
+/*!
+ * @brief Append the measured values of AM2321 to the writer.
+ *
+ * The records are written when the rest of the buffer can not hold the
+ * next record, or when the oldest record is kept longer than
+ * AM2321_OUTPUT_FLUSH.
+ *
+ * @param[in,out] writer      The writer.
+ * @param[in]     am2321_data The data of received from AM2321.
+ * @param[in]     sensor      Index of the sensor.
+ */
+void write_am2321(struct am2321_writer *writer, struct am2321 *am2321_data, int sensor) {
+
+  uint64_t now = monotonic_ns();
+  uint64_t time = realtime_ns() - (now - am2321_data->timestamp);
+  int temp = calc_temp_x10(am2321_data), hum = calc_hum_x10(am2321_data);
+  int discomfort = discomfort_x10(temp, hum);
+  struct am2321_output_record record;
+
+  if (writer->len == 0) {
+    writer->buffered_at = now;
+  }
+  switch (writer->format) {
+    case AM2321_OUTPUT_NDJSON:
+      put_str(writer, "{\"Time\":");
+      put_time(writer, time);
+      if (am2321_data->name[0] != '\0') {
+        put_str(writer, ",\"Name\":\"");
+        put_str(writer, am2321_data->name);
+        put_str(writer, "\"");
+      }
+      put_str(writer, ",\"Bus\":");
+      put_uint(writer, am2321_data->bus);
+      put_str(writer, ",\"Address\":");
+      put_uint(writer, am2321_data->address);
+      put_str(writer, ",\"Templature\":");
+      put_x10(writer, temp);
+      put_str(writer, ",\"Humidity\":");
+      put_x10(writer, hum);
+      put_str(writer, ",\"Discomfort\":");
+      put_x10(writer, discomfort);
+      put_str(writer, "}\n");
+      break;
+    case AM2321_OUTPUT_CSV:
+      put_time(writer, time);
+      put_str(writer, ",");
+      put_str(writer, am2321_data->name);
+      put_str(writer, ",");
+      put_uint(writer, am2321_data->bus);
+      put_str(writer, ",");
+      put_uint(writer, am2321_data->address);
+      put_str(writer, ",");
+      put_x10(writer, temp);
+      put_str(writer, ",");
+      put_x10(writer, hum);
+      put_str(writer, ",");
+      put_x10(writer, discomfort);
+      put_str(writer, "\n");
+      break;
+    case AM2321_OUTPUT_INFLUX:
+      put_str(writer, "am2321");
+      if (am2321_data->name[0] != '\0') {
+        put_str(writer, ",sensor=");
+        put_tag(writer, am2321_data->name);
+      }
+      put_str(writer, ",bus=");
+      put_uint(writer, am2321_data->bus);
+      put_str(writer, ",address=");
+      put_uint(writer, am2321_data->address);
+      put_str(writer, " temperature=");
+      put_x10(writer, temp);
+      put_str(writer, ",humidity=");
+      put_x10(writer, hum);
+      put_str(writer, ",discomfort=");
+      put_x10(writer, discomfort);
+      put_str(writer, " ");
+      put_uint(writer, time);
+      put_str(writer, "\n");
+      break;
+    case AM2321_OUTPUT_BINARY:
+      fill_record_am2321(&record, am2321_data, sensor);
+      record.time = time;
+      memcpy(writer->buf + writer->len, &record, sizeof(record));
+      writer->len += sizeof(record);
+      break;
+  }
+  if (sizeof(writer->buf) - writer->len < AM2321_OUTPUT_RECORD_MAX || writer->buffered_at + AM2321_OUTPUT_FLUSH * 1000ULL <= now) {
+    flush_writer_am2321(writer);
+  }
+}
+
+static const char *const stats_values[AM2321_VALUES] = { "temperature", "humidity", "discomfort" };
+static const char *const stats_json_values[AM2321_VALUES] = { "Templature", "Humidity", "Discomfort" };
+static const char *const stats_fields[AM2321_STATS_FIELDS] = { "min", "max", "mean", "ewma", "p50", "p90", "p99" };
+static const char *const stats_json_fields[AM2321_STATS_FIELDS] = { "Min", "Max", "Mean", "EWMA", "P50", "P90", "P99" };
+static const double stats_quantiles[AM2321_STATS_FIELDS - 4] = { 0.5, 0.9, 0.99 };
+
+/*!
+ * @brief Sort the values in ascending order. The buffer of the digest is small enough for the insertion sort.
+ */
+static void sort_values(double *values, int n) {
+
+  double value;
+  int i, j;
+
+  for (i = 1; i < n; i++) {
+    value = values[i];
+    for (j = i; j > 0 && value < values[j - 1]; j--) {
+      values[j] = values[j - 1];
+    }
+    values[j] = value;
+  }
+}
+
+/*!
+ * @brief Merge the buffer into the centroids of the digest.
+ *
+ * The neighbours are merged while the weight of the centroid is within
+ * pi * total * sqrt(q * (1 - q)) / AM2321_DIGEST_COMPRESSION at its
+ * quantile q, so that the centroids are small at the tails.
+ *
+ * @param[in,out] digest The digest.
+ */
+static void compress_digest(struct am2321_digest *digest) {
+
+  double mean[AM2321_DIGEST_CENTROIDS + AM2321_DIGEST_BUFFER];
+  double weight[AM2321_DIGEST_CENTROIDS + AM2321_DIGEST_BUFFER];
+  double total, cumulative = 0.0, merged, q;
+  int i = 0, j = 0, n = 0, k = 0;
+
+  if (digest->nbuffer == 0) {
+    return;
+  }
+  sort_values(digest->buffer, digest->nbuffer);
+  while (i < digest->ncentroids || j < digest->nbuffer) {
+    if (j == digest->nbuffer || (i < digest->ncentroids && digest->mean[i] <= digest->buffer[j])) {
+      mean[n] = digest->mean[i];
+      weight[n++] = digest->weight[i++];
+    } else {
+      mean[n] = digest->buffer[j++];
+      weight[n++] = 1.0;
+    }
+  }
+  total = digest->total + digest->nbuffer;
+
+  digest->mean[0] = mean[0];
+  digest->weight[0] = weight[0];
+  for (i = 1; i < n; i++) {
+    merged = digest->weight[k] + weight[i];
+    q = (cumulative + merged / 2.0) / total;
+    // The last centroid takes the rest, not to overflow.
+    if (merged <= M_PI * total * sqrt(q * (1.0 - q)) / AM2321_DIGEST_COMPRESSION || k == AM2321_DIGEST_CENTROIDS - 1) {
+      digest->mean[k] += (mean[i] - digest->mean[k]) * weight[i] / merged;
+      digest->weight[k] = merged;
+    } else {
+      cumulative += digest->weight[k++];
+      digest->mean[k] = mean[i];
+      digest->weight[k] = weight[i];
+    }
+  }
+  digest->ncentroids = k + 1;
+  digest->total = total;
+  digest->nbuffer = 0;
+}
+
+/*!
+ * @brief Add the value to the digest.
+ *
+ * @param[in,out] digest The digest.
+ * @param[in]     value  The value.
+ */
+void add_digest_am2321(struct am2321_digest *digest, double value) {
+
+  digest->buffer[digest->nbuffer++] = value;
+  if (digest->nbuffer == AM2321_DIGEST_BUFFER) {
+    compress_digest(digest);
+  }
+}
+
+/*!
+ * @brief Estimate the quantile of the values added to the digest.
+ *
+ * The values are interpolated between the centers of the neighbour centroids.
+ *
+ * @param[in,out] digest The digest. The buffer is merged.
+ * @param[in]     q      The quantile. 0.0 to 1.0
+ *
+ * @return The estimated value, or 0.0 if no value is added.
+ */
+double quantile_digest_am2321(struct am2321_digest *digest, double q) {
+
+  double target, cumulative = 0.0, center, next;
+  int i;
+
+  compress_digest(digest);
+  if (digest->ncentroids == 0) {
+    return 0.0;
+  }
+  target = q * digest->total;
+  if (target <= digest->weight[0] / 2.0) {
+    return digest->mean[0];
+  }
+  for (i = 0; i + 1 < digest->ncentroids; i++) {
+    center = cumulative + digest->weight[i] / 2.0;
+    next = cumulative + digest->weight[i] + digest->weight[i + 1] / 2.0;
+    if (target <= next) {
+      return digest->mean[i] + (digest->mean[i + 1] - digest->mean[i]) * (target - center) / (next - center);
+    }
+    cumulative += digest->weight[i];
+  }
+  return digest->mean[digest->ncentroids - 1];
+}
+
+/*!
+ * @brief Initialize the aggregates.
+ *
+ * @param[out] stats The aggregates.
+ * @param[in]  alpha Smoothing factor of EWMA. 0.0 to 1.0
+ */
+void init_stats_am2321(struct am2321_stats *stats, double alpha) {
+
+  memset(stats, 0, sizeof(struct am2321_stats));
+  stats->alpha = alpha;
+}
+
+/*!
+ * @brief Begin the next window. EWMA and the last values forwarded are kept.
+ *
+ * @param[in,out] stats The aggregates.
+ */
+void reset_stats_am2321(struct am2321_stats *stats) {
+
+  double ewma;
+  int i;
+
+  stats->begin = 0;
+  for (i = 0; i < AM2321_VALUES; i++) {
+    ewma = stats->series[i].ewma;
+    memset(&stats->series[i], 0, sizeof(struct am2321_series));
+    stats->series[i].ewma = ewma;
+  }
+}
+
+/*!
+ * @brief Add the measured values of AM2321 to the aggregates in the window.
+ *
+ * @param[in,out] stats       The aggregates.
+ * @param[in]     am2321_data The data of received from AM2321.
+ * @param[in]     deadband    Deadband of 10 times of the temperature and the humidity. 0 : No sample is forwarded.
+ *
+ * @return 1 : The sample is the first one, or crosses the deadband from the last one forwarded, 0 : Otherwise
+ */
+int update_stats_am2321(struct am2321_stats *stats, struct am2321 *am2321_data, int deadband) {
+
+  struct am2321_series *series;
+  int values[AM2321_VALUES], i, forward = 0;
+
+  values[AM2321_VALUE_TEMPERATURE] = calc_temp_x10(am2321_data);
+  values[AM2321_VALUE_HUMIDITY] = calc_hum_x10(am2321_data);
+  values[AM2321_VALUE_DISCOMFORT] = discomfort_x10(values[AM2321_VALUE_TEMPERATURE], values[AM2321_VALUE_HUMIDITY]);
+
+  if (stats->series[0].count == 0) {
+    stats->begin = am2321_data->timestamp;
+  }
+  for (i = 0; i < AM2321_VALUES; i++) {
+    series = &stats->series[i];
+    if (series->count == 0 || values[i] < series->min) {
+      series->min = values[i];
+    }
+    if (series->count == 0 || series->max < values[i]) {
+      series->max = values[i];
+    }
+    series->count++;
+    series->sum += values[i];
+    series->ewma = stats->samples == 0 ? values[i] : series->ewma + stats->alpha * (values[i] - series->ewma);
+    add_digest_am2321(&series->digest, values[i]);
+  }
+
+  // The discomfort index follows the temperature and the humidity.
+  if (deadband > 0) {
+    forward = stats->samples == 0
+      || deadband <= abs(values[AM2321_VALUE_TEMPERATURE] - stats->last[AM2321_VALUE_TEMPERATURE])
+      || deadband <= abs(values[AM2321_VALUE_HUMIDITY] - stats->last[AM2321_VALUE_HUMIDITY]);
+  }
+  if (forward) {
+    memcpy(stats->last, values, sizeof(values));
+  }
+  stats->samples++;
+
+  return forward;
+}
+
+/*!
+ * @brief Round the value of 10 times to the integer.
+ */
+static inline int round_x10(double value) {
+
+  return (int)(value < 0.0 ? value - 0.5 : value + 0.5);
+}
+
+/*!
+ * @brief Get the aggregates of the series, in the order of stats_fields.
+ */
+static void summary_series(struct am2321_series *series, int *fields) {
+
+  int i;
+
+  fields[0] = series->min;
+  fields[1] = series->max;
+  fields[2] = round_x10((double)series->sum / series->count);
+  fields[3] = round_x10(series->ewma);
+  for (i = 0; i < AM2321_STATS_FIELDS - 4; i++) {
+    fields[4 + i] = round_x10(quantile_digest_am2321(&series->digest, stats_quantiles[i]));
+    // The estimation is not out of the values.
+    fields[4 + i] = fields[4 + i] < series->min ? series->min : series->max < fields[4 + i] ? series->max : fields[4 + i];
+  }
+}
+
+/*!
+ * @brief Append the aggregates of the window to the writer.
+ *
+ * The writer must be opened with AM2321_OUTPUT_STATS, in the format other
+ * than AM2321_OUTPUT_BINARY. The record is the time of the last sample in
+ * the window, the length of the window, the number of the samples, and
+ * min, max, mean, EWMA, p50, p90 and p99 of the temperature, the humidity
+ * and the discomfort index. Nothing is written if the window is empty.
+ *
+ * @param[in,out] writer      The writer.
+ * @param[in,out] stats       The aggregates. The digests are merged.
+ * @param[in]     am2321_data The data of the last sample in the window.
+ */
+void write_stats_am2321(struct am2321_writer *writer, struct am2321_stats *stats, struct am2321 *am2321_data) {
+
+  uint64_t now = monotonic_ns();
+  uint64_t time = realtime_ns() - (now - am2321_data->timestamp);
+  uint64_t window = am2321_data->timestamp - stats->begin;
+  uint32_t count = stats->series[0].count;
+  int fields[AM2321_VALUES][AM2321_STATS_FIELDS];
+  int i, j;
+
+  if (count == 0 || writer->format == AM2321_OUTPUT_BINARY) {
+    return;
+  }
+  for (i = 0; i < AM2321_VALUES; i++) {
+    summary_series(&stats->series[i], fields[i]);
+  }
+
+  if (writer->len == 0) {
+    writer->buffered_at = now;
+  }
+  switch (writer->format) {
+    case AM2321_OUTPUT_NDJSON:
+      put_str(writer, "{\"Time\":");
+      put_time(writer, time);
+      if (am2321_data->name[0] != '\0') {
+        put_str(writer, ",\"Name\":\"");
+        put_str(writer, am2321_data->name);
+        put_str(writer, "\"");
+      }
+      put_str(writer, ",\"Bus\":");
+      put_uint(writer, am2321_data->bus);
+      put_str(writer, ",\"Address\":");
+      put_uint(writer, am2321_data->address);
+      put_str(writer, ",\"Window\":");
+      put_time(writer, window);
+      put_str(writer, ",\"Count\":");
+      put_uint(writer, count);
+      for (i = 0; i < AM2321_VALUES; i++) {
+        put_str(writer, ",\"");
+        put_str(writer, stats_json_values[i]);
+        put_str(writer, "\":{");
+        for (j = 0; j < AM2321_STATS_FIELDS; j++) {
+          put_str(writer, j == 0 ? "\"" : ",\"");
+          put_str(writer, stats_json_fields[j]);
+          put_str(writer, "\":");
+          put_x10(writer, fields[i][j]);
+        }
+        put_str(writer, "}");
+      }
+      put_str(writer, "}\n");
+      break;
+    case AM2321_OUTPUT_CSV:
+      put_time(writer, time);
+      put_str(writer, ",");
+      put_str(writer, am2321_data->name);
+      put_str(writer, ",");
+      put_uint(writer, am2321_data->bus);
+      put_str(writer, ",");
+      put_uint(writer, am2321_data->address);
+      put_str(writer, ",");
+      put_time(writer, window);
+      put_str(writer, ",");
+      put_uint(writer, count);
+      for (i = 0; i < AM2321_VALUES; i++) {
+        for (j = 0; j < AM2321_STATS_FIELDS; j++) {
+          put_str(writer, ",");
+          put_x10(writer, fields[i][j]);
+        }
+      }
+      put_str(writer, "\n");
+      break;
+    case AM2321_OUTPUT_INFLUX:
+      put_str(writer, "am2321_stats");
+      if (am2321_data->name[0] != '\0') {
+        put_str(writer, ",sensor=");
+        put_tag(writer, am2321_data->name);
+      }
+      put_str(writer, ",bus=");
+      put_uint(writer, am2321_data->bus);
+      put_str(writer, ",address=");
+      put_uint(writer, am2321_data->address);
+      put_str(writer, " window=");
+      put_time(writer, window);
+      put_str(writer, ",count=");
+      put_uint(writer, count);
+      put_str(writer, "i");
+      for (i = 0; i < AM2321_VALUES; i++) {
+        for (j = 0; j < AM2321_STATS_FIELDS; j++) {
+          put_str(writer, ",");
+          put_str(writer, stats_values[i]);
+          put_str(writer, "_");
+          put_str(writer, stats_fields[j]);
+          put_str(writer, "=");
+          put_x10(writer, fields[i][j]);
+        }
+      }
+      put_str(writer, " ");
+      put_uint(writer, time);
+      put_str(writer, "\n");
+      break;
+  }
+  if (sizeof(writer->buf) - writer->len < AM2321_OUTPUT_RECORD_MAX || writer->buffered_at + AM2321_OUTPUT_FLUSH * 1000ULL <= now) {
+    flush_writer_am2321(writer);
+  }
+}
+
+/*!
+ * @brief Create the writer to the file descriptor.
+ *
+ * The header of CSV is written once here. The header is of the aggregates
+ * if AM2321_OUTPUT_STATS is set to the format.
+ *
+ * @param[in] fd     The file descriptor to write the records to.
+ * @param[in] format AM2321_OUTPUT_*, with AM2321_OUTPUT_STATS.
+ *
+ * @return The writer, or NULL if failed.
+ */
+struct am2321_writer *open_writer_am2321(int fd, int format) {
+
+  struct am2321_writer *writer;
+  int i, j;
+
+  if ((writer = calloc(1, sizeof(struct am2321_writer))) == NULL) {
+    return NULL;
+  }
+  writer->fd = fd;
+  writer->format = format & ~AM2321_OUTPUT_STATS;
+  writer->stats = (format & AM2321_OUTPUT_STATS) != 0;
+  if (writer->format == AM2321_OUTPUT_CSV && writer->stats) {
+    put_str(writer, "time,name,bus,address,window,count");
+    for (i = 0; i < AM2321_VALUES; i++) {
+      for (j = 0; j < AM2321_STATS_FIELDS; j++) {
+        put_str(writer, ",");
+        put_str(writer, stats_values[i]);
+        put_str(writer, "_");
+        put_str(writer, stats_fields[j]);
+      }
+    }
+    put_str(writer, "\n");
+    flush_writer_am2321(writer);
+  } else if (writer->format == AM2321_OUTPUT_CSV) {
+    put_str(writer, "time,name,bus,address,temperature,humidity,discomfort\n");
+    flush_writer_am2321(writer);
+  }
+  return writer;
+}
+
+/*!
+ * @brief Flush and free the writer. The file descriptor is not closed.
+ *
+ * @param[in] writer The writer.
+ */
+void close_writer_am2321(struct am2321_writer *writer) {
+
+  flush_writer_am2321(writer);
+  free(writer);
+}
+
+#endif
@@ -0,0 +1,520 @@
+/*!
+ *
+ * Public interface of libam2321, the library to measure the temperature and
+ * the humidity from AM2321 sold by Akizuki-denshi.
+ *
+ * The session is opened once and measured many times :
+ *
+ *   struct am2321 am2321_data;
+ *
+ *   if (open_am2321(&am2321_data, 1, AM2321_ID, AM2321_VARIANT_AM2321, -1, 0) == 0) {
+ *     if (measure_retry(&am2321_data) == 0) {
+ *       printf("%.1f\n", calc_temp(&am2321_data));
+ *     }
+ *     close_am2321(&am2321_data);
+ *   }
+ *
+ * Link with -lam2321. The decode functions in am2321-decode.h, which is
+ * included from here, can be inlined into the caller by defining
+ * AM2321_HEADER_ONLY before the include. Then the frames decoded need not
+ * link with the library.
+ *
+ * @file am2321.h
+ */
+#ifndef AM2321_H
+#define AM2321_H
+
+#if MODULE
+  #include <linux/types.h>
+  #include <linux/i2c.h>
+  typedef struct i2c_client I2CSlave;
+#else
+  #include <stddef.h>
+  #include <stdint.h>
+  #include <stdio.h>
+  #include <time.h>
+  #include "lib/i2c-ctl.h"
+#endif
+
+/*
+ * Version of the library. The major is the soname of libam2321.so, and is
+ * raised when struct am2321 or the signatures are changed incompatibly.
+ * The new fields of the structs are added only at their ends within a
+ * major, so the callers must not depend on their sizes, and must open
+ * the sessions by open_am2321().
+ */
+#define AM2321_VERSION_MAJOR 2
+#define AM2321_VERSION_MINOR 0
+#define AM2321_VERSION "2.0"
+
+#define I2C_DEV "/dev/i2c-%d"
+
+#define AM2321_ID 0x5c
+#define AM2321_DEV_NAME "am2321"
+#define I2C_SLAVE_MAX_RETRY 5
+#define AM2321_WAIT_WAKEUP 800      // 800 to 3000
+#define AM2321_WAIT_WRITEMODE 1500  // up to 1500
+#define AM2321_WAIT_READMODE 30     // up to 30
+#define AM2321_WAIT_REFRESH 2000000 // up to 2000000(= 2sec)
+#define AM2321_MAX_AGE 120000000    // Max age of the last conversion to skip warm-up. (= 2min)
+
+/*
+ * Health of AM2321 by the faults of the measurements. See update_health_am2321().
+ */
+#define AM2321_HEALTH_MAX 100       // Score of AM2321 without the faults.
+#define AM2321_HEALTH_FLAKY 60      // AM2321 of the score below this is flaky.
+#define AM2321_HEALTH_DEAD 5        // Measurements failed in a row until AM2321 is quarantined.
+#define AM2321_HEALTH_PROBE 300000000 // Max backoff of the failed AM2321, as the probe of the quarantined one. (= 5min)
+
+/*!
+ * States of the health of AM2321. See state_health_am2321().
+ */
+enum am2321_health_state {
+  AM2321_HEALTHY = 0,       // Measured at the normal rate with all retries.
+  AM2321_FLAKY,             // Retried once, after the healthy ones.
+  AM2321_QUARANTINED,       // Probed once after the backoff up to AM2321_HEALTH_PROBE.
+};
+
+/*
+ * Classes of the failure of the measurement. Each class is retried in its own way.
+ * See measure_retry().
+ */
+#define AM2321_ERR_IO -1      // Failed I2C transfer.
+#define AM2321_ERR_WAKEUP -2  // AM2321 does not wake up yet. (NACK after the wakeup)
+#define AM2321_ERR_CRC -3     // CRC mismatch. The frame is broken on the bus.
+#define AM2321_ERR_DEVICE -4  // AM2321 returned the error code.
+#define AM2321_ERR_NODEV -5   // The device is missing (NACK after the wakeup twice in a row), or the session is not opened.
+
+/*!
+ * Steps of the measurement from AM2321.
+ */
+enum am2321_step {
+  AM2321_STEP_IDLE = 0,
+  AM2321_STEP_WAKEUP,
+  AM2321_STEP_WRITEMODE,
+  AM2321_STEP_REQUEST,
+  AM2321_STEP_READ,
+  AM2321_STEP_FAILED,     // The last measurement is failed.
+};
+
+/*!
+ * Phases of the measurement timed when built with -DAM2321_TIMING=1.
+ * The wait before the step s is AM2321_PHASE_WAIT(s).
+ */
+enum am2321_phase {
+  AM2321_PHASE_OPEN = 0,        // init_i2c_slave() in open_am2321().
+  AM2321_PHASE_WAKEUP,          // The write NACKed by AM2321 in suspend mode.
+  AM2321_PHASE_WAIT_WAKEUP,
+  AM2321_PHASE_WRITEMODE,
+  AM2321_PHASE_WAIT_WRITEMODE,
+  AM2321_PHASE_REQUEST,
+  AM2321_PHASE_WAIT_READMODE,
+  AM2321_PHASE_READ,
+  AM2321_PHASE_MEASURE,         // Whole of measure().
+  AM2321_PHASE_RETRY,           // Whole of measure_retry(), including the retries.
+  AM2321_PHASES,
+};
+#define AM2321_PHASE_WAIT(step) (2 * (step) - 2)
+
+/*!
+ * The health of AM2321. All zero is healthy, so it is kept over the reopen of the session.
+ */
+struct am2321_health {
+
+  int penalty;          // EWMA of the faults per measurement. 0 to AM2321_HEALTH_MAX.
+  int failed;           // Measurements failed in a row.
+  uint64_t due;         // Time of the next measurement after the backoff. (CLOCK_MONOTONIC, nsec) 0 : At once.
+  uint64_t faults;      // Sum of the counters of the faults at the last update.
+};
+
+/*!
+ * The waits of the measurement which can be calibrated. See calibrate_am2321().
+ */
+enum am2321_wait {
+  AM2321_CAL_WAKEUP = 0,
+  AM2321_CAL_WRITEMODE,
+  AM2321_CAL_READMODE,
+  AM2321_CAL_WAITS,
+};
+
+/*!
+ * Variants of the sensor on the same protocol of I2C. See am2321_descriptors[].
+ * AM2321 is 0, the default of the command.
+ */
+enum am2321_variant {
+  AM2321_VARIANT_AM2321 = 0,
+  AM2321_VARIANT_AM2320,
+  AM2321_VARIANT_AM2322,
+  AM2321_VARIANT_DHT12,
+  AM2321_VARIANTS,
+};
+
+/*!
+ * Frames read from the sensors. All are converted to AM2321_FRAME_MODBUS
+ * in register_data by the converter of the descriptor.
+ */
+enum am2321_frame {
+  AM2321_FRAME_MODBUS = 0,  // Function code, length, 4 registers and CRC-16 (Modbus) of AM232x.
+  AM2321_FRAME_SUM,         // Integer and decimal of the humidity and the temperature, and the 8 bit sum of DHT12.
+};
+
+/*!
+ * The descriptor of the variant of the sensor.
+ */
+struct am2321_descriptor {
+
+  const char *name;
+  int address;              // I2C slave address.
+  int frame;                // AM2321_FRAME_*
+  int wakeup;               // Woken up from suspend mode, and read in write mode. 0 : Only the request and the read.
+  int registers;            // Has the registers of the model and the device ID. See discover_am2321().
+  int wait[AM2321_CAL_WAITS]; // The safe waits.
+  char request[3];          // Request of the humidity and the temperature.
+  int request_len;
+  int frame_len;            // Length of the frame read.
+  int (*convert)(char *frame); // Convert the frame read to AM2321_FRAME_MODBUS. Failed : -1
+};
+
+struct am2321;
+
+/*!
+ * Selects the channel of the mux in front of AM2321 with the bus locked.
+ * Returns Successed : 0, Failed : -1
+ */
+typedef int (*am2321_select_t)(struct am2321 *am2321_data, void *arg);
+
+struct am2321 {
+
+  char register_data[8];
+  uint64_t timestamp;   // register_data の取得時刻。 (CLOCK_MONOTONIC, nsec)
+
+  I2CSlave *i2c_slave;  // Session handle. NULL while the session is closed.
+  int bus;              // Number of I2C bus. (/dev/i2c-<bus>)
+  int address;          // I2C slave address of AM2321.
+  int variant;          // AM2321_VARIANT_*. See open_am2321().
+  int mux_address;      // I2C slave address of TCA9548A in front of AM2321. -1 : No mux.
+  int mux_channel;      // Channel of TCA9548A connected to AM2321.
+  char name[32];        // Name of AM2321 in the config, [A-Za-z0-9_.-]. Empty for the single sensor.
+  int step;             // Next step of the measurement. See step_am2321().
+  int lock_fd;          // /dev/i2c-<bus> locked during each transfer. -1 : Not locked. See share_bus_am2321().
+
+  uint64_t crc_errors;        // Count of the frames failed check_crc().
+  uint64_t device_errors[8];  // Count of the error codes 0x80 to 0x87 of check_err().
+  uint64_t retries;           // Count of the retries of measure_retry().
+  struct am2321_health health; // See update_health_am2321().
+
+  int wait[AM2321_CAL_WAITS]; // Calibrated waits in microseconds. 0 : The safe value of the descriptor.
+  uint32_t history;           // Results of the last 32 measurements with the calibrated waits. 1 : Failed.
+
+  int discovered;             // The registers below are read by discover_am2321() in this session.
+  uint16_t model;             // Model. (register 0x08 - 0x09)
+  uint8_t version;            // Version. (register 0x0a)
+  uint32_t device_id;         // Device ID. (register 0x0b - 0x0e)
+
+  am2321_select_t select;     // Select the channel of AM2321 in the bus lock. See share_bus_am2321().
+  void *select_arg;
+
+  // Resolved from the variant once by open_am2321(), not to look it up at each frame.
+  const struct am2321_descriptor *descriptor;
+  int (*convert)(char *frame);  // descriptor->convert
+};
+
+#include "am2321-decode.h"
+
+/*
+ * Measurement. (am2321.c)
+ */
+int write_mode_am2321(I2CSlave *i2c_slave);
+int wakeup_am2321(I2CSlave *i2c_slave);
+int open_am2321(struct am2321 *am2321_data, int bus, int address, int variant, int mux_address, int mux_channel);
+int close_am2321(struct am2321 *am2321_data);
+int wait_am2321(struct am2321 *am2321_data, int wait);
+int check_frame_am2321(struct am2321 *am2321_data);
+void begin_am2321(struct am2321 *am2321_data);
+int step_am2321(struct am2321 *am2321_data);
+int run_am2321(struct am2321 *am2321_data);
+int measure(struct am2321 *am2321_data);
+int discover_am2321(struct am2321 *am2321_data);
+
+/*
+ * Latency histograms, only when built with -DAM2321_TIMING=1.
+ * TIMED_AM2321() evaluates the expression and counts its latency in the phase.
+ */
+#if AM2321_TIMING && !MODULE
+void record_timing_am2321(int phase, uint64_t value);
+uint64_t quantile_timing_am2321(int phase, double quantile);
+void summary_timing_am2321(int phase, uint64_t *count, uint64_t *sum);
+const char *phase_name_am2321(int phase);
+void print_timing_am2321(FILE *stream);
+
+/*!
+ * @brief Get the time of CLOCK_MONOTONIC_RAW, which is not slewed by NTP.
+ *
+ * @return The time in nanoseconds.
+ */
+static inline uint64_t raw_ns(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+  #define TIMED_AM2321(phase, expr) ({ \
+    uint64_t timed_begin = raw_ns(); \
+    __typeof__(expr) timed_ret = (expr); \
+    record_timing_am2321((phase), raw_ns() - timed_begin); \
+    timed_ret; \
+  })
+#else
+  #define TIMED_AM2321(phase, expr) (expr)
+#endif
+
+#if !MODULE
+uint64_t monotonic_ns(void);
+uint64_t realtime_ns(void);
+void lock_bus_am2321(int fd);
+void unlock_bus_am2321(int fd);
+void share_bus_am2321(struct am2321 *am2321_data, int fd, am2321_select_t select, void *arg);
+const char *strerror_am2321(int err);
+long backoff_am2321(int count, unsigned int *seed);
+int health_am2321(const struct am2321 *am2321_data);
+int state_health_am2321(const struct am2321 *am2321_data);
+int budget_am2321(const struct am2321 *am2321_data);
+int due_am2321(const struct am2321 *am2321_data, uint64_t now);
+void update_health_am2321(struct am2321 *am2321_data, int ret);
+int measure_retry(struct am2321* am2321_data);
+
+/*
+ * Non-blocking API for the event loop of the host application.
+ *
+ * The measurement with the retries is advanced by step_async_am2321()
+ * without sleeping. Between the steps, the host waits for the timerfd
+ * (async.fd) to be readable in its epoll, or for async.deadline by its
+ * own timer, e.g. the timeout of io_uring :
+ *
+ *   struct am2321 am2321_data;
+ *   struct am2321_async async;
+ *
+ *   open_am2321(&am2321_data, 1, AM2321_ID, AM2321_VARIANT_AM2321, -1, 0);
+ *   open_async_am2321(&async, &am2321_data);
+ *   epoll_ctl(epfd, EPOLL_CTL_ADD, async.fd, &ev);
+ *   begin_async_am2321(&async);
+ *   ...
+ *   // When async.fd is readable :
+ *   if ((ret = step_async_am2321(&async)) == 0) {
+ *     print_am2321(&am2321_data, 'c');
+ *   } else if (ret < 0) {
+ *     printf("%s\n", strerror_am2321(ret));
+ *   }
+ */
+#define AM2321_PENDING 1    // Returned by step_async_am2321() while measuring.
+
+/*!
+ * The asynchronous measurement of AM2321.
+ */
+struct am2321_async {
+
+  struct am2321 *am2321_data;
+  int fd;                   // timerfd which is readable at the deadline.
+  uint64_t deadline;        // Time of the next step. (CLOCK_MONOTONIC, nsec) 0 : Not measuring.
+  int count;                // Count of the retries.
+  int backoff;              // Count of the backoffs.
+  int reopen;               // Reopen the session at the next step.
+  unsigned int seed;
+  int nacks;                // Count of AM2321_ERR_WAKEUP in a row, the second is AM2321_ERR_NODEV.
+};
+
+int open_async_am2321(struct am2321_async *async, struct am2321 *am2321_data);
+void close_async_am2321(struct am2321_async *async);
+void begin_async_am2321(struct am2321_async *async);
+int step_async_am2321(struct am2321_async *async);
+
+/*
+ * The state of the last conversion, and the calibrated waits, kept in the files.
+ * The state files are in /run/am2321, or in the environment variable AM2321_STATE_DIR.
+ * The calibration files are in /var/lib/am2321, or in AM2321_CALIBRATION_DIR.
+ */
+int save_state_am2321(struct am2321 *am2321_data);
+long long load_state_am2321(struct am2321 *am2321_data);
+int save_calibration_am2321(struct am2321 *am2321_data);
+int load_calibration_am2321(struct am2321 *am2321_data);
+int calibrate_am2321(struct am2321 *am2321_data);
+
+/*
+ * Bulk decoder of the frames. See decode_bulk_am2321().
+ */
+#define AM2321_BULK_CRC 0x01  // Status : CRC mismatch.
+#define AM2321_BULK_ERR 0x02  // Status : AM2321 returned the error code.
+
+/*!
+ * The values decoded by decode_bulk_am2321(), in the structure of arrays.
+ * Each array has the elements as many as the frames.
+ */
+struct am2321_bulk {
+
+  int16_t *temperature;     // 0.1 degC
+  uint16_t *humidity;       // 0.1 %RH
+  int16_t *discomfort;      // 0.1
+  uint8_t *status;          // 0 : OK, AM2321_BULK_CRC | AM2321_BULK_ERR : Failed
+};
+
+size_t decode_bulk_am2321(const char (*frames)[8], size_t n, struct am2321_bulk *out);
+
+/*
+ * Capture of the raw frames.
+ */
+#define AM2321_CAPTURE_ANCHOR 0xffff    // Sensor of the record of the clock anchor.
+
+/*!
+ * A record of the capture file. The records are appended after the header.
+ *
+ * The record whose sensor is AM2321_CAPTURE_ANCHOR is the clock anchor
+ * written at each start of the capture. Its frame is CLOCK_REALTIME at the
+ * CLOCK_MONOTONIC timestamp, to convert the timestamps of the following records.
+ */
+struct am2321_frame_record {
+
+  uint64_t timestamp;       // Time of the frame is received. (CLOCK_MONOTONIC, nsec)
+  uint16_t sensor;          // Index of AM2321 in the config.
+  uint8_t bus;
+  uint8_t address;
+  int32_t status;           // Result of the measurement. 0 : Successed, negative : Failed
+  char frame[8];            // register_data
+};
+
+struct am2321_capture;
+
+struct am2321_capture *open_capture_am2321(const char *path);
+void append_capture_am2321(struct am2321_capture *capture, const struct am2321_frame_record *record);
+int flush_capture_am2321(struct am2321_capture *capture);
+void close_capture_am2321(struct am2321_capture *capture);
+int decode_capture_am2321(const char *path, int format);
+
+/*
+ * Compact history of the values.
+ */
+#define AM2321_HISTORY_MAGIC "AMH1"
+#define AM2321_HISTORY_BLOCK 4096   // Size of a block, as a page of the flash memory.
+#define AM2321_HISTORY_CHANGES 0x01 // Flag : Append only the values changed from the last ones.
+
+/*!
+ * The header at the top of each block of the history file.
+ *
+ * The records follow the header in the block. Each record is the varints of
+ * the index of the sensor, the milliseconds from the last record in the
+ * block (or from the time of the block), and the zigzag encoded differences
+ * of the temperature and the humidity of 10 times from the last record of
+ * the sensor in the block (or from 0). Thus each block is decoded alone.
+ */
+struct am2321_history_header {
+
+  char magic[4];            // AM2321_HISTORY_MAGIC
+  uint16_t count;           // Number of the records in the block.
+  uint16_t length;          // Bytes of the records.
+  uint16_t crc;             // CRC-16/MODBUS of the records.
+  uint16_t reserved[3];
+  uint64_t time;            // Time of the first record. (CLOCK_REALTIME, nsec)
+};
+
+struct am2321_history;
+
+struct am2321_history *open_history_am2321(const char *path, int nsensors, int flags);
+int append_history_am2321(struct am2321_history *history, struct am2321 *am2321_data, int sensor);
+int flush_history_am2321(struct am2321_history *history);
+void close_history_am2321(struct am2321_history *history);
+int decode_history_am2321(const char *path, int format);
+
+/*
+ * Output of the values.
+ */
+#define AM2321_OUTPUT_NDJSON 1
+#define AM2321_OUTPUT_CSV 2
+#define AM2321_OUTPUT_INFLUX 3
+#define AM2321_OUTPUT_BINARY 4
+#define AM2321_OUTPUT_STATS 0x100   // Flag : The writer of the aggregates.
+
+/*!
+ * The record of AM2321_OUTPUT_BINARY, in the byte order of the host.
+ */
+struct am2321_output_record {
+
+  uint64_t time;            // Time of the frame is received. (CLOCK_REALTIME, nsec)
+  uint16_t sensor;          // Index of the sensor in the config.
+  uint8_t bus;
+  uint8_t address;
+  int16_t temperature;      // 0.1 degC
+  uint16_t humidity;        // 0.1 %RH
+  int16_t discomfort;       // 0.1
+  uint16_t reserved[3];
+};
+
+struct am2321_writer;
+
+void print_am2321(struct am2321 *am2321_data, int format);
+int parse_output_am2321(const char *name);
+struct am2321_writer *open_writer_am2321(int fd, int format);
+void fill_record_am2321(struct am2321_output_record *record, struct am2321 *am2321_data, int sensor);
+void write_am2321(struct am2321_writer *writer, struct am2321 *am2321_data, int sensor);
+int flush_writer_am2321(struct am2321_writer *writer);
+void close_writer_am2321(struct am2321_writer *writer);
+
+/*
+ * Aggregation of the values over the windows.
+ */
+#define AM2321_DIGEST_COMPRESSION 25  // The centroids are at most about 2 times of it.
+#define AM2321_DIGEST_CENTROIDS 64
+#define AM2321_DIGEST_BUFFER 32
+
+#define AM2321_VALUE_TEMPERATURE 0
+#define AM2321_VALUE_HUMIDITY 1
+#define AM2321_VALUE_DISCOMFORT 2
+#define AM2321_VALUES 3
+
+/*!
+ * The merging t-digest of the values, in the fixed memory.
+ */
+struct am2321_digest {
+
+  int ncentroids;
+  int nbuffer;
+  double total;             // Sum of the weights of the centroids.
+  double mean[AM2321_DIGEST_CENTROIDS];
+  double weight[AM2321_DIGEST_CENTROIDS];
+  double buffer[AM2321_DIGEST_BUFFER];  // The values not merged yet.
+};
+
+/*!
+ * The aggregate of a value of 10 times over the window.
+ */
+struct am2321_series {
+
+  uint32_t count;
+  int min;
+  int max;
+  int64_t sum;
+  double ewma;              // Not reset by the window.
+  struct am2321_digest digest;
+};
+
+/*!
+ * The aggregates of the values of AM2321 over the window.
+ */
+struct am2321_stats {
+
+  double alpha;             // Smoothing factor of EWMA. 0.0 to 1.0
+  uint64_t begin;           // Time of the first sample in the window. (CLOCK_MONOTONIC, nsec)
+  uint64_t samples;         // Number of the samples since init_stats_am2321().
+  int last[AM2321_VALUES];  // The values of the last sample forwarded by the deadband.
+  struct am2321_series series[AM2321_VALUES];
+};
+
+void add_digest_am2321(struct am2321_digest *digest, double value);
+double quantile_digest_am2321(struct am2321_digest *digest, double q);
+void init_stats_am2321(struct am2321_stats *stats, double alpha);
+void reset_stats_am2321(struct am2321_stats *stats);
+int update_stats_am2321(struct am2321_stats *stats, struct am2321 *am2321_data, int deadband);
+void write_stats_am2321(struct am2321_writer *writer, struct am2321_stats *stats, struct am2321 *am2321_data);
+#endif
+
+#endif
@@ -0,0 +1,595 @@
+/*!
+ *
+ * Benchmark of libam2321 on the simulated AM2321s of am2321-mock.c.
+ *
+ * The measurement is benchmarked in each mode, and the samples/s, the
+ * latency per sample and the syscalls per sample are printed :
+ *
+ *   oneshot   : open_am2321(), measure() and close_am2321() per sample.
+ *   session   : measure() on the session opened once.
+ *   pipelined : step_am2321() of the sensors interleaved, as the daemon does.
+ *   retry     : measure_retry() with the NACKs and the broken frames.
+ *   startup   : Time to the first output of the one-shot "am2321 -F -j" with
+ *               the fresh state, by fork and exec. (Not the syscalls.)
+ *   shutdown  : Time to the exit of the daemon "am2321 -d -I" by SIGTERM,
+ *               after its AM2321s are in the backoff of the NACKs. The
+ *               command must be built with the mock. (A sample only.)
+ *   crc       : crc16_modbus() and its references per frame, without the bus.
+ *   decode    : check_crc() and calc_*_x10() per frame, and decode_bulk_am2321().
+ *
+ * Built and run by "make bench".
+ *
+ * @file am2321-bench.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "am2321.h"
+#include "am2321-mock.h"
+
+#define BENCH_FRAMES 1000000    // Frames of the crc and decode modes.
+#define BENCH_UNHEALTHY 6500000 // Time of the shutdown mode until SIGTERM : the sweeps after the backoff. (usec)
+
+static volatile uint64_t bench_sink;  // Keeps the results of the crc and decode modes.
+
+/*!
+ * The options of the benchmark.
+ */
+struct bench_options {
+
+  int samples;
+  int sensors;
+  int latency;
+  double nack;
+  double crc;
+  const char *command;      // The command am2321 of the startup and shutdown modes.
+};
+
+/*!
+ * The result of a mode.
+ */
+struct bench_result {
+
+  uint64_t *latency;        // Latency of each sample. (nsec)
+  int samples;
+  int failures;
+  uint64_t elapsed;         // nsec
+  uint64_t syscalls;
+};
+
+/*!
+ * @brief Compare the latencies for qsort().
+ */
+static int cmp_latency(const void *a, const void *b) {
+
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/*!
+ * @brief Get the latency at the quantile of the result. The latencies must be sorted.
+ */
+static double quantile_bench(const struct bench_result *result, double quantile) {
+
+  int i = (int)(quantile * (result->samples - 1) + 0.5);
+
+  return result->samples == 0 ? 0.0 : result->latency[i] / 1000.0;
+}
+
+/*!
+ * @brief Print the result of the mode.
+ */
+static void print_bench(const char *mode, struct bench_result *result) {
+
+  int n = result->samples - result->failures;
+
+  qsort(result->latency, result->samples, sizeof(uint64_t), cmp_latency);
+  printf("%-10s %8d %12.1f %12.1f %12.1f %12.2f %8d\n", mode, result->samples
+    , n * 1e9 / result->elapsed, quantile_bench(result, 0.5), quantile_bench(result, 0.99)
+    , (double)result->syscalls / result->samples, result->failures);
+}
+
+/*!
+ * @brief Set the config of the mock for the mode.
+ */
+static void mock_bench(const struct bench_options *options, double nack, double crc) {
+
+  struct am2321_mock_config config;
+
+  get_config_mock_am2321(&config);
+  config.latency = options->latency;
+  config.nack = nack;
+  config.crc = crc;
+  config_mock_am2321(&config);
+}
+
+/*!
+ * @brief Measure by open_am2321(), measure() and close_am2321() per sample.
+ */
+static void bench_oneshot(const struct bench_options *options, struct bench_result *result) {
+
+  struct am2321 am2321_data;
+  uint64_t begin, syscalls = syscalls_mock_am2321(), start = monotonic_ns();
+  int i;
+
+  mock_bench(options, 0.0, 0.0);
+  for (i = 0; i < options->samples; i++) {
+    begin = monotonic_ns();
+    if (open_am2321(&am2321_data, 1, AM2321_ID, AM2321_VARIANT_AM2321, -1, 0) == -1 || measure(&am2321_data) != 0) {
+      result->failures++;
+    }
+    close_am2321(&am2321_data);
+    result->latency[result->samples++] = monotonic_ns() - begin;
+  }
+  result->elapsed = monotonic_ns() - start;
+  result->syscalls = syscalls_mock_am2321() - syscalls;
+}
+
+/*!
+ * @brief Measure by measure() or measure_retry() on the session opened once.
+ */
+static void bench_session(const struct bench_options *options, struct bench_result *result, int retry) {
+
+  struct am2321 am2321_data;
+  uint64_t begin, syscalls, start;
+  int i;
+
+  mock_bench(options, retry ? options->nack : 0.0, retry ? options->crc : 0.0);
+  if (open_am2321(&am2321_data, 1, AM2321_ID, AM2321_VARIANT_AM2321, -1, 0) == -1) {
+    result->failures = options->samples;
+    return;
+  }
+  syscalls = syscalls_mock_am2321();
+  start = monotonic_ns();
+  for (i = 0; i < options->samples; i++) {
+    begin = monotonic_ns();
+    if ((retry ? measure_retry(&am2321_data) : measure(&am2321_data)) != 0) {
+      result->failures++;
+    }
+    result->latency[result->samples++] = monotonic_ns() - begin;
+  }
+  result->elapsed = monotonic_ns() - start;
+  result->syscalls = syscalls_mock_am2321() - syscalls;
+  close_am2321(&am2321_data);
+}
+
+/*!
+ * @brief Measure from the sensors at once by step_am2321() with the deadlines.
+ */
+static void bench_pipelined(const struct bench_options *options, struct bench_result *result) {
+
+  struct am2321 *sensors;
+  uint64_t *begin, *deadline, now, syscalls, start;
+  int i, ret, active, next = 0, min;
+
+  sensors = calloc(options->sensors, sizeof(struct am2321));
+  begin = calloc(options->sensors, sizeof(uint64_t));
+  deadline = calloc(options->sensors, sizeof(uint64_t));
+  mock_bench(options, 0.0, 0.0);
+  for (i = 0; i < options->sensors; i++) {
+    open_am2321(&sensors[i], 1, AM2321_ID, AM2321_VARIANT_AM2321, -1, 0);
+  }
+
+  syscalls = syscalls_mock_am2321();
+  start = monotonic_ns();
+  // Each sensor begins again when its measurement is finished, until the samples are begun.
+  for (i = 0; i < options->sensors && next < options->samples; i++, next++) {
+    begin_am2321(&sensors[i]);
+    begin[i] = deadline[i] = monotonic_ns();
+  }
+  active = i;
+  while (0 < active) {
+    for (min = -1, i = 0; i < options->sensors; i++) {
+      if (deadline[i] != 0 && (min == -1 || deadline[i] < deadline[min])) {
+        min = i;
+      }
+    }
+    if ((now = monotonic_ns()) < deadline[min]) {
+      usleep((deadline[min] - now) / 1000);
+    }
+    if (0 < (ret = step_am2321(&sensors[min]))) {
+      deadline[min] = monotonic_ns() + (uint64_t)ret * 1000;
+      continue;
+    }
+    result->failures += ret != 0;
+    now = monotonic_ns();
+    result->latency[result->samples++] = now - begin[min];
+    if (next < options->samples) {
+      next++;
+      begin_am2321(&sensors[min]);
+      begin[min] = deadline[min] = now;
+    } else {
+      deadline[min] = 0;
+      active--;
+    }
+  }
+  result->elapsed = monotonic_ns() - start;
+  result->syscalls = syscalls_mock_am2321() - syscalls;
+
+  for (i = 0; i < options->sensors; i++) {
+    close_am2321(&sensors[i]);
+  }
+  free(sensors);
+  free(begin);
+  free(deadline);
+}
+
+/*!
+ * @brief Measure the time from fork until the first output of the one-shot of the command.
+ *
+ * The state of the last conversion is saved fresh before each sample, as
+ * the last one-shot does, so the command prints it without the bus. The
+ * state is kept in the temporary AM2321_STATE_DIR, not to overwrite the
+ * state of the real AM2321.
+ */
+static void bench_startup(const struct bench_options *options, struct bench_result *result) {
+
+  char *argv[] = { (char *)options->command, "-F", "-j", NULL };
+  char dir[] = "/tmp/am2321-bench.XXXXXX", state[sizeof(dir) + 16];
+  struct am2321 am2321_data;
+  uint64_t begin, start;
+  char buf[256];
+  int i, fds[2], status, fd;
+  pid_t pid;
+  ssize_t len;
+
+  mock_bench(options, 0.0, 0.0);
+  if (mkdtemp(dir) == NULL) {
+    result->failures = options->samples;
+    return;
+  }
+  setenv("AM2321_STATE_DIR", dir, 1);
+  snprintf(state, sizeof(state), "%s/%d-%02x.state", dir, 1, AM2321_ID);
+  if (open_am2321(&am2321_data, 1, AM2321_ID, AM2321_VARIANT_AM2321, -1, 0) == -1 || measure_retry(&am2321_data) != 0) {
+    result->failures = options->samples;
+    close_am2321(&am2321_data);
+    unsetenv("AM2321_STATE_DIR");
+    rmdir(dir);
+    return;
+  }
+  close_am2321(&am2321_data);
+
+  start = monotonic_ns();
+  for (i = 0; i < options->samples; i++) {
+    am2321_data.timestamp = monotonic_ns();
+    if (save_state_am2321(&am2321_data) == -1 || pipe(fds) == -1) {
+      result->failures++;
+      continue;
+    }
+    begin = monotonic_ns();
+    if ((pid = fork()) == 0) {
+      dup2(fds[1], STDOUT_FILENO);
+      close(fds[0]);
+      close(fds[1]);
+      if ((fd = open("/dev/null", O_RDONLY)) != -1) {
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+      }
+      execv(argv[0], argv);
+      _exit(127);
+    }
+    close(fds[1]);
+    len = pid == -1 ? -1 : read(fds[0], buf, sizeof(buf));
+    result->latency[result->samples++] = monotonic_ns() - begin;
+    while (0 < len && 0 < (len = read(fds[0], buf, sizeof(buf))));
+    close(fds[0]);
+    if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      result->failures++;
+    }
+  }
+  result->elapsed = monotonic_ns() - start;
+  unsetenv("AM2321_STATE_DIR");
+  unlink(state);
+  rmdir(dir);
+}
+
+/*!
+ * @brief Measure the time from SIGTERM until the exit of the daemon with the unhealthy AM2321s.
+ *
+ * All transfers of the mock are NACKed, so the AM2321s are in the backoff,
+ * and the interleaved sweep of -I has none of them to measure. The daemon
+ * which crashes or does not exit by 0 is the failure. Its state and its
+ * calibrations are in the temporary directory.
+ */
+static void bench_shutdown(const struct bench_options *options, struct bench_result *result) {
+
+  char dir[] = "/tmp/am2321-bench.XXXXXX", config[sizeof(dir) + 16];
+  char *argv[] = { (char *)options->command, "-d", "-I", "-n", "-i", "2", "-f", config, NULL };
+  uint64_t begin, start;
+  int status, fd;
+  FILE *fp;
+  pid_t pid;
+
+  if (mkdtemp(dir) == NULL) {
+    result->failures = result->samples = 1;
+    return;
+  }
+  snprintf(config, sizeof(config), "%s/am2321.conf", dir);
+  if ((fp = fopen(config, "w")) == NULL) {
+    result->failures = result->samples = 1;
+    rmdir(dir);
+    return;
+  }
+  fprintf(fp, "s0 1 0x%02x\ns1 1 0x%02x 0x70 0\n", AM2321_ID, AM2321_ID);
+  fclose(fp);
+
+  start = monotonic_ns();
+  if ((pid = fork()) == 0) {
+    if ((fd = open("/dev/null", O_RDWR)) != -1) {
+      dup2(fd, STDIN_FILENO);
+      dup2(fd, STDOUT_FILENO);
+      close(fd);
+    }
+    setenv("AM2321_STATE_DIR", dir, 1);
+    setenv("AM2321_CALIBRATION_DIR", dir, 1);
+    setenv("AM2321_MOCK", "latency=0,nack=1", 1);
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  if (pid != -1) {
+    usleep(BENCH_UNHEALTHY);
+    kill(pid, SIGTERM);
+  }
+  begin = monotonic_ns();
+  if (pid == -1 || waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    result->failures++;
+  }
+  result->latency[result->samples++] = monotonic_ns() - begin;
+  result->elapsed = monotonic_ns() - start;
+  unlink(config);
+  rmdir(dir);
+}
+
+/*!
+ * @brief Make the valid frames with the values distributed over the range of AM2321.
+ */
+static char (*frames_bench(size_t n))[8] {
+
+  char (*frames)[8] = malloc(n * 8);
+  unsigned int seed = 1;
+  uint16_t crc;
+  size_t i;
+  int temp, hum;
+
+  for (i = 0; frames != NULL && i < n; i++) {
+    temp = rand_r(&seed) % 1201 - 400;
+    hum = rand_r(&seed) % 1001;
+    frames[i][0] = 0x03;
+    frames[i][1] = 0x04;
+    frames[i][2] = hum >> 8;
+    frames[i][3] = hum & 0xff;
+    frames[i][4] = ((temp < 0 ? -temp : temp) >> 8) | (temp < 0 ? 0x80 : 0);
+    frames[i][5] = (temp < 0 ? -temp : temp) & 0xff;
+    crc = crc16_modbus((const uint8_t *)frames[i], 6);
+    frames[i][6] = crc & 0xff;
+    frames[i][7] = crc >> 8;
+  }
+  return frames;
+}
+
+/*!
+ * @brief Print the time per frame of the function over the frames.
+ */
+static void print_frames(const char *name, uint64_t elapsed, size_t n, uint64_t sink) {
+
+  bench_sink += sink;
+  printf("%-24s %12.2f ns/frame %14.0f frames/s\n", name, (double)elapsed / n, n * 1e9 / elapsed);
+}
+
+/*!
+ * @brief Benchmark CRC-16 (Modbus) by bit, by byte and by slicing-by-4.
+ */
+static void bench_crc(void) {
+
+  static uint16_t (*const crcs[])(const uint8_t *, size_t) = {
+    crc16_modbus_bitwise, crc16_modbus_bytewise, crc16_modbus,
+  };
+  static const char *names[] = { "crc16_modbus_bitwise", "crc16_modbus_bytewise", "crc16_modbus" };
+  char (*frames)[8] = frames_bench(BENCH_FRAMES);
+  uint64_t begin, sink;
+  size_t i;
+  int f;
+
+  if (frames == NULL) {
+    return;
+  }
+  for (f = 0; f < 3; f++) {
+    sink = 0;
+    begin = monotonic_ns();
+    for (i = 0; i < BENCH_FRAMES; i++) {
+      sink += crcs[f]((const uint8_t *)frames[i], 6);
+    }
+    print_frames(names[f], monotonic_ns() - begin, BENCH_FRAMES, sink);
+  }
+  free(frames);
+}
+
+/*!
+ * @brief Benchmark the decode of the frames one by one, and in bulk.
+ */
+static void bench_decode(void) {
+
+  char (*frames)[8] = frames_bench(BENCH_FRAMES);
+  struct am2321 am2321_data;
+  struct am2321_bulk bulk;
+  uint64_t begin, sink = 0;
+  size_t i;
+
+  bulk.temperature = malloc(BENCH_FRAMES * sizeof(int16_t));
+  bulk.humidity = malloc(BENCH_FRAMES * sizeof(uint16_t));
+  bulk.discomfort = malloc(BENCH_FRAMES * sizeof(int16_t));
+  bulk.status = malloc(BENCH_FRAMES);
+  if (frames == NULL || bulk.temperature == NULL || bulk.humidity == NULL || bulk.discomfort == NULL || bulk.status == NULL) {
+    return;
+  }
+  // Not to count the page faults of the first touch.
+  memset(bulk.temperature, 0, BENCH_FRAMES * sizeof(int16_t));
+  memset(bulk.humidity, 0, BENCH_FRAMES * sizeof(uint16_t));
+  memset(bulk.discomfort, 0, BENCH_FRAMES * sizeof(int16_t));
+  memset(bulk.status, 0, BENCH_FRAMES);
+
+  begin = monotonic_ns();
+  for (i = 0; i < BENCH_FRAMES; i++) {
+    memcpy(am2321_data.register_data, frames[i], 8);
+    if (check_crc(&am2321_data) == 0 && check_err(&am2321_data) == 0) {
+      sink += calc_temp_x10(&am2321_data) + calc_hum_x10(&am2321_data) + calc_discomfort_x10(&am2321_data);
+    }
+  }
+  print_frames("check_crc + calc_*_x10", monotonic_ns() - begin, BENCH_FRAMES, sink);
+
+  begin = monotonic_ns();
+  sink = decode_bulk_am2321((const char (*)[8])frames, BENCH_FRAMES, &bulk);
+  print_frames("decode_bulk_am2321", monotonic_ns() - begin, BENCH_FRAMES, sink + bulk.discomfort[BENCH_FRAMES - 1]);
+
+  free(frames);
+  free(bulk.temperature);
+  free(bulk.humidity);
+  free(bulk.discomfort);
+  free(bulk.status);
+}
+
+/*!
+ * @brief Print the usage of the benchmark.
+ */
+static void print_help(void) {
+
+  printf("Usage: am2321-bench [OPTION]\n");
+  printf("Benchmark libam2321 on the simulated AM2321s. (am2321-mock.c)\n");
+  printf("\n");
+  printf("  -m, --mode=MODE      oneshot, session, pipelined, retry, startup, shutdown, crc, decode or all. (default all)\n");
+  printf("  -n, --samples=N      Samples of each mode of the measurement. (default 200)\n");
+  printf("  -s, --sensors=N      Sensors measured at once in the pipelined mode. (default 4)\n");
+  printf("  -l, --latency=USEC   Latency of each transfer. (default the time on the bus of 100kHz)\n");
+  printf("  -N, --nack=RATE      Rate of the NACKs in the retry mode. (default 0.05)\n");
+  printf("  -C, --crc=RATE       Rate of the broken frames in the retry mode. (default 0.02)\n");
+  printf("  -x, --command=PATH   The command of the startup and shutdown modes. (default am2321 next to am2321-bench)\n");
+  printf("                       The state of the last conversion is kept in a temporary AM2321_STATE_DIR.\n");
+  printf("  -v, --verbose        Print the messages of libam2321.\n");
+  printf("  -h, --help           Print this help.\n");
+}
+
+static const struct option long_options[] = {
+  { "mode",    required_argument, NULL, 'm' },
+  { "samples", required_argument, NULL, 'n' },
+  { "sensors", required_argument, NULL, 's' },
+  { "latency", required_argument, NULL, 'l' },
+  { "nack",    required_argument, NULL, 'N' },
+  { "crc",     required_argument, NULL, 'C' },
+  { "command", required_argument, NULL, 'x' },
+  { "verbose", no_argument,       NULL, 'v' },
+  { "help",    no_argument,       NULL, 'h' },
+  { NULL, 0, NULL, 0 },
+};
+
+int main(int argc, char* argv[]) {
+
+  static const char *modes[] = { "oneshot", "session", "pipelined", "retry", "startup", "shutdown" };
+  struct bench_options options = { 200, 4, AM2321_MOCK_BUS_TIME, 0.05, 0.02, NULL };
+  struct bench_result result;
+  const char *mode = "all";
+  char path[4096], command[4096 + 8];
+  int opt, verbose = 0, header = 1, i, fd;
+
+  while ((opt = getopt_long(argc, argv, "m:n:s:l:N:C:x:vh", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'm':
+        mode = optarg;
+        break;
+      case 'n':
+        options.samples = atoi(optarg);
+        break;
+      case 's':
+        options.sensors = atoi(optarg);
+        break;
+      case 'l':
+        options.latency = atoi(optarg);
+        break;
+      case 'N':
+        options.nack = atof(optarg);
+        break;
+      case 'C':
+        options.crc = atof(optarg);
+        break;
+      case 'x':
+        options.command = optarg;
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      case 'h':
+        print_help();
+        return 0;
+      default:
+        print_help();
+        return 1;
+    }
+  }
+  if (options.samples <= 0 || options.sensors <= 0) {
+    fprintf(stderr, "am2321-bench : The samples and the sensors must be positive.\n");
+    return 1;
+  }
+  if (options.command == NULL) {
+    snprintf(path, sizeof(path), "%s", argv[0]);
+    snprintf(command, sizeof(command), "%s/am2321", dirname(path));
+    options.command = command;
+  }
+  // The messages of the failures injected are not the result.
+  if (!verbose && (fd = open("/dev/null", O_WRONLY)) != -1) {
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+  }
+
+  if ((result.latency = malloc(options.samples * sizeof(uint64_t))) == NULL) {
+    return 1;
+  }
+  for (i = 0; i < (int)(sizeof(modes) / sizeof(modes[0])); i++) {
+    if (strcmp(mode, "all") != 0 && strcmp(mode, modes[i]) != 0) {
+      continue;
+    }
+    if (header) {
+      printf("%-10s %8s %12s %12s %12s %12s %8s\n", "mode", "samples", "samples/s", "p50(usec)", "p99(usec)", "syscalls", "failures");
+      header = 0;
+    }
+    memset(result.latency, 0, options.samples * sizeof(uint64_t));
+    result.samples = result.failures = 0;
+    result.elapsed = result.syscalls = 0;
+    switch (i) {
+      case 0:
+        bench_oneshot(&options, &result);
+        break;
+      case 1:
+        bench_session(&options, &result, 0);
+        break;
+      case 2:
+        bench_pipelined(&options, &result);
+        break;
+      case 3:
+        bench_session(&options, &result, 1);
+        break;
+      case 4:
+        bench_startup(&options, &result);
+        break;
+      case 5:
+        bench_shutdown(&options, &result);
+        break;
+    }
+    print_bench(modes[i], &result);
+  }
+  free(result.latency);
+
+  if (strcmp(mode, "all") == 0 || strcmp(mode, "crc") == 0) {
+    bench_crc();
+  }
+  if (strcmp(mode, "all") == 0 || strcmp(mode, "decode") == 0) {
+    bench_decode();
+  }
+  return 0;
+}